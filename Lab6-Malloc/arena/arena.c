@@ -0,0 +1,317 @@
+/*
+ * arena.c - per-thread arenas on top of the mspaces of dlmalloc 2.8.6
+ * 
+ *     With USE_LOCKS, every dlmalloc call takes the lock of its mspace,
+ * so threads that share a heap are serialized. Here each thread gets an
+ * mspace of its own that only it allocates from, and malloc.c is built
+ * without locks. FOOTERS makes every chunk record its mspace, and the
+ * mspace records its arena in the spare extp field, so free can find the
+ * owner of any pointer.
+ * 
+ *     A thread frees its own chunks directly. A chunk of another arena
+ * is pushed on that arena's return queue instead: a lock-free stack that
+ * any thread may push to (compare and swap on the head, the link lives in
+ * the dead payload), and that only the owner empties by swapping the head
+ * for NULL, which avoids the ABA problem. The owner drains the queue on
+ * its next allocation, so a producer that hands its blocks to consumers
+ * gets them back without ever taking a lock.
+ * 
+ *     Arenas are never destroyed. When a thread exits its arena is drained
+ * and goes back to the pool, and the next new thread adopts it along with
+ * any frees that were queued in the meantime. Only creating and adopting
+ * arenas takes the pool mutex.
+ * 
+ *     In huge page mode (arena_set_huge) the granularity is 2MB, so every
+ * segment dlmalloc asks for is a multiple of 2MB. The MMAP hook maps such
+ * segments 2MB aligned and advises MADV_HUGEPAGE on them, so the kernel
+ * can back a big heap with few TLB entries. The mmap threshold goes up at
+ * the same time, so large chunks also live in those segments rather than 
+ * in mappings of their own. Without transparent huge pages the mode is
+ * refused and the arenas keep using normal pages.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdint.h>
+
+static void *arena_mmap(size_t size);
+
+#define ONLY_MSPACES 1
+#define USE_LOCKS 0
+#define FOOTERS 1
+#define MMAP(s) arena_mmap(s)
+#define DIRECT_MMAP(s) arena_mmap(s)
+#include "../malloc.c"
+
+#include "arena.h"
+
+/* One per mspace, allocated from that mspace */
+typedef struct arena {
+    mspace msp;            /* the dlmalloc heap of this arena */
+    void *remote;          /* return queue of chunks freed by other threads */
+    struct arena *next;    /* next arena in the pool */
+    int owned;             /* does a live thread own this arena? */
+    size_t remote_frees;   /* frees other threads queued to this arena */
+    size_t drained;        /* queued frees this arena has released */
+} arena_t;
+
+/* The pool of all arenas */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static arena_t *pool = NULL;
+
+/* Huge page mode */
+#define HUGE_SIZE (2 * 1024 * 1024)            /* size of a huge page */
+#define HUGE_MMAP_THRESHOLD (64 * 1024 * 1024) /* mmap threshold in that mode */
+#define THP_ENABLED "/sys/kernel/mm/transparent_hugepage/enabled"
+static int huge_pages = 0;
+
+/* The arena of the calling thread */
+static __thread arena_t *my_arena = NULL;
+
+/* Function prototypes for internal helper routines */
+static arena_t *arena_get(void);
+static void arena_release(void *arg);
+static void arena_key(void);
+static void drain(arena_t *a);
+static void remote_push(arena_t *a, void *mem);
+
+/* 
+ * arena_malloc - allocate from the arena of the calling thread, after
+ *     taking back what other threads have freed to it
+ */
+void *arena_malloc(size_t size)
+{
+    arena_t *a = arena_get();
+
+    if (a == NULL)
+	return NULL;
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) != NULL)
+	drain(a);
+    return mspace_malloc(a->msp, size);
+}
+
+void *arena_calloc(size_t n, size_t size)
+{
+    arena_t *a = arena_get();
+
+    if (a == NULL)
+	return NULL;
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) != NULL)
+	drain(a);
+    return mspace_calloc(a->msp, n, size);
+}
+
+/* 
+ * arena_free - free a chunk of our own arena, or queue it to its owner
+ */
+void arena_free(void *ptr)
+{
+    mstate m;
+    arena_t *owner;
+
+    if (ptr == NULL)
+	return;
+    m = get_mstate_for(mem2chunk(ptr));
+    owner = (arena_t *)m->extp;
+    if (owner == my_arena) {
+	mspace_free(owner->msp, ptr);
+	return;
+    }
+    remote_push(owner, ptr);
+}
+
+/* 
+ * arena_realloc - resize in our own arena, a chunk of another arena is
+ *     copied into ours and queued back to its owner
+ */
+void *arena_realloc(void *ptr, size_t size)
+{
+    arena_t *a;
+    void *newptr;
+    size_t copy;
+
+    if (ptr == NULL)
+	return arena_malloc(size);
+    if (size == 0) {
+	arena_free(ptr);
+	return NULL;
+    }
+    if ((a = arena_get()) == NULL)
+	return NULL;
+    if ((arena_t *)get_mstate_for(mem2chunk(ptr))->extp == a)
+	return mspace_realloc(a->msp, ptr, size);
+
+    if ((newptr = arena_malloc(size)) == NULL)
+	return NULL;
+    copy = mspace_usable_size(ptr);
+    memcpy(newptr, ptr, copy < size ? copy : size);
+    arena_free(ptr);
+    return newptr;
+}
+
+/* 
+ * arena_stats - sum the counters of all arenas, the numbers of other 
+ *     threads are read without synchronization and may be slightly stale
+ */
+void arena_stats(arena_stats_t *stats)
+{
+    arena_t *a;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&pool_lock);
+    for (a = pool; a != NULL; a = a->next) {
+	stats->arenas++;
+	stats->owned += a->owned;
+	stats->remote_frees += a->remote_frees;
+	stats->drained += a->drained;
+	stats->footprint += mspace_footprint(a->msp);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * arena_set_huge - switch huge page mode on or off, call it before the 
+ *     first allocation. Returns -1 if transparent huge pages are not 
+ *     available, in which case nothing changes.
+ */
+int arena_set_huge(int enable)
+{
+    FILE *fp;
+    char buf[128];
+
+    if (enable) {
+	if ((fp = fopen(THP_ENABLED, "r")) == NULL)
+	    return -1;
+	if (fgets(buf, sizeof(buf), fp) == NULL || strstr(buf, "[never]")) {
+	    fclose(fp);
+	    return -1;
+	}
+	fclose(fp);
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    huge_pages = enable;
+    mspace_mallopt(M_GRANULARITY, enable ? HUGE_SIZE : DEFAULT_GRANULARITY);
+    mspace_mallopt(M_MMAP_THRESHOLD, 
+		   enable ? HUGE_MMAP_THRESHOLD : DEFAULT_MMAP_THRESHOLD);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+/*
+ * arena_get - return the arena of the calling thread, adopting a free 
+ *     arena from the pool or creating one on the first call
+ */
+static arena_t *arena_get(void)
+{
+    arena_t *a;
+    mspace msp;
+
+    if (my_arena != NULL)
+	return my_arena;
+
+    pthread_once(&pool_once, arena_key);
+    pthread_mutex_lock(&pool_lock);
+    for (a = pool; a != NULL && a->owned; a = a->next)
+	;
+    if (a == NULL) {
+	/* malloc.c is not locked, so create mspaces under the pool lock */
+	if ((msp = create_mspace(0, 0)) == NULL ||
+	    (a = mspace_malloc(msp, sizeof(arena_t))) == NULL) {
+	    pthread_mutex_unlock(&pool_lock);
+	    return NULL;
+	}
+	memset(a, 0, sizeof(arena_t));
+	a->msp = msp;
+	((mstate)msp)->extp = a;
+	a->next = pool;
+	pool = a;
+    }
+    a->owned = 1;
+    pthread_mutex_unlock(&pool_lock);
+
+    my_arena = a;
+    pthread_setspecific(pool_key, a);
+    return a;
+}
+
+/*
+ * arena_release - thread exit, give the arena back to the pool
+ */
+static void arena_release(void *arg)
+{
+    arena_t *a = (arena_t *)arg;
+
+    drain(a);
+    my_arena = NULL;
+    pthread_mutex_lock(&pool_lock);
+    a->owned = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void arena_key(void)
+{
+    pthread_key_create(&pool_key, arena_release);
+}
+
+/*
+ * drain - release the chunks that other threads queued to arena a, 
+ *     only called by the owner of a
+ */
+static void drain(arena_t *a)
+{
+    void *p, *next;
+
+    p = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    while (p != NULL) {
+	next = *(void **)p;
+	mspace_free(a->msp, p);
+	a->drained++;
+	p = next;
+    }
+}
+
+/*
+ * arena_mmap - MMAP for dlmalloc, in huge page mode a whole number of 
+ *     huge pages is mapped on a huge page boundary: map one huge page 
+ *     more, and unmap the excess at both ends
+ */
+static void *arena_mmap(size_t size)
+{
+    char *p;
+    size_t lead;
+
+    if (!huge_pages || size % HUGE_SIZE != 0)
+	return mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+		    -1, 0);
+
+    p = mmap(0, size + HUGE_SIZE, PROT_READ|PROT_WRITE, 
+	     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+	return p;
+    lead = (HUGE_SIZE - (uintptr_t)p % HUGE_SIZE) % HUGE_SIZE;
+    if (lead != 0)
+	munmap(p, lead);
+    munmap(p + lead + size, HUGE_SIZE - lead);
+    p += lead;
+
+    /* Only a hint, fails harmlessly if the kernel has no THP */
+    madvise(p, size, MADV_HUGEPAGE);
+    return p;
+}
+
+/*
+ * remote_push - queue the chunk mem to the owner arena a
+ */
+static void remote_push(arena_t *a, void *mem)
+{
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+
+    do {
+	*(void **)mem = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, mem, 1,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&a->remote_frees, 1, __ATOMIC_RELAXED);
+}
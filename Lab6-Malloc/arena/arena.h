@@ -0,0 +1,20 @@
+/*
+ * arena.h - per-thread dlmalloc arenas
+ */
+#include <stddef.h>
+
+/* Counters summed over all arenas, see arena_stats */
+typedef struct {
+    size_t arenas;        /* mspaces created so far */
+    size_t owned;         /* arenas that belong to a live thread */
+    size_t remote_frees;  /* frees queued to the arena of another thread */
+    size_t drained;       /* queued frees released by the owners */
+    size_t footprint;     /* bytes obtained from the system */
+} arena_stats_t;
+
+extern void *arena_malloc(size_t size);
+extern void *arena_calloc(size_t n, size_t size);
+extern void arena_free(void *ptr);
+extern void *arena_realloc(void *ptr, size_t size);
+extern void arena_stats(arena_stats_t *stats);
+extern int arena_set_huge(int enable);
@@ -0,0 +1,303 @@
+/*
+ * arenabench.c - multithreaded stress test and benchmark for the arenas
+ * 
+ *     Runs one of two patterns on several threads and reports the 
+ * throughput of the arenas, of one dlmalloc mspace behind a global lock 
+ * (what USE_LOCKS gives), and of libc malloc:
+ * 
+ *   local     every thread allocates and frees its own blocks
+ *   prodcons  threads come in pairs, the producer allocates and fills
+ *             blocks and hands them over a ring to the consumer, which
+ *             checks and frees them, so every free is a cross-thread free
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+#define ONLY_MSPACES 1
+#include "../malloc.h"
+#include "arena.h"
+
+#define SLOTS 1024          /* live blocks per thread in the local pattern */
+#define RING  4096          /* blocks in flight per producer/consumer pair */
+
+/* The allocator under test */
+typedef struct {
+    char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+} bench_alloc_t;
+
+/* Single producer, single consumer ring */
+typedef struct {
+    void *slot[RING];
+    volatile size_t head;   /* written by the producer */
+    volatile size_t tail;   /* written by the consumer */
+} ring_t;
+
+/* Arguments of one thread */
+typedef struct {
+    int id;
+    ring_t *ring;           /* prodcons: shared with the partner */
+    unsigned seed;
+} worker_t;
+
+/* Global parameters */
+static bench_alloc_t *alloc;
+static long nops = 1000000;       /* operations per thread */
+static size_t maxsize = 512;      /* largest block */
+static pthread_barrier_t start;
+static int errors = 0;
+
+/* The locked baseline */
+static mspace global_msp;
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *locked_malloc(size_t size)
+{
+    void *p;
+
+    pthread_mutex_lock(&global_lock);
+    p = mspace_malloc(global_msp, size);
+    pthread_mutex_unlock(&global_lock);
+    return p;
+}
+
+static void locked_free(void *ptr)
+{
+    pthread_mutex_lock(&global_lock);
+    mspace_free(global_msp, ptr);
+    pthread_mutex_unlock(&global_lock);
+}
+
+static bench_alloc_t allocs[] = {
+    {"arena", arena_malloc, arena_free},
+    {"locked", locked_malloc, locked_free},
+    {"libc", malloc, free},
+};
+#define NALLOCS (int)(sizeof(allocs) / sizeof(allocs[0]))
+
+/*
+ * randsize - mostly small blocks, sometimes up to maxsize
+ */
+static size_t randsize(unsigned *seed)
+{
+    unsigned r = rand_r(seed);
+
+    if (r % 8 != 0)
+	return 8 + (r >> 3) % 120;
+    return 8 + (r >> 3) % maxsize;
+}
+
+/*
+ * local - each thread frees only what it allocated
+ */
+static void *local(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    char *slot[SLOTS];
+    long i;
+    int k;
+    size_t size;
+
+    memset(slot, 0, sizeof(slot));
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nops; i++) {
+	k = rand_r(&w->seed) % SLOTS;
+	if (slot[k] != NULL) {
+	    alloc->free(slot[k]);
+	    slot[k] = NULL;
+	}
+	else {
+	    size = randsize(&w->seed);
+	    if ((slot[k] = alloc->malloc(size)) == NULL) {
+		__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+		break;
+	    }
+	    slot[k][0] = slot[k][size-1] = (char)k;
+	}
+    }
+    for (k = 0; k < SLOTS; k++)
+	alloc->free(slot[k]);
+    return NULL;
+}
+
+/*
+ * producer - allocate blocks tagged with their sequence number and 
+ *     hand them to the consumer, spin while the ring is full
+ */
+static void *producer(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    ring_t *r = w->ring;
+    long i;
+    size_t size;
+    long *p;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nops; i++) {
+	size = randsize(&w->seed);
+	if (size < sizeof(long))
+	    size = sizeof(long);
+	if ((p = alloc->malloc(size)) == NULL) {
+	    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+	    p = NULL;
+	}
+	else
+	    *p = i;
+	while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING)
+	    sched_yield();
+	r->slot[r->head % RING] = p;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * consumer - check and free the blocks of the partner
+ */
+static void *consumer(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    ring_t *r = w->ring;
+    long i;
+    long *p;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nops; i++) {
+	while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail)
+	    sched_yield();
+	p = r->slot[r->tail % RING];
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+	if (p != NULL && *p != i)
+	    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+	alloc->free(p);
+    }
+    return NULL;
+}
+
+/*
+ * run - time one pattern on nthreads threads, return ops per second
+ */
+static double run(int prodcons, int nthreads)
+{
+    pthread_t *tid;
+    worker_t *w;
+    ring_t *rings = NULL;
+    struct timespec t0, t1;
+    int i;
+
+    tid = calloc(nthreads, sizeof(pthread_t));
+    w = calloc(nthreads, sizeof(worker_t));
+    if (prodcons)
+	rings = calloc(nthreads / 2, sizeof(ring_t));
+    if (tid == NULL || w == NULL || (prodcons && rings == NULL)) {
+	fprintf(stderr, "arenabench: out of memory\n");
+	exit(1);
+    }
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+	w[i].id = i;
+	w[i].seed = i + 1;
+	if (prodcons) {
+	    w[i].ring = &rings[i / 2];
+	    pthread_create(&tid[i], NULL, i % 2 ? consumer : producer, &w[i]);
+	}
+	else
+	    pthread_create(&tid[i], NULL, local, &w[i]);
+    }
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tid[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_barrier_destroy(&start);
+
+    free(tid);
+    free(w);
+    free(rings);
+    return nops * nthreads /
+	((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: arenabench [-h] [-a <alloc>] [-p <pattern>] "
+	    "[-t <threads>] [-n <ops>] [-s <size>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <alloc>    arena, locked or libc (default all).\n");
+    fprintf(stderr, "\t-p <pattern>  local or prodcons (default both).\n");
+    fprintf(stderr, "\t-t <threads>  Number of threads, even (default 4).\n");
+    fprintf(stderr, "\t-n <ops>      Operations per thread (default 1000000).\n");
+    fprintf(stderr, "\t-s <size>     Largest block (default 512).\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, p;
+    int nthreads = 4;
+    char *only_alloc = NULL, *only_pattern = NULL;
+    static char *patterns[] = {"local", "prodcons"};
+    arena_stats_t st;
+
+    while ((c = getopt(argc, argv, "ha:p:t:n:s:")) != EOF) {
+	switch (c) {
+	case 'a':
+	    only_alloc = optarg;
+	    break;
+	case 'p':
+	    only_pattern = optarg;
+	    break;
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'n':
+	    nops = atol(optarg);
+	    break;
+	case 's':
+	    maxsize = atol(optarg);
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (nthreads < 2 || nthreads % 2 != 0 || nops <= 0 || maxsize < 8) {
+	usage();
+	exit(1);
+    }
+    global_msp = create_mspace(0, 0);
+
+    printf("%d threads, %ld ops per thread, blocks up to %lu bytes\n",
+	   nthreads, nops, (unsigned long)maxsize);
+    printf("%-10s%-10s%12s\n", "pattern", "alloc", "Mops/s");
+    for (p = 0; p < 2; p++) {
+	if (only_pattern && strcmp(only_pattern, patterns[p]))
+	    continue;
+	for (i = 0; i < NALLOCS; i++) {
+	    if (only_alloc && strcmp(only_alloc, allocs[i].name))
+		continue;
+	    alloc = &allocs[i];
+	    printf("%-10s%-10s%12.2f\n", patterns[p], alloc->name,
+		   run(p, nthreads) / 1e6);
+	}
+    }
+
+    arena_stats(&st);
+    printf("arenas %lu (owned %lu), remote frees %lu, drained %lu, "
+	   "footprint %luKB\n", (unsigned long)st.arenas, 
+	   (unsigned long)st.owned, (unsigned long)st.remote_frees, 
+	   (unsigned long)st.drained, (unsigned long)st.footprint/1024);
+    if (errors) {
+	printf("Terminated with %d errors\n", errors);
+	exit(1);
+    }
+    exit(0);
+}
@@ -0,0 +1,217 @@
+/*
+ * hugebench.c - the arenas with normal pages and with huge pages on a
+ *     working set that is much larger than the reach of the TLB
+ * 
+ *     Each mode runs in a child process of its own, since the page mode 
+ * must be chosen before the first allocation. A child fills the working
+ * set with small blocks, links them in random order, and chases the 
+ * links. It reports the allocation throughput, the time per access, the 
+ * dTLB load misses per access (from a perf counter, if the kernel lets 
+ * us open one), and how much of its memory the kernel backed with huge 
+ * pages.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "arena.h"
+
+static size_t wsmb = 512;       /* working set in MB */
+static long naccess = 20000000; /* number of links to follow */
+static size_t maxsize = 256;    /* largest block */
+static void *volatile sink;     /* keeps the chase from being optimized out */
+
+/*
+ * seconds - monotonic time in seconds
+ */
+static double seconds(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * dtlb_open - open a counter of dTLB load misses of this process in 
+ *     user mode, -1 if there is no such counter
+ */
+static int dtlb_open(void)
+{
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_DTLB |
+	(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+/*
+ * anon_huge_kb - the AnonHugePages of this process, in KB
+ */
+static long anon_huge_kb(void)
+{
+    FILE *fp;
+    char line[256];
+    long kb = -1;
+
+    if ((fp = fopen("/proc/self/smaps_rollup", "r")) == NULL)
+	return -1;
+    while (fgets(line, sizeof(line), fp) != NULL)
+	if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+	    break;
+    fclose(fp);
+    return kb;
+}
+
+/*
+ * run - one mode, in the child process
+ */
+static void run(int huge)
+{
+    void **blocks, **p;
+    size_t n, max, i, j, size, total = 0;
+    unsigned seed = 1;
+    double t0, talloc, tchase;
+    long long misses = -1;
+    int fd;
+    arena_stats_t st;
+
+    if (huge && arena_set_huge(1) < 0) {
+	printf("%-8s transparent huge pages unavailable\n", "huge");
+	return;
+    }
+
+    /* Allocate the working set */
+    max = wsmb * 1024 * 1024 / 16;
+    if ((blocks = malloc(max * sizeof(void *))) == NULL) {
+	fprintf(stderr, "hugebench: out of memory\n");
+	exit(1);
+    }
+    t0 = seconds();
+    for (n = 0; total < wsmb * 1024 * 1024 && n < max; n++) {
+	size = sizeof(void *) + rand_r(&seed) % (maxsize - sizeof(void *));
+	if ((blocks[n] = arena_malloc(size)) == NULL) {
+	    fprintf(stderr, "hugebench: arena_malloc failed\n");
+	    exit(1);
+	}
+	total += size;
+    }
+    talloc = seconds() - t0;
+
+    /* Link the blocks in random order (shuffle, then chain) */
+    for (i = n - 1; i > 0; i--) {
+	j = ((size_t)rand_r(&seed) << 16 ^ rand_r(&seed)) % (i + 1);
+	p = blocks[i];
+	blocks[i] = blocks[j];
+	blocks[j] = p;
+    }
+    for (i = 0; i < n; i++)
+	*(void **)blocks[i] = blocks[(i + 1) % n];
+
+    /* Chase the links */
+    fd = dtlb_open();
+    if (fd >= 0) {
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    p = blocks[0];
+    t0 = seconds();
+    for (i = 0; i < (size_t)naccess; i++)
+	p = *p;
+    tchase = seconds() - t0;
+    sink = p;
+    if (fd >= 0) {
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+	    misses = -1;
+	close(fd);
+    }
+
+    arena_stats(&st);
+    printf("%-8s%10.2f%10.1f", huge ? "huge" : "normal", 
+	   n / talloc / 1e6, tchase / naccess * 1e9);
+    if (misses >= 0)
+	printf("%12.3f", (double)misses / naccess);
+    else
+	printf("%12s", "n/a");
+    printf("%12lu%12ld\n", (unsigned long)st.footprint / 1024, 
+	   anon_huge_kb());
+
+    for (i = 0; i < n; i++)
+	arena_free(blocks[i]);
+    free(blocks);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: hugebench [-h] [-m <MB>] [-n <accesses>] "
+	    "[-s <size>] [-M normal|huge]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-m <MB>        Working set (default 512).\n");
+    fprintf(stderr, "\t-n <accesses>  Links to follow (default 20000000).\n");
+    fprintf(stderr, "\t-s <size>      Largest block (default 256).\n");
+    fprintf(stderr, "\t-M <mode>      Run only one page mode.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, mode;
+    char *only = NULL;
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "hm:n:s:M:")) != EOF) {
+	switch (c) {
+	case 'm':
+	    wsmb = atol(optarg);
+	    break;
+	case 'n':
+	    naccess = atol(optarg);
+	    break;
+	case 's':
+	    maxsize = atol(optarg);
+	    break;
+	case 'M':
+	    only = optarg;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (wsmb == 0 || naccess <= 0 || maxsize <= sizeof(void *)) {
+	usage();
+	exit(1);
+    }
+
+    printf("%luMB working set, %ld accesses, blocks up to %lu bytes\n",
+	   (unsigned long)wsmb, naccess, (unsigned long)maxsize);
+    printf("%-8s%10s%10s%12s%12s%12s\n", "mode", "Mallocs/s", "ns/access",
+	   "dTLB/access", "heap(KB)", "huge(KB)");
+    fflush(stdout);
+    for (mode = 0; mode < 2; mode++) {
+	if (only && strcmp(only, mode ? "huge" : "normal"))
+	    continue;
+	if ((pid = fork()) == 0) {
+	    run(mode);
+	    exit(0);
+	}
+	waitpid(pid, NULL, 0);
+    }
+    exit(0);
+}
@@ -0,0 +1,107 @@
+/*
+ * dlmm.c - the bundled dlmalloc 2.8.6 as a contender for mdriver
+ * 
+ *     malloc.c is compiled here with ONLY_MSPACES, so it defines no malloc
+ * of its own and does not clash with libc. The "system" memory of the one
+ * mspace comes from memlib: MMAP carves pages off the top of the memlib
+ * heap with mem_sbrk, and MUNMAP gives them back when they are at the top.
+ * That keeps dlmalloc's payloads inside the heap that mdriver checks, and
+ * its footprint is measured with the same mem_peak_footprint as mm.c.
+ * 
+ *     Chunks are never mapped directly (the mmap threshold is infinite) and
+ * mremap is off, since neither works on memlib pages.
+ * 
+ *     The batch calls map to independent_comalloc, which carves all the
+ * blocks from one chunk, and to bulk_free.
+ */
+#include "memlib.h"
+
+static void *dl_mmap(size_t size);
+static int dl_munmap(void *addr, size_t size);
+
+#define ONLY_MSPACES 1
+#define USE_LOCKS 0
+#define HAVE_MORECORE 0
+#define HAVE_MREMAP 0
+#define MMAP(s) dl_mmap(s)
+#define DIRECT_MMAP(s) dl_mmap(s)
+#define MUNMAP(a, s) dl_munmap((a), (s))
+#define DEFAULT_MMAP_THRESHOLD ((size_t)-1)
+#include "../malloc.c"
+
+#include "dlmm.h"
+
+/* the mspace for the current trace, lives at the bottom of the memlib heap */
+static mspace dl_msp = NULL;
+
+/* the sizes array that independent_comalloc wants, from libc */
+static size_t *dl_sizes = NULL;
+static size_t dl_nsizes = 0;
+
+/*
+ * dl_init - create a fresh mspace, the memlib heap must have been reset
+ */
+int dl_init(void)
+{
+    if ((dl_msp = create_mspace(0, 0)) == NULL)
+        return -1;
+    return 0;
+}
+
+void *dl_malloc(size_t size)
+{
+    return mspace_malloc(dl_msp, size);
+}
+
+void dl_free(void *ptr)
+{
+    mspace_free(dl_msp, ptr);
+}
+
+void *dl_realloc(void *ptr, size_t size)
+{
+    return mspace_realloc(dl_msp, ptr, size);
+}
+
+/*
+ * dl_malloc_batch - n blocks of size bytes in one independent_comalloc, return n or 0
+ */
+size_t dl_malloc_batch(size_t n, size_t size, void **ptrs)
+{
+    size_t i;
+
+    if (n > dl_nsizes) {
+	if ((dl_sizes = realloc(dl_sizes, n * sizeof(size_t))) == NULL)
+	    return 0;
+	dl_nsizes = n;
+    }
+    for (i = 0; i < n; i++)
+	dl_sizes[i] = size;
+    return mspace_independent_comalloc(dl_msp, n, dl_sizes, ptrs) ? n : 0;
+}
+
+void dl_free_batch(size_t n, void **ptrs)
+{
+    mspace_bulk_free(dl_msp, ptrs, n);
+}
+
+/*
+ * dl_mmap - MMAP for dlmalloc, take size bytes from the top of the memlib heap
+ */
+static void *dl_mmap(size_t size)
+{
+    void *p = mem_sbrk((int)size);
+
+    return p == (void *)-1 ? MFAIL : p;
+}
+
+/*
+ * dl_munmap - MUNMAP for dlmalloc, only the top of the memlib heap can be released
+ */
+static int dl_munmap(void *addr, size_t size)
+{
+    if ((char *)addr + size != (char *)mem_heap_hi() + 1)
+        return -1;
+    mem_sbrk(-(int)size);
+    return 0;
+}
@@ -0,0 +1,12 @@
+/*
+ * dlmm.h - the bundled dlmalloc 2.8.6 (../malloc.c) as a contender for mdriver,
+ *          drawing its memory from the memlib heap
+ */
+#include <stdio.h>
+
+extern int dl_init(void);
+extern void *dl_malloc(size_t size);
+extern void dl_free(void *ptr);
+extern void *dl_realloc(void *ptr, size_t size);
+extern size_t dl_malloc_batch(size_t n, size_t size, void **ptrs);
+extern void dl_free_batch(size_t n, void **ptrs);
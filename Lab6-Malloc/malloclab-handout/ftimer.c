@@ -7,8 +7,10 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_samples: times every run with CLOCK_MONOTONIC_RAW
  */
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include "ftimer.h"
 
@@ -52,6 +54,24 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     return (1E-3*diff);
 }
 
+/* 
+ * ftimer_samples - Time each of n runs of f(argp) with the raw monotonic
+ * clock (not slewed by NTP) into samples[], after one untimed warm-up run.
+ */
+void ftimer_samples(ftimer_test_funct f, void *argp, int n, double *samples)
+{
+    int i;
+    struct timespec stv, etv;
+
+    f(argp);
+    for (i = 0; i < n; i++) {
+	clock_gettime(CLOCK_MONOTONIC_RAW, &stv);
+	f(argp);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &etv);
+	samples[i] = (etv.tv_sec - stv.tv_sec) + 1E-9*(etv.tv_nsec - stv.tv_nsec);
+    }
+}
+
 
 /*
  * Routines for manipulating the Unix interval timer
@@ -12,3 +12,6 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+/* Time each of n runs of f(argp) with CLOCK_MONOTONIC_RAW into samples[] */
+void ftimer_samples(ftimer_test_funct f, void *argp, int n, double *samples);
+
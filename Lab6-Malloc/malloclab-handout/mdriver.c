@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for sched_setaffinity */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,10 +16,15 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <math.h>
+#include <sched.h>
+#include <sys/wait.h>
 
 #include "mm.h"
+#include "dlmm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "ftimer.h"
 #include "config.h"
 
 /**********************
@@ -27,6 +33,11 @@
 
 /* Misc */
 #define MAXLINE     1024 /* max string size */
+#define STREAM_OPS (1<<16) /* requests in the window of a streamed trace */
+#define STREAM_MIN (1<<20) /* always stream traces with more requests */
+#define STREAM_RUNS 3      /* timed runs of a streamed trace without -K */
+#define CLOCK_READS 1024  /* clock reads per batch timed to measure ... */
+#define CLOCK_BATCHES 16  /* ... their cost, and the number of batches */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
@@ -37,18 +48,29 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload, in a treap (a binary 
+ * search tree by address that is also a heap by random priority), so
+ * that checking and removing a payload take O(log n)
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* payloads at lower addresses */
+    struct range_t *right; /* payloads at higher addresses */
+    unsigned prio;         /* treap priority */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* 
+ * Characterizes a single trace operation (allocator request). A batch
+ * request covers the ids index .. index+count-1; it is written 
+ * "A id count size" (allocate) or "F id count" (free) in a trace file.
+ */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, ALLOC_BATCH, FREE_BATCH} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int count;                        /* number of blocks of a batch request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -56,12 +78,32 @@ typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
+    int num_blocks;      /* requests counting a batch once per block */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests, or a window of them ... */
+    FILE *opfile;        /* ... on the requests in binary, if streamed */
+    int op_pos;          /* next request in ops */
+    int op_len;          /* number of requests in ops */
+    double io_secs;      /* time next_op spent reading windows this pass */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
 
+/* 
+ * The entry points of a malloc package that runs in the memlib heap,
+ * so that the mm package can be measured against another allocator
+ */
+typedef struct {
+    char *name;                          /* name used in messages */
+    int (*init)(void);                   /* called after each heap reset */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    size_t (*malloc_batch)(size_t n, size_t size, void **ptrs);
+    void (*free_batch)(size_t n, void **ptrs);
+    int is_mm;                           /* does it have the mm statistics? */
+} allocator_t;
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -70,6 +112,7 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    allocator_t *alloc;
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -78,9 +121,21 @@ typedef struct {
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    int samples;     /* timed runs with -K, secs is then their median */
+    double p95;      /* 95th percentile of the timed runs */
+    double stddev;   /* standard deviation of the timed runs */
+    double check_secs; /* secs of the checked run, allocator plus harness */
+    double range_secs; /* ... of which add_range and remove_range took */
+    double io_secs;    /* ... and reading the windows of a streamed trace */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t nocopy;   /* reallocs that grew a block in place */
+    size_t copied;   /* payload bytes copied by reallocs that moved a block */
+    size_t peak;     /* peak heap plus mapped bytes while running the trace */
+    size_t cur;      /* heap plus mapped bytes at the end of the trace */
+    int has_mm;      /* are the allocator statistics below defined? */
+    mm_stats_t mm;   /* mm_stats at the end of the trace */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -90,8 +145,22 @@ typedef struct {
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int repeats = 0; /* timed runs per trace (-K), 0 to time with fsecs */
+static int njobs = 1;   /* traces evaluated in parallel processes (-j) */
+static int pin_cpu = -1;/* first core to pin to (-P), -1 to not pin */
+static int stream = 0;  /* stream every trace (-S), not only huge ones */
+static double range_secs = 0; /* time spent in add_range and remove_range */
+static long range_calls = 0;  /* ... in this many calls */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* The student's package and the bundled dlmalloc */
+static allocator_t mm_allocator = 
+    {"mm malloc", mm_init, mm_malloc, mm_free, mm_realloc, 
+     mm_malloc_batch, mm_free_batch, 1};
+static allocator_t dl_allocator = 
+    {"dlmalloc", dl_init, dl_malloc, dl_free, dl_realloc, 
+     dl_malloc_batch, dl_free_batch, 0};
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -105,15 +174,21 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_insert(range_t *t, range_t *p);
+static range_t *range_delete(range_t *t, char *lo);
+static range_t *range_join(range_t *l, range_t *r);
+static unsigned range_prio(void);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
+static traceop_t *first_op(trace_t *trace);
+static inline traceop_t *next_op(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -121,12 +196,36 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(allocator_t *a, trace_t *trace, int tracenum, 
+			 range_t **ranges);
+static double eval_mm_util(allocator_t *a, trace_t *trace, int tracenum, 
+			   range_t **ranges);
 static void eval_mm_speed(void *ptr);
 
+/* Routines that run either package on the traces */
+static void eval_trace(allocator_t *a, char *tracefile, int tracenum,
+		       stats_t *stats, range_t **ranges);
+static void eval_traces(allocator_t *a, char **tracefiles, int num_tracefiles,
+			stats_t *stats, range_t **ranges);
+static void time_trace(fsecs_test_funct f, speed_t *params, stats_t *stats);
+static void stream_samples(fsecs_test_funct f, speed_t *params, int n,
+			   double *samples);
+static int double_cmp(const void *a, const void *b);
+static double clock_ovhd(void);
+static void pin(int cpu);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printfootprint(int n, stats_t *stats);
+static void printfitcompare(int n, stats_t **stats);
+static void printdlcompare(int n, stats_t *mm_results, stats_t *dl_stats,
+			   stats_t *libc_stats);
+static void printmmstats(int n, stats_t *stats);
+static void printspread(int n, stats_t *stats);
+static void printharness(int n, stats_t *stats);
+static void printjson(char *path, char **tracefiles, int n, char **names,
+		      stats_t **stats, int nstats, double perfindex);
+static void printjsonstr(FILE *fp, char *s);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -141,15 +240,21 @@ int main(int argc, char **argv)
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
-    trace_t *trace = NULL;     /* stores a single trace file in memory */
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
-    stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
-    speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    stats_t *mm_results = NULL;/* mm (i.e. student) stats for each trace */
+    stats_t *fit_stats[3];     /* mm stats for each trace and fit policy */
+    stats_t *dl_stats = NULL;  /* dlmalloc stats for each trace */
+    char *names[3];            /* allocator names for the JSON output */
+    stats_t *all_stats[3];     /* ... and their stats */
+    int nall = 0;
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int compare_fit = 0; /* If set, compare the mm fit policies (-F) */
+    int run_dl = 0;      /* If set, compare mm with dlmalloc (-d) */
+    char *json = NULL;   /* If set, write the results as JSON here (-J) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +263,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalFdSK:j:P:J:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +289,27 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'F': /* Compare first, next and best fit in mm malloc */
+            compare_fit = 1;
+            break;
+        case 'd': /* Compare mm malloc with the bundled dlmalloc */
+            run_dl = 1;
+            break;
+        case 'S': /* Stream the traces instead of reading them whole */
+            stream = 1;
+            break;
+        case 'K': /* Time each trace this many times */
+            repeats = atoi(optarg);
+            break;
+        case 'j': /* Evaluate this many traces in parallel */
+            njobs = atoi(optarg);
+            break;
+        case 'P': /* Pin to this core (parallel jobs to the next ones) */
+            pin_cpu = atoi(optarg);
+            break;
+        case 'J': /* Write the results as JSON ("-" for stdout) */
+            json = optarg;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -237,6 +363,8 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    if (pin_cpu >= 0 && njobs <= 1)
+	pin(pin_cpu);
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -251,25 +379,15 @@ int main(int argc, char **argv)
 	    unix_error("libc_stats calloc in main failed");
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
-	for (i=0; i < num_tracefiles; i++) {
-	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
-	    if (verbose > 1)
-		printf("Checking libc malloc for correctness, ");
-	    libc_stats[i].valid = eval_libc_valid(trace, i);
-	    if (libc_stats[i].valid) {
-		speed_params.trace = trace;
-		if (verbose > 1)
-		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
-	    }
-	    free_trace(trace);
-	}
+	eval_traces(NULL, tracefiles, num_tracefiles, libc_stats, &ranges);
+	names[nall] = "libc malloc";
+	all_stats[nall++] = libc_stats;
 
 	/* Display the libc results in a compact table */
 	if (verbose) {
 	    printf("\nResults for libc malloc:\n");
 	    printresults(num_tracefiles, libc_stats);
+	    printspread(num_tracefiles, libc_stats);
 	}
     }
 
@@ -280,37 +398,80 @@ int main(int argc, char **argv)
 	printf("\nTesting mm malloc\n");
 
     /* Allocate the mm stats array, with one stats_t struct per tracefile */
-    mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (mm_stats == NULL)
-	unix_error("mm_stats calloc in main failed");
+    mm_results = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+    if (mm_results == NULL)
+	unix_error("mm_results calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    eval_traces(&mm_allocator, tracefiles, num_tracefiles, mm_results, &ranges);
+    names[nall] = "mm malloc";
+    all_stats[nall++] = mm_results;
 
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
-	printresults(num_tracefiles, mm_stats);
+	printresults(num_tracefiles, mm_results);
+	printspread(num_tracefiles, mm_results);
+	printf("\n");
+	printharness(num_tracefiles, mm_results);
+	printf("\n");
+	printfootprint(num_tracefiles, mm_results);
+	printf("\n");
+	printmmstats(num_tracefiles, mm_results);
+    }
+    if (verbose > 1) {
+	printf("Reallocs in place, and payload bytes copied by the others:\n");
+	printf("%2s%10s%14s\n", "", "in place", "copied");
+	for (i=0; i < num_tracefiles; i++)
+	    if (mm_results[i].valid)
+		printf("%2d%10lu%14lu\n", i, (unsigned long)mm_results[i].nocopy,
+		       (unsigned long)mm_results[i].copied);
+	printf("\n");
+    }
+
+    /*
+     * Optionally run the mm package again with each fit policy, the
+     * default policy stays in effect for the other mm_init calls
+     */
+    if (compare_fit) {
+	for (i=0; i < 3; i++) {
+	    if (verbose > 1)
+		printf("\nTesting mm malloc with fit policy %d\n", i);
+	    fit_stats[i] = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	    if (fit_stats[i] == NULL)
+		unix_error("fit_stats calloc in main failed");
+	    mm_set_fit(i == 0 ? MM_FIT_FIRST : i == 1 ? MM_FIT_NEXT : MM_FIT_BEST);
+	    eval_traces(&mm_allocator, tracefiles, num_tracefiles, fit_stats[i],
+			&ranges);
+	}
+	printf("\nFit policy comparison for mm malloc:\n");
+	printfitcompare(num_tracefiles, fit_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally run dlmalloc on the same traces and heap, and put it
+     * side by side with mm (and libc, for throughput only)
+     */
+    if (run_dl) {
+	if (verbose > 1)
+	    printf("\nTesting dlmalloc\n");
+	dl_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (dl_stats == NULL)
+	    unix_error("dl_stats calloc in main failed");
+	eval_traces(&dl_allocator, tracefiles, num_tracefiles, dl_stats, &ranges);
+	names[nall] = "dlmalloc";
+	all_stats[nall++] = dl_stats;
+	if (verbose) {
+	    printf("\nResults for dlmalloc:\n");
+	    printresults(num_tracefiles, dl_stats);
+	    printspread(num_tracefiles, dl_stats);
+	}
+	printf("\nComparison of mm malloc and dlmalloc:\n");
+	printdlcompare(num_tracefiles, mm_results, dl_stats, libc_stats);
 	printf("\n");
     }
 
@@ -322,10 +483,10 @@ int main(int argc, char **argv)
     util = 0;
     numcorrect = 0;
     for (i=0; i < num_tracefiles; i++) {
-	secs += mm_stats[i].secs;
-	ops += mm_stats[i].ops;
-	util += mm_stats[i].util;
-	if (mm_stats[i].valid)
+	secs += mm_results[i].secs;
+	ops += mm_results[i].ops;
+	util += mm_results[i].util;
+	if (mm_results[i].valid)
 	    numcorrect++;
     }
     avg_mm_util = util/num_tracefiles;
@@ -362,30 +523,36 @@ int main(int argc, char **argv)
 	printf("perfidx:%.0f\n", perfindex);
     }
 
+    if (json != NULL)
+	printjson(json, tracefiles, num_tracefiles, names, all_stats, nall,
+		  perfindex);
+
     exit(0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *pred = NULL, *succ = NULL;
     char msg[MAXLINE];
+    struct timespec t0, t1;
 
     assert(size > 0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
 
     /* Payload addresses must be ALIGNMENT-byte aligned */
     if (!IS_ALIGNED(lo)) {
@@ -395,36 +562,58 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. The payloads in 
+     * the tree do not overlap each other, so only the nearest payloads
+     * below and above lo can overlap this one.
+     */
+    for (p = *ranges; p != NULL; ) {
+	if (p->lo <= lo) {
+	    pred = p;
+	    p = p->right;
+	}
+	else {
+	    succ = p;
+	    p = p->left;
+	}
+    }
+    if ((p = pred) != NULL && p->hi >= lo)
+	;
+    else if ((p = succ) != NULL && p->lo <= hi)
+	;
+    else
+	p = NULL;
+    if (p != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->left = p->right = NULL;
+    p->prio = range_prio();
+    *ranges = range_insert(*ranges, p);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    range_secs += (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+    range_calls++;
     return 1;
 }
 
@@ -433,34 +622,110 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
+    struct timespec t0, t1;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    *ranges = range_delete(*ranges, lo);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    range_secs += (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+    range_calls++;
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
 static void clear_ranges(range_t **ranges)
+{
+    range_t *p = *ranges;
+
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    free(p);
+    *ranges = NULL;
+}
+
+/*
+ * range_insert - insert p into the treap t by address and return the 
+ *     new root, rotating p up while its priority beats its parent's
+ */
+static range_t *range_insert(range_t *t, range_t *p)
+{
+    range_t *c;
+
+    if (t == NULL)
+	return p;
+    if (p->lo < t->lo) {
+	c = t->left = range_insert(t->left, p);
+	if (c->prio > t->prio) {
+	    t->left = c->right;
+	    c->right = t;
+	    return c;
+	}
+    }
+    else {
+	c = t->right = range_insert(t->right, p);
+	if (c->prio > t->prio) {
+	    t->right = c->left;
+	    c->left = t;
+	    return c;
+	}
+    }
+    return t;
+}
+
+/*
+ * range_delete - remove and free the range starting at lo from the
+ *     treap t, and return the new root
+ */
+static range_t *range_delete(range_t *t, char *lo)
 {
     range_t *p;
-    range_t *pnext;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (t == NULL)
+	return NULL;
+    if (lo < t->lo)
+	t->left = range_delete(t->left, lo);
+    else if (lo > t->lo)
+	t->right = range_delete(t->right, lo);
+    else {
+	p = range_join(t->left, t->right);
+	free(t);
+	return p;
     }
-    *ranges = NULL;
+    return t;
+}
+
+/*
+ * range_join - join two treaps, all of l below all of r
+ */
+static range_t *range_join(range_t *l, range_t *r)
+{
+    if (l == NULL)
+	return r;
+    if (r == NULL)
+	return l;
+    if (l->prio > r->prio) {
+	l->right = range_join(l->right, r);
+	return l;
+    }
+    r->left = range_join(l, r->left);
+    return r;
+}
+
+/*
+ * range_prio - a pseudo-random treap priority (xorshift), the same 
+ *     sequence on every run
+ */
+static unsigned range_prio(void)
+{
+    static unsigned x = 2463534242U;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
 }
 
 
@@ -477,9 +742,10 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, count;
     unsigned max_index = 0;
     unsigned op_index;
+    traceop_t op;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -500,8 +766,21 @@ static trace_t *read_trace(char *tracedir, char *filename)
     fscanf(tracefile, "%d", &(trace->num_ops));     
     fscanf(tracefile, "%d", &(trace->weight));        /* not used */
     
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
+    /* 
+     * We'll store each request line in the trace in this array, or for 
+     * a streamed trace in a temporary file, from which next_op reads 
+     * STREAM_OPS requests at a time into the array (in the speed passes
+     * too, whose time leaves those reads out, see stream_samples)
+     */
+    trace->opfile = NULL;
+    if (stream || trace->num_ops > STREAM_MIN) {
+	if ((trace->opfile = tmpfile()) == NULL)
+	    unix_error("tmpfile failed in read_trace");
+	if ((trace->ops = 
+	     (traceop_t *)malloc(STREAM_OPS * sizeof(traceop_t))) == NULL)
+	    unix_error("malloc 2 failed in read_trace");
+    }
+    else if ((trace->ops = 
 	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 	unix_error("malloc 2 failed in read_trace");
 
@@ -518,32 +797,53 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
+    trace->num_blocks = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
 	switch(type[0]) {
 	case 'a':
 	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
+	    op.type = ALLOC;
+	    op.index = index;
+	    op.size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'r':
 	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
+	    op.type = REALLOC;
+	    op.index = index;
+	    op.size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
+	    op.type = FREE;
+	    op.index = index;
+	    break;
+	case 'A':
+	    fscanf(tracefile, "%u %u %u", &index, &count, &size);
+	    op.type = ALLOC_BATCH;
+	    op.index = index;
+	    op.count = count;
+	    op.size = size;
+	    index += count - 1;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'F':
+	    fscanf(tracefile, "%u %u", &index, &count);
+	    op.type = FREE_BATCH;
+	    op.index = index;
+	    op.count = count;
 	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
 	    exit(1);
 	}
+	trace->num_blocks += (type[0] == 'A' || type[0] == 'F') ? count : 1;
+	if (trace->opfile == NULL)
+	    trace->ops[op_index] = op;
+	else if (fwrite(&op, sizeof(op), 1, trace->opfile) != 1)
+	    unix_error("fwrite failed in read_trace");
 	op_index++;
 	
     }
@@ -560,12 +860,54 @@ static trace_t *read_trace(char *tracedir, char *filename)
  */
 void free_trace(trace_t *trace)
 {
+    if (trace->opfile != NULL)
+	fclose(trace->opfile);
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * first_op - Return the first request of the trace, NULL if none
+ */
+static traceop_t *first_op(trace_t *trace)
+{
+    trace->op_pos = 0;
+    trace->op_len = trace->num_ops;
+    trace->io_secs = 0;
+    if (trace->opfile != NULL) {
+	rewind(trace->opfile);
+	trace->op_len = 0;
+    }
+    return next_op(trace);
+}
+
+/*
+ * next_op - Return the next request of the trace, NULL at the end. A
+ *     streamed trace reads the next window of requests from its file,
+ *     and adds the time of the read to io_secs.
+ */
+static inline traceop_t *next_op(trace_t *trace)
+{
+    struct timespec t0, t1;
+
+    if (trace->op_pos == trace->op_len) {
+	if (trace->opfile == NULL)
+	    return NULL;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	trace->op_len = 
+	    fread(trace->ops, sizeof(traceop_t), STREAM_OPS, trace->opfile);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	trace->io_secs += (t1.tv_sec - t0.tv_sec) + 
+	    1e-9*(t1.tv_nsec - t0.tv_nsec);
+	if (trace->op_len == 0)
+	    return NULL;
+	trace->op_pos = 0;
+    }
+    return &trace->ops[trace->op_pos++];
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -574,44 +916,47 @@ void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static int eval_mm_valid(allocator_t *a, trace_t *trace, int tracenum, 
+			 range_t **ranges) 
 {
     int i, j;
     int index;
     int size;
     int oldsize;
+    int count;
     char *newp;
     char *oldp;
     char *p;
+    traceop_t *op;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
-    if (mm_init() < 0) {
+    if (a->init() < 0) {
 	malloc_error(tracenum, 0, "mm_init failed.");
 	return 0;
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    for (i = 0, op = first_op(trace); op != NULL; i++, op = next_op(trace)) {
+	index = op->index;
+	size = op->size;
 
-        switch (trace->ops[i].type) {
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    if ((p = a->malloc(size)) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -633,15 +978,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+	    if ((newp = a->realloc(oldp, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range tree */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range tree */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -653,7 +998,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((newp[j] & 0xFF) != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -671,7 +1016,32 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    a->free(p);
+	    break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+
+	    /* The blocks go straight into the slots of their ids */
+	    count = op->count;
+	    if (a->malloc_batch(count, size, (void **)&trace->blocks[index])
+		!= count) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = 0; j < count; j++) {
+		p = trace->blocks[index + j];
+		if (add_range(ranges, p, size, tracenum, i) == 0)
+		    return 0;
+		memset(p, (index + j) & 0xFF, size);
+		trace->block_sizes[index + j] = size;
+	    }
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    count = op->count;
+	    for (j = 0; j < count; j++)
+		remove_range(ranges, trace->blocks[index + j]);
+	    a->free_batch(count, (void **)&trace->blocks[index]);
 	    break;
 
 	default:
@@ -688,36 +1058,37 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   Utilization is the ratio hwm/footprint, where footprint is the 
+ *   peak size of the heap plus the regions mapped by mem_mmap() while 
+ *   running the student's malloc package on the trace. The heap can
+ *   shrink, so its size at the end is not the high water mark.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(allocator_t *a, trace_t *trace, int tracenum, 
+			   range_t **ranges)
 {   
-    int i;
+    int i, j;
     int index;
-    int size, newsize, oldsize;
+    int size, newsize, oldsize, count;
     int max_total_size = 0;
     int total_size = 0;
     char *p;
     char *newp, *oldp;
+    traceop_t *op;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
-    if (mm_init() < 0)
+    if (a->init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (i = 0, op = first_op(trace); op != NULL; i++, op = next_op(trace)) {
+        switch (op->type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = a->malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -734,12 +1105,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op->index;
+	    newsize = op->size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
+	    if ((newp = a->realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
 	    /* Remember region and size */
@@ -756,11 +1127,11 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    a->free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -768,13 +1139,37 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+	    index = op->index;
+	    size = op->size;
+	    count = op->count;
+
+	    if (a->malloc_batch(count, size, (void **)&trace->blocks[index])
+		!= count)
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    for (j = 0; j < count; j++)
+		trace->block_sizes[index + j] = size;
+
+	    total_size += count * size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    index = op->index;
+	    count = op->count;
+	    for (j = 0; j < count; j++)
+		total_size -= trace->block_sizes[index + j];
+	    a->free_batch(count, (void **)&trace->blocks[index]);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -784,40 +1179,57 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int i, index, size, newsize, count;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    allocator_t *a = ((speed_t *)ptr)->alloc;
+    traceop_t *op;
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
-    if (mm_init() < 0) 
+    if (a->init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (i = 0, op = first_op(trace); op != NULL; i++, op = next_op(trace))
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            index = op->index;
+            size = op->size;
+            if ((p = a->malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+	    index = op->index;
+            newsize = op->size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
+            if ((newp = a->realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
             trace->blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             block = trace->blocks[index];
-            mm_free(block);
+            a->free(block);
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = op->index;
+            size = op->size;
+            count = op->count;
+            if (a->malloc_batch(count, size, (void **)&trace->blocks[index])
+		!= count)
+		app_error("mm_malloc_batch error in eval_mm_speed");
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = op->index;
+            count = op->count;
+            a->free_batch(count, (void **)&trace->blocks[index]);
             break;
 
 	default:
@@ -825,6 +1237,273 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_trace - Check a malloc package in the memlib heap (mm or dlmalloc),
+ *    or libc malloc if a is NULL, for correctness on one trace and, if it
+ *    is correct, evaluate its utilization (not for libc) and speed
+ */
+static void eval_trace(allocator_t *a, char *tracefile, int tracenum,
+		       stats_t *stats, range_t **ranges)
+{
+    trace_t *trace;
+    speed_t speed_params;
+    struct timespec t0, t1;
+
+    trace = read_trace(tracedir, tracefile);
+    stats->ops = trace->num_blocks;
+    if (verbose > 1)
+	printf("Checking %s for correctness, ", a ? a->name : "libc malloc");
+
+    if (a == NULL) {
+	stats->valid = eval_libc_valid(trace, tracenum);
+	if (stats->valid) {
+	    speed_params.trace = trace;
+	    if (verbose > 1)
+		printf("and performance.\n");
+	    time_trace(eval_libc_speed, &speed_params, stats);
+	}
+	free_trace(trace);
+	return;
+    }
+
+    range_secs = 0;
+    range_calls = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    stats->valid = eval_mm_valid(a, trace, tracenum, ranges);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats->check_secs = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+
+    /* 
+     * Each range call reads the clock twice, one read falling inside the
+     * time it adds to range_secs; take the reads back out of both
+     */
+    stats->range_secs = range_secs - range_calls * clock_ovhd();
+    stats->check_secs -= 2 * range_calls * clock_ovhd();
+    if (stats->range_secs < 0)
+	stats->range_secs = 0;
+    stats->io_secs = trace->io_secs;
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(a, trace, tracenum, ranges);
+	stats->peak = mem_peak_footprint();
+	stats->cur = mem_footprint();
+	if (a->is_mm) {
+	    stats->nocopy = mm_realloc_nocopy();
+	    stats->copied = mm_realloc_copied();
+	    stats->has_mm = (mm_stats(&stats->mm) == 0);
+	}
+	speed_params.trace = trace;
+	speed_params.ranges = *ranges;
+	speed_params.alloc = a;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	time_trace(eval_mm_speed, &speed_params, stats);
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_traces - Run eval_trace on every trace, one after the other, or 
+ *    with -j in up to njobs child processes at a time. A child evaluates
+ *    one trace in its own copy of the heap, and sends its stats and its
+ *    error count back through a pipe.
+ */
+static void eval_traces(allocator_t *a, char **tracefiles, int num_tracefiles,
+			stats_t *stats, range_t **ranges)
+{
+    int i, next, running, slot, base, errs;
+    int *fds, *slots, *busy, fd[2];
+    pid_t pid, *pids;
+
+    if (njobs <= 1 || num_tracefiles < 2) {
+	for (i=0; i < num_tracefiles; i++)
+	    eval_trace(a, tracefiles[i], i, &stats[i], ranges);
+	return;
+    }
+
+    pids = (pid_t *)calloc(num_tracefiles, sizeof(pid_t));
+    fds = (int *)calloc(num_tracefiles, sizeof(int));
+    slots = (int *)calloc(num_tracefiles, sizeof(int));
+    busy = (int *)calloc(njobs, sizeof(int));
+    if (pids == NULL || fds == NULL || slots == NULL || busy == NULL)
+	unix_error("calloc in eval_traces failed");
+
+    fflush(stdout); /* or the children print it again */
+    next = running = 0;
+    while (next < num_tracefiles || running > 0) {
+
+	/* Start the next trace in a free slot */
+	if (next < num_tracefiles && running < njobs) {
+	    for (slot = 0; busy[slot]; slot++)
+		;
+	    if (pipe(fd) < 0)
+		unix_error("pipe in eval_traces failed");
+	    if ((pid = fork()) < 0)
+		unix_error("fork in eval_traces failed");
+	    if (pid == 0) {
+		close(fd[0]);
+		if (pin_cpu >= 0)
+		    pin(pin_cpu + slot);
+		base = errors;
+		eval_trace(a, tracefiles[next], next, &stats[next], ranges);
+		errs = errors - base;
+		if (write(fd[1], &stats[next], sizeof(stats_t)) != sizeof(stats_t)
+		    || write(fd[1], &errs, sizeof(int)) != sizeof(int))
+		    unix_error("write in eval_traces failed");
+		exit(0);
+	    }
+	    close(fd[1]);
+	    pids[next] = pid;
+	    fds[next] = fd[0];
+	    slots[next] = slot;
+	    busy[slot] = 1;
+	    next++;
+	    running++;
+	    continue;
+	}
+
+	/* Collect a child that is done */
+	if ((pid = wait(NULL)) < 0)
+	    unix_error("wait in eval_traces failed");
+	for (i = 0; i < next && pids[i] != pid; i++)
+	    ;
+	if (i == next)
+	    continue;
+	if (read(fds[i], &stats[i], sizeof(stats_t)) != sizeof(stats_t) ||
+	    read(fds[i], &errs, sizeof(int)) != sizeof(int)) {
+	    stats[i].valid = 0;
+	    errs = 1;
+	    printf("ERROR [trace %d]: evaluation process failed\n", i);
+	}
+	errors += errs;
+	close(fds[i]);
+	busy[slots[i]] = 0;
+	pids[i] = 0;
+	running--;
+    }
+
+    free(pids);
+    free(fds);
+    free(slots);
+    free(busy);
+}
+
+/*
+ * time_trace - Time f on the trace with fsecs or, with -K, as the median
+ *    of repeats runs timed one by one, along with their spread. A
+ *    streamed trace is always timed run by run (the median of STREAM_RUNS
+ *    runs without -K), so that the reads of its windows are left out.
+ */
+static void time_trace(fsecs_test_funct f, speed_t *params, stats_t *stats)
+{
+    double *samples, mean = 0, var = 0;
+    int k, n = repeats;
+
+    if (n <= 0 && params->trace->opfile == NULL) {
+	stats->secs = fsecs(f, params);
+	return;
+    }
+    if (n <= 0)
+	n = STREAM_RUNS;
+
+    if ((samples = (double *)malloc(n * sizeof(double))) == NULL)
+	unix_error("malloc in time_trace failed");
+    if (params->trace->opfile == NULL)
+	ftimer_samples(f, params, n, samples); /* the raw monotonic clock */
+    else
+	stream_samples(f, params, n, samples);
+    qsort(samples, n, sizeof(double), double_cmp);
+    stats->secs = (n % 2) ? samples[n/2] :
+	(samples[n/2 - 1] + samples[n/2]) / 2;
+    if (repeats <= 0) {
+	free(samples);
+	return;
+    }
+
+    for (k = 0; k < repeats; k++)
+	mean += samples[k] / repeats;
+    for (k = 0; k < repeats; k++)
+	var += (samples[k] - mean) * (samples[k] - mean) / repeats;
+
+    stats->samples = repeats;
+    stats->p95 = samples[(95 * repeats + 99) / 100 - 1];
+    stats->stddev = sqrt(var);
+    free(samples);
+}
+
+/*
+ * stream_samples - Time each of n runs of f on a streamed trace into
+ *    samples[], as ftimer_samples does, less the time next_op spent
+ *    reading the windows of the run
+ */
+static void stream_samples(fsecs_test_funct f, speed_t *params, int n,
+			   double *samples)
+{
+    struct timespec t0, t1;
+    int i;
+
+    f(params);
+    for (i = 0; i < n; i++) {
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	f(params);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	samples[i] = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec)
+	    - params->trace->io_secs;
+    }
+}
+
+/*
+ * clock_ovhd - Return the secs one clock_gettime call takes, measured on
+ *    the first call as the fastest of CLOCK_BATCHES batches of CLOCK_READS
+ *    reads, so that a batch the process was preempted in does not count
+ */
+static double clock_ovhd(void)
+{
+    static double ovhd = -1;
+    struct timespec t0, t1, t;
+    double secs;
+    int i, j;
+
+    if (ovhd >= 0)
+	return ovhd;
+    for (j = 0; j < CLOCK_BATCHES; j++) {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < CLOCK_READS; i++)
+	    clock_gettime(CLOCK_MONOTONIC, &t);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = ((t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec)) / 
+	    CLOCK_READS;
+	if (ovhd < 0 || secs < ovhd)
+	    ovhd = secs;
+    }
+    return ovhd;
+}
+
+/*
+ * double_cmp - order doubles for qsort
+ */
+static int double_cmp(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * pin - Run this process on one core only (wrapping around the cores)
+ */
+static void pin(int cpu)
+{
+    cpu_set_t set;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % (ncpu > 0 ? ncpu : 1), &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+	unix_error("sched_setaffinity failed");
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -833,32 +1512,48 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    int i, j, newsize;
     char *p, *newp, *oldp;
+    traceop_t *op;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (i = 0, op = first_op(trace); op != NULL; i++, op = next_op(trace)) {
+        switch (op->type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op->size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op->index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op->size;
+	    oldp = trace->blocks[op->index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op->index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op->index]);
+	    break;
+
+	case ALLOC_BATCH: /* libc has no batch calls, one malloc per block */
+	    for (j = 0; j < op->count; j++) {
+		if ((p = malloc(op->size)) == NULL) {
+		    malloc_error(tracenum, i, "libc malloc failed");
+		    unix_error("System message");
+		}
+		trace->blocks[op->index + j] = p;
+	    }
+	    break;
+
+	case FREE_BATCH:
+	    for (j = 0; j < op->count; j++)
+		free(trace->blocks[op->index + j]);
 	    break;
 
 	default:
@@ -876,24 +1571,25 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    traceop_t *op;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (i = 0, op = first_op(trace); op != NULL; i++, op = next_op(trace)) {
+        switch (op->type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op->index;
+	    newsize = op->size;
 	    oldp = trace->blocks[index];
 	    if ((newp = realloc(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
@@ -902,10 +1598,26 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+	case ALLOC_BATCH: /* libc has no batch calls, one malloc per block */
+	    index = op->index;
+	    size = op->size;
+	    for (j = 0; j < op->count; j++) {
+		if ((p = malloc(size)) == NULL)
+		    unix_error("malloc failed in eval_libc_speed");
+		trace->blocks[index + j] = p;
+	    }
+	    break;
+
+	case FREE_BATCH:
+	    index = op->index;
+	    for (j = 0; j < op->count; j++)
+		free(trace->blocks[index + j]);
+	    break;
 	}
     }
 }
@@ -972,6 +1684,311 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printfootprint - prints the peak and final memory footprint of the 
+ *     mm malloc package for each trace, and the RSS of this process
+ */
+static void printfootprint(int n, stats_t *stats)
+{
+    int i;
+    long rss = 0, hwm = 0;
+    char line[MAXLINE];
+    FILE *fp;
+
+    printf("%5s%7s%10s%10s\n", "trace", " valid", "peak(KB)", "cur(KB)");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid)
+	    printf("%2d%10s%10.0f%10.0f\n", i, "yes",
+		   stats[i].peak/1024.0, stats[i].cur/1024.0);
+	else
+	    printf("%2d%10s%10s%10s\n", i, "no", "-", "-");
+    }
+
+    /* Resident set size of the driver itself, both from the same
+       accounting (ru_maxrss is updated lazily, and may lag VmRSS) */
+    if ((fp = fopen("/proc/self/status", "r")) != NULL) {
+	while (fgets(line, MAXLINE, fp) != NULL) {
+	    sscanf(line, "VmRSS: %ld", &rss);
+	    sscanf(line, "VmHWM: %ld", &hwm);
+	}
+	fclose(fp);
+    }
+    printf("Process RSS: %ld KB current, %ld KB peak\n", rss, hwm);
+}
+
+/*
+ * printfitcompare - prints the utilization and throughput of the mm
+ *     malloc package for each trace under first, next and best fit
+ */
+static void printfitcompare(int n, stats_t **stats)
+{
+    int i, p;
+    double secs, ops, util;
+
+    printf("%5s%18s%18s%18s\n", "trace", "first fit", "next fit", "best fit");
+    printf("%5s", "");
+    for (p=0; p < 3; p++)
+	printf("%8s%10s", "util", "Kops");
+    printf("\n");
+    for (i=0; i < n; i++) {
+	printf("%2d   ", i);
+	for (p=0; p < 3; p++) {
+	    if (stats[p][i].valid)
+		printf("%7.0f%%%10.0f", stats[p][i].util*100.0,
+		       (stats[p][i].ops/1e3)/stats[p][i].secs);
+	    else
+		printf("%8s%10s", "-", "-");
+	}
+	printf("\n");
+    }
+
+    /* Aggregate over the traces that were valid */
+    printf("%5s", "Total");
+    for (p=0; p < 3; p++) {
+	secs = ops = util = 0;
+	for (i=0; i < n; i++) {
+	    if (stats[p][i].valid) {
+		secs += stats[p][i].secs;
+		ops += stats[p][i].ops;
+		util += stats[p][i].util;
+	    }
+	}
+	printf("%7.0f%%%10.0f", (util/n)*100.0, (ops/1e3)/secs);
+    }
+    printf("\n");
+}
+
+/*
+ * printdlcompare - prints the utilization, throughput and peak footprint
+ *     of mm malloc and dlmalloc for each trace, and the libc throughput
+ *     if libc was run as well
+ */
+static void printdlcompare(int n, stats_t *mm_results, stats_t *dl_stats,
+			   stats_t *libc_stats)
+{
+    int i, p;
+    stats_t *stats[2];
+    double secs, ops, util, peak;
+
+    stats[0] = mm_results;
+    stats[1] = dl_stats;
+    printf("%5s%26s%26s%s\n", "trace", "mm malloc", "dlmalloc", 
+	   libc_stats ? "      libc" : "");
+    printf("%5s", "");
+    for (p=0; p < 2; p++)
+	printf("%8s%8s%10s", "util", "Kops", "peak(KB)");
+    if (libc_stats)
+	printf("%10s", "Kops");
+    printf("\n");
+    for (i=0; i < n; i++) {
+	printf("%2d   ", i);
+	for (p=0; p < 2; p++) {
+	    if (stats[p][i].valid)
+		printf("%7.0f%%%8.0f%10.0f", stats[p][i].util*100.0,
+		       (stats[p][i].ops/1e3)/stats[p][i].secs,
+		       stats[p][i].peak/1024.0);
+	    else
+		printf("%8s%8s%10s", "-", "-", "-");
+	}
+	if (libc_stats) {
+	    if (libc_stats[i].valid)
+		printf("%10.0f", (libc_stats[i].ops/1e3)/libc_stats[i].secs);
+	    else
+		printf("%10s", "-");
+	}
+	printf("\n");
+    }
+
+    /* Aggregate over the traces that were valid */
+    printf("%5s", "Total");
+    for (p=0; p < 2; p++) {
+	secs = ops = util = peak = 0;
+	for (i=0; i < n; i++) {
+	    if (stats[p][i].valid) {
+		secs += stats[p][i].secs;
+		ops += stats[p][i].ops;
+		util += stats[p][i].util;
+		peak += stats[p][i].peak;
+	    }
+	}
+	printf("%7.0f%%%8.0f%10.0f", (util/n)*100.0, (ops/1e3)/secs, 
+	       peak/1024.0);
+    }
+    if (libc_stats) {
+	secs = ops = 0;
+	for (i=0; i < n; i++) {
+	    if (libc_stats[i].valid) {
+		secs += libc_stats[i].secs;
+		ops += libc_stats[i].ops;
+	    }
+	}
+	printf("%10.0f", (ops/1e3)/secs);
+    }
+    printf("\n");
+}
+
+/*
+ * printharness - Split the checked run of each trace into the time
+ *     spent in the allocator (the timed run), in the range tree, reading
+ *     a streamed trace, and the rest of the driver (filling and checking
+ *     payloads), with the shares of the range tree and of the rest
+ */
+static void printharness(int n, stats_t *stats)
+{
+    int i;
+    double other, total;
+
+    printf("%5s%7s%11s%11s%11s%11s%11s%8s%8s\n", "trace", " valid", 
+	   "checked", "allocator", "ranges", "reads", "other", "ranges%", 
+	   "other%");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid) {
+	    total = stats[i].check_secs > 0 ? stats[i].check_secs : 1;
+	    other = stats[i].check_secs - stats[i].secs - 
+		stats[i].range_secs - stats[i].io_secs;
+	    if (other < 0)
+		other = 0;
+	    printf("%2d%10s%11.6f%11.6f%11.6f%11.6f%11.6f%7.1f%%%7.1f%%\n", 
+		   i, "yes", stats[i].check_secs, stats[i].secs, 
+		   stats[i].range_secs, stats[i].io_secs, other,
+		   100.0*stats[i].range_secs/total, 100.0*other/total);
+	}
+	else
+	    printf("%2d%10s%11s%11s%11s%11s%11s%8s%8s\n", i, "no", 
+		   "-", "-", "-", "-", "-", "-", "-");
+    }
+}
+
+/*
+ * printspread - prints the spread of the timed runs of each trace, if 
+ *     they were timed with -K
+ */
+static void printspread(int n, stats_t *stats)
+{
+    int i;
+
+    if (repeats <= 0)
+	return;
+    printf("%5s%7s%12s%12s%12s%8s\n", 
+	   "trace", " valid", "median", "p95", "stddev", "runs");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid)
+	    printf("%2d%10s%12.6f%12.6f%12.6f%8d\n", i, "yes", stats[i].secs,
+		   stats[i].p95, stats[i].stddev, stats[i].samples);
+	else
+	    printf("%2d%10s%12s%12s%12s%8s\n", i, "no", "-", "-", "-", "-");
+    }
+}
+
+/*
+ * printjson - writes the results of every package that was run on every
+ *     trace to path ("-" for stdout), one flat record per package and 
+ *     trace, for tracking them over time
+ */
+static void printjson(char *path, char **tracefiles, int n, char **names,
+		      stats_t **stats, int nstats, double perfindex)
+{
+    FILE *fp;
+    int i, p;
+    stats_t *st;
+
+    if (!strcmp(path, "-"))
+	fp = stdout;
+    else if ((fp = fopen(path, "w")) == NULL)
+	unix_error("fopen of the JSON file failed");
+
+    fprintf(fp, "{\n  \"perfindex\": %.1f,\n  \"repeats\": %d,\n", 
+	    perfindex, repeats);
+    fprintf(fp, "  \"results\": [");
+    for (p=0; p < nstats; p++) {
+	for (i=0; i < n; i++) {
+	    st = &stats[p][i];
+	    fprintf(fp, "%s\n    {\"allocator\": ", (p || i) ? "," : "");
+	    printjsonstr(fp, names[p]);
+	    fprintf(fp, ", \"trace\": ");
+	    printjsonstr(fp, tracefiles[i]);
+	    fprintf(fp, ", \"valid\": %s", st->valid ? "true" : "false");
+	    if (st->valid)
+		fprintf(fp, ", \"ops\": %.0f, \"util\": %.4f, \"secs\": %.9f, "
+			"\"kops\": %.1f, \"p95\": %.9f, \"stddev\": %.9f, "
+			"\"peak\": %lu", st->ops, st->util, st->secs, 
+			(st->ops/1e3)/st->secs, st->p95, st->stddev, 
+			(unsigned long)st->peak);
+	    fprintf(fp, "}");
+	}
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fp != stdout)
+	fclose(fp);
+}
+
+/*
+ * printjsonstr - writes s as a JSON string, quoted, with the quotes,
+ *     backslashes and control characters in it escaped
+ */
+static void printjsonstr(FILE *fp, char *s)
+{
+    unsigned char ch;
+
+    fputc('"', fp);
+    for (; (ch = *s) != '\0'; s++) {
+	if (ch == '"' || ch == '\\')
+	    fprintf(fp, "\\%c", ch);
+	else if (ch < 0x20)
+	    fprintf(fp, "\\u%04x", ch);
+	else
+	    fputc(ch, fp);
+    }
+    fputc('"', fp);
+}
+
+/*
+ * printmmstats - prints the statistics reported by mm_stats for each 
+ *     trace, if the mm package was compiled with them
+ */
+static void printmmstats(int n, stats_t *stats)
+{
+    int i, c;
+    mm_stats_t *st;
+    double internal, external;
+
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid || !stats[i].has_mm)
+	    continue;
+	st = &stats[i].mm;
+
+	/* Internal: block bytes beyond the request; external: free 
+	   bytes that are not in the largest free block */
+	internal = st->block_bytes ? 
+	    1.0 - (double)st->req_bytes / st->block_bytes : 0;
+	external = st->free_bytes ?
+	    1.0 - (double)st->largest_free / st->free_bytes : 0;
+
+	printf("Statistics for trace %d:\n", i);
+	printf("  heap peak %.0fKB, internal frag %.1f%%, external frag %.1f%%\n",
+	       st->heap_peak/1024.0, internal*100.0, external*100.0);
+	printf("  searches %lu, avg %.1f blocks, max %lu blocks\n",
+	       (unsigned long)st->search_cnt,
+	       st->search_cnt ? (double)st->search_steps/st->search_cnt : 0,
+	       (unsigned long)st->search_max);
+	printf("  mapped %lu, quick %lu, reallocs in place %lu, "
+	       "realloc bytes copied %lu\n",
+	       (unsigned long)st->mmap_cnt, (unsigned long)st->quick_len,
+	       (unsigned long)st->realloc_nocopy,
+	       (unsigned long)st->realloc_copied);
+	printf("  %-10s", "class");
+	for (c=0; c < MM_NCLASS; c++)
+	    printf("%8d", c);
+	printf("\n  %-10s", "allocs");
+	for (c=0; c < MM_NCLASS; c++)
+	    printf("%8lu", (unsigned long)st->alloc_cnt[c]);
+	printf("\n  %-10s", "free list");
+	for (c=0; c < MM_NCLASS; c++)
+	    printf("%8lu", (unsigned long)st->free_len[c]);
+	printf("\n\n");
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1004,13 +2021,21 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValFdS] [-f <file>] [-t <dir>] [-K <n>] [-j <n>]\n"
+	    "               [-P <cpu>] [-J <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-d         Compare mm malloc with the bundled dlmalloc.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F         Compare first, next and best fit in mm malloc.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to <n> traces in parallel processes.\n");
+    fprintf(stderr, "\t-J <file>  Write the results as JSON to <file> (- for stdout).\n");
+    fprintf(stderr, "\t-K <n>     Time each trace <n> times, report the median.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-P <cpu>   Pin to core <cpu> (parallel jobs to the next cores).\n");
+    fprintf(stderr, "\t-S         Stream the traces instead of loading them whole.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
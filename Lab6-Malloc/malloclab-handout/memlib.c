@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,24 +15,42 @@
 #include "memlib.h"
 #include "config.h"
 
+/* Records a region handed out by mem_mmap */
+typedef struct map_t {
+    char *addr;              /* first byte of the region */
+    size_t size;             /* byte size of the region */
+    struct map_t *next;      /* next list element */
+} map_t;
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static map_t *mem_maps;      /* regions currently mapped by mem_mmap */
+static size_t mem_mapped;    /* total bytes in those regions */
+static size_t mem_peak;      /* high water mark of heap size plus mapped bytes */
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* 
+     * allocate the storage we will use to model the available VM, mapped 
+     * on its own so that pages above a shrunk brk can be given back
+     */
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_maps = NULL;
+    mem_mapped = 0;
+    mem_peak = 0;
 }
 
 /* 
@@ -39,35 +58,160 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ *    and unmap every region left by mem_mmap
  */
 void mem_reset_brk()
 {
+    map_t *p, *pnext;
+
+    for (p = mem_maps; p != NULL; p = pnext) {
+	pnext = p->next;
+	munmap(p->addr, p->size);
+	free(p);
+    }
+    mem_maps = NULL;
+    mem_mapped = 0;
     mem_brk = mem_start_brk;
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, and the whole pages above the new
+ *    brk are madvise'd away.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
+    char *lo, *hi;
+    size_t page = mem_pagesize();
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((mem_brk + incr < mem_start_brk) || ((mem_brk + incr) > mem_max_addr)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+
+    if (incr < 0) {
+	lo = mem_start_brk + (mem_brk - mem_start_brk + page - 1) / page * page;
+	hi = mem_start_brk + (old_brk - mem_start_brk) / page * page;
+	if (lo < hi) {
+#ifdef MADV_FREE
+	    /* lazy free is cheaper if the heap grows back soon */
+	    if (madvise(lo, hi - lo, MADV_FREE) < 0)
+#endif
+		madvise(lo, hi - lo, MADV_DONTNEED);
+	}
+    }
+    else if (mem_heapsize() + mem_mapped > mem_peak)
+	mem_peak = mem_heapsize() + mem_mapped;
     return (void *)old_brk;
 }
 
+/*
+ * mem_mmap - map a region of size bytes (rounded up to whole pages) 
+ *    outside the heap, and return its start address or (void *)-1
+ */
+void *mem_mmap(size_t size)
+{
+    map_t *p;
+    size_t page = mem_pagesize();
+
+    if ((p = (map_t *)malloc(sizeof(map_t))) == NULL) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    p->size = (size + page - 1) / page * page;
+    p->addr = mmap(NULL, p->size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p->addr == MAP_FAILED) {
+	free(p);
+	fprintf(stderr, "ERROR: mem_mmap failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    p->next = mem_maps;
+    mem_maps = p;
+
+    mem_mapped += p->size;
+    if (mem_heapsize() + mem_mapped > mem_peak)
+	mem_peak = mem_heapsize() + mem_mapped;
+    return (void *)p->addr;
+}
+
+/*
+ * mem_mremap - resize a region returned by mem_mmap to size bytes (rounded
+ *    up to whole pages), moving it if it cannot grow where it is; return its
+ *    start address or (void *)-1, in which case the region is left alone
+ */
+void *mem_mremap(void *addr, size_t size)
+{
+    map_t *p;
+    size_t page = mem_pagesize();
+    char *newaddr;
+
+    for (p = mem_maps; p != NULL && p->addr != addr; p = p->next)
+	;
+    if (p == NULL) {
+	errno = EINVAL;
+	return (void *)-1;
+    }
+    size = (size + page - 1) / page * page;
+    newaddr = mremap(p->addr, p->size, size, MREMAP_MAYMOVE);
+    if (newaddr == MAP_FAILED)
+	return (void *)-1;
+
+    mem_mapped += size - p->size;
+    p->addr = newaddr;
+    p->size = size;
+    if (mem_heapsize() + mem_mapped > mem_peak)
+	mem_peak = mem_heapsize() + mem_mapped;
+    return (void *)newaddr;
+}
+
+/*
+ * mem_munmap - unmap a region returned by mem_mmap, return 0 or -1
+ */
+int mem_munmap(void *addr)
+{
+    map_t *p;
+    map_t **prevpp = &mem_maps;
+
+    for (p = mem_maps; p != NULL; p = p->next) {
+	if (p->addr == addr) {
+	    *prevpp = p->next;
+	    mem_mapped -= p->size;
+	    munmap(p->addr, p->size);
+	    free(p);
+	    return 0;
+	}
+	prevpp = &(p->next);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * mem_is_mapped - return 1 if [lo, hi] lies within one mem_mmap region
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    map_t *p;
+
+    for (p = mem_maps; p != NULL; p = p->next) {
+	if ((char *)lo >= p->addr && (char *)hi < p->addr + p->size)
+	    return 1;
+    }
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +236,23 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_footprint() - returns the heap size plus the bytes mapped by mem_mmap
+ */
+size_t mem_footprint()
+{
+    return mem_heapsize() + mem_mapped;
+}
+
+/*
+ * mem_peak_footprint() - returns the high water mark of mem_footprint()
+ *    since the last mem_reset_brk
+ */
+size_t mem_peak_footprint()
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
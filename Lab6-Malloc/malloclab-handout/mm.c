@@ -16,6 +16,47 @@
  * faster by firstly comparing req size to some fixed block size.
  *     The key point is we maintain multiple free lists. Other designs remain the
  * same with explicit list.
+ * 
+ *     With DEFERCOAL, small freed blocks are not coalesced right away. They
+ * go into per-size quick lists and stay marked allocated, so a request of
+ * the same size reuses them without touching any free list. The quick lists
+ * are flushed (freed with coalescing) when a request misses or when they
+ * hold more than QLIMIT blocks.
+ * 
+ *     Blocks of at least MMAP_THRESHOLD bytes are not placed in the heap,
+ * each of them gets a mapping of its own from mem_mmap, which is unmapped
+ * by mm_free. When the free block at the top of the heap grows bigger than
+ * TRIM_THRESHOLD, the heap is shrunk so that TRIM_PAD bytes remain free;
+ * the gap between the two keeps a block freed and allocated again at the
+ * top from shrinking and growing the heap every time.
+ * 
+ *     mm_realloc grows a block in place into its free neighbours or past
+ * the brk when it can. A block it grows is marked GROWN and, if the block
+ * has a spare word, keeps the size of its live payload there, so that a
+ * later move copies only the live bytes. A GROWN block that grows in place
+ * again gets slack, and keeps it when it shrinks. A mapped block is resized
+ * with mremap, so its pages are never copied.
+ * 
+ *     The search policy is first fit (the default), next fit (a roving
+ * pointer per list) or best fit. Best fit buys a few points of util on the
+ * random traces for a third of the throughput on the others. With best
+ * fit, the last class (blocks above 4KB) is not a list but an AVL tree
+ * keyed by (size, address), whose nodes live in the free blocks
+ * themselves, so the smallest fitting block is found in O(log n).
+ * 
+ *     mm_malloc_batch finds one free block for all n blocks of a batch and
+ * cuts it up, so n requests cost a single search. If no free block is big
+ * enough it falls back to n mm_malloc calls, which fill the holes in the 
+ * heap before growing it. mm_free_batch sorts the caller's array of
+ * pointers by address, in place, and frees each run of adjacent blocks as one block.
+ * 
+ *     HEAPCHECK 1 runs mm_check, which walks the whole heap and all free 
+ * lists, on every call. HEAPCHECK 2 checks incrementally: each call checks
+ * the block it was passed, the last block the previous call touched, and 
+ * the next CHECK_WINDOW blocks of a window rolling through the heap, and
+ * every CHECK_FULL calls it runs mm_check. The block functions report the
+ * blocks they leave behind with CK_TOUCH, which also moves the window back
+ * when its position is swallowed by a coalesced block.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,13 +87,23 @@ team_t team = {
 #define WSIZE 4             /* word and header/footer size (bytes) */
 #define DSIZE 8             /* double word size (bytes) */
 #define CHUNKSIZE (1 << 12) /* extend heap by this amount (bytes) */
-#define HEAPCHECK 0         /* heap check option */
+#define MMAP_THRESHOLD (1 << 18) /* blocks this big get their own mapping */
+#define TRIM_THRESHOLD (1 << 18) /* trim a free top block bigger than this */
+#define TRIM_PAD (1 << 17)  /* free bytes a trim leaves at the top */
+#define HEAPCHECK 0         /* heap check option (1 full, 2 incremental) */
+#define CHECK_WINDOW 32     /* blocks checked per call by HEAPCHECK 2 */
+#define CHECK_FULL (1 << 14) /* calls between full checks with HEAPCHECK 2 */
+#define DEFERCOAL 1         /* deferred coalescing option */
+#ifndef MMSTATS
+#define MMSTATS 0           /* statistics option (mm_stats), -DMMSTATS=1 to enable */
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
 #define ALIGN(size) (((size) + (DSIZE - 1)) / DSIZE)
 
-/* Max macro function */
+/* Max and min macro functions */
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc) ((size) | (alloc))
@@ -64,6 +115,16 @@ team_t team = {
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p) (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_GROWN(p) (GET(p) & 0x2)
+#define GET_MAPPED(p) (GET(p) & 0x4)
+
+/* block bits: grown by mm_realloc, mapped outside the heap */
+#define GROWN 0x2
+#define MAPPED 0x4
+
+/* a GROWN block keeps the size of its live payload in its last payload word */
+#define LIVEP(bp) (FTRP(bp) - WSIZE)
+#define LIVE_SIZE(bp) (GET_GROWN(HDRP(bp)) ? GET(LIVEP(bp)) : GET_SIZE(HDRP(bp)) - DSIZE)
 
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp) ((char *)(bp)-WSIZE)
@@ -73,6 +134,11 @@ team_t team = {
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)))
 #define PREV_BLKP(bp) ((char *)(bp)-GET_SIZE((char *)(bp)-DSIZE))
 
+/* Given block ptr bp, read and write left and right child and height in the tree block */
+#define TREE_LEFT(bp) (*(char **)(bp))
+#define TREE_RIGHT(bp) (*((char **)(bp) + 1))
+#define TREE_HEIGHT(bp) (*(int *)((char **)(bp) + 2))
+
 /* Given block ptr bp, read and write prev and next pointer in the free block */
 #define GET_PREV(bp) (*(char **)(bp))
 #define GET_NEXT(bp) (*((char **)(bp) + 1))
@@ -83,12 +149,53 @@ team_t team = {
 static char *heap_listp = NULL;
 
 /* static pointer that points to start of free blocks */
-#define FCNT 9
+#define FCNT MM_NCLASS /* mm_stats reports one count per list */
 #define FS(x) (4 * DSIZE * (1 << (x)))
 static char *heap_freep[FCNT];
 
+/* search policy, roving pointers for next fit, whether the last class is a tree */
+static int fit_policy = MM_FIT_FIRST;
+static char *heap_roverp[FCNT];
+static int tree_class = FCNT;
+#define IS_TREE(class) ((class) == tree_class)
+
+/* static pointers that point to quick lists of freed but uncoalesced blocks */
+#define QMAX (32 * DSIZE)              /* largest block size kept in a quick list */
+#define QCNT (QMAX / DSIZE - 2)        /* one list per block size from 3*DSIZE */
+#define QLIMIT 256                     /* flush all quick lists above this count */
+#define QI(size) ((size) / DSIZE - 3)  /* quick list index of a block size */
+static char *quick_listp[QCNT];
+static int quick_cnt;
+
+/* number of reallocs that grew a block without moving it, bytes copied by the others */
+static size_t realloc_nocopy = 0;
+static size_t realloc_copied = 0;
+
+/* counters for mm_stats, only updated if MMSTATS */
+static mm_stats_t stats;
+
+/* incremental heap check: last block touched, window position, calls */
+static char *ck_last = NULL;
+static char *ck_rover = NULL;
+static size_t ck_calls = 0;
+#define CK_TOUCH(bp)              \
+    do                            \
+    {                             \
+        if (HEAPCHECK == 2)       \
+            ck_touch((char *)(bp)); \
+    } while (0)
+
 /* static functions */
 static void *extend_heap(size_t words);
+static void *extend_tail(void *bp, size_t asize);
+static void trim_heap(void);
+
+/* blocks mapped outside the heap */
+static void *mmap_alloc(size_t asize);
+static void *mmap_realloc(void *bp, size_t size, size_t newsize);
+
+/* realloc helpers */
+static inline void rl_mark(void *bp, size_t size);
 
 /* explicit free list manipulation */
 static inline void ex_delete(void *bp);
@@ -96,10 +203,34 @@ static void *ex_insert(void *bp);
 static void ex_insert_after(void *prev_bp, void *bp, int class);
 static inline void *ex_insert_back(void *bp, int class);
 static inline void *ex_find_fit(size_t asize);
+static inline void *ex_search(size_t asize);
 static void ex_place(void *bp, size_t asize);
 static inline int ex_classify(size_t size);
 static inline int ex_update(void *bp, size_t newsize);
 
+/* size-keyed AVL tree manipulation (best fit for the last class) */
+static char *tr_insert(char *root, char *bp);
+static char *tr_delete(char *root, char *bp);
+static char *tr_delete_min(char *root, char **minp);
+static char *tr_balance(char *bp);
+static inline void *tr_find_fit(char *root, size_t asize);
+static int tr_check(char *bp, int *free_cnt);
+
+/* batch helpers */
+static size_t batch_each(size_t n, size_t size, void **ptrs);
+static int ptr_cmp(const void *a, const void *b);
+
+/* incremental heap check */
+static int ck_enter(void *bp);
+static int ck_block(char *bp);
+static inline int ck_in_heap(char *p);
+static inline void ck_touch(char *bp);
+
+/* quick list manipulation (deferred coalescing) */
+static inline void *qk_pop(size_t asize);
+static inline void qk_push(void *bp);
+static void qk_flush(void);
+
 /* 
  * mm_init - initialize the malloc package.
  */
@@ -113,11 +244,25 @@ int mm_init(void)
     PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
     PUT(heap_listp + (3 * WSIZE), PACK(0, 1));     /* Alignment padding footer (Epilogue header) */
     heap_listp += 2 * WSIZE;
+    realloc_nocopy = 0;
+    realloc_copied = 0;
+    if (MMSTATS)
+        memset(&stats, 0, sizeof(stats));
 
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
     int i;
     for (i = 0; i < FCNT; i++)
+    {
         heap_freep[i] = NULL;
+        heap_roverp[i] = NULL;
+    }
+    tree_class = fit_policy == MM_FIT_BEST ? FCNT - 1 : FCNT;
+    for (i = 0; i < QCNT; i++)
+        quick_listp[i] = NULL;
+    quick_cnt = 0;
+    ck_last = NULL;
+    ck_rover = NULL;
+    ck_calls = 0;
     if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
         return -1;
 
@@ -136,6 +281,8 @@ static void *extend_heap(size_t words)
     size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
     if ((long)(bp = mem_sbrk(size)) == -1)
         return NULL;
+    if (MMSTATS)
+        stats.heap_peak = MAX(stats.heap_peak, mem_heapsize());
 
     /* set free block header/footer and the epilogue header */
     PUT(HDRP(bp), PACK(size, 0));         /* free block header */
@@ -147,13 +294,114 @@ static void *extend_heap(size_t words)
     return ex_insert_back(bp, ex_classify(size));
 }
 
+/*
+ * extend_tail - grow the last block before the epilogue in place to asize bytes,
+ *               return bp or NULL
+ */
+static void *extend_tail(void *bp, size_t asize)
+{
+    size_t oldsize = GET_SIZE(HDRP(bp));
+    char *next_bp = NEXT_BLKP(bp);
+    size_t next_size = GET_ALLOC(HDRP(next_bp)) ? 0 : GET_SIZE(HDRP(next_bp));
+
+    if (mem_sbrk(asize - oldsize - next_size) == (void *)-1)
+        return NULL;
+    if (MMSTATS)
+        stats.heap_peak = MAX(stats.heap_peak, mem_heapsize());
+
+    if (next_size)
+        ex_delete(next_bp);
+    PUT(HDRP(bp), PACK(asize, GROWN | 1));
+    PUT(FTRP(bp), PACK(asize, GROWN | 1));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* new epilogue header */
+    CK_TOUCH(bp);
+
+    realloc_nocopy++;
+    return bp;
+}
+
+/*
+ * trim_heap - give the free space at the top of the heap back to memlib
+ *           - only when the last block is free and bigger than TRIM_THRESHOLD,
+ *             and TRIM_PAD bytes stay free
+ */
+static void trim_heap(void)
+{
+    char *ep = (char *)mem_heap_hi() + 1; /* block ptr whose header is the epilogue */
+    char *bp;
+    size_t size;
+
+    if (GET_ALLOC(ep - DSIZE))
+        return;
+    bp = PREV_BLKP(ep);
+    if ((size = GET_SIZE(HDRP(bp))) <= TRIM_THRESHOLD)
+        return;
+
+    /* keep TRIM_PAD bytes free at the top */
+    ex_delete(bp);
+    mem_sbrk(-(int)(size - TRIM_PAD));
+    PUT(HDRP(bp), PACK(TRIM_PAD, 0));
+    PUT(FTRP(bp), PACK(TRIM_PAD, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* new epilogue header */
+    ex_insert(bp);
+}
+
+/*
+ * mmap_alloc - place a block of asize bytes in a mapping of its own
+ *            - the header keeps the mapping size, there is no footer
+ */
+static void *mmap_alloc(size_t asize)
+{
+    char *p;
+
+    if ((p = mem_mmap(asize)) == (void *)-1)
+        return NULL;
+    asize = (asize + mem_pagesize() - 1) / mem_pagesize() * mem_pagesize();
+    PUT(p + WSIZE, PACK(asize, MAPPED | 1));
+    CK_TOUCH(p + DSIZE);
+    return p + DSIZE;
+}
+
+/*
+ * mmap_realloc - realloc for a mapped block
+ *              - stay in the mapping while newsize fits and is at least half of it,
+ *                else resize the mapping with mremap, so the pages are not copied
+ *              - only a block that is no longer large moves back into the heap
+ */
+static void *mmap_realloc(void *bp, size_t size, size_t newsize)
+{
+    size_t oldsize = GET_SIZE(HDRP(bp));
+    size_t page = mem_pagesize();
+    char *p;
+
+    if (newsize < MMAP_THRESHOLD / 2)
+    {
+        if ((p = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(p, bp, MIN(oldsize - DSIZE, size));
+        realloc_copied += MIN(oldsize - DSIZE, size);
+        mm_free(bp);
+        return p;
+    }
+    if (newsize <= oldsize && newsize >= oldsize / 2)
+        return bp;
+
+    if ((p = mem_mremap((char *)bp - DSIZE, newsize)) == (void *)-1)
+        return NULL;
+    PUT(p + WSIZE, PACK((newsize + page - 1) / page * page, MAPPED | 1));
+    CK_TOUCH(p + DSIZE);
+    if (newsize > oldsize && p + DSIZE == bp)
+        realloc_nocopy++;
+    return p + DSIZE;
+}
+
 /* 
  * mm_malloc - Allocate a block by incrementing the brk pointer.
  *     Always allocate a block whose size is a multiple of the alignment.
  */
 void *mm_malloc(size_t size)
 {
-    if (HEAPCHECK && !mm_check())
+    if (HEAPCHECK && !ck_enter(NULL))
         exit(0);
 
     size_t asize;      /* adjusted block size (in bytes) */
@@ -170,6 +418,24 @@ void *mm_malloc(size_t size)
     else
         asize = DSIZE * ALIGN(size + DSIZE);
 
+    if (MMSTATS)
+    {
+        stats.req_bytes += size;
+        stats.block_bytes += asize;
+        if (asize >= MMAP_THRESHOLD)
+            stats.mmap_cnt++;
+        else
+            stats.alloc_cnt[ex_classify(asize)]++;
+    }
+
+    /* large blocks do not come from the heap */
+    if (asize >= MMAP_THRESHOLD)
+        return mmap_alloc(asize);
+
+    /* reuse a block of the same size freed recently */
+    if (DEFERCOAL && (bp = qk_pop(asize)) != NULL)
+        return bp;
+
     /* search the free list for a fit */
     if ((bp = ex_find_fit(asize)) != NULL)
     {
@@ -177,6 +443,17 @@ void *mm_malloc(size_t size)
         return bp;
     }
 
+    /* coalesce the deferred blocks and search again */
+    if (DEFERCOAL && quick_cnt)
+    {
+        qk_flush();
+        if ((bp = ex_find_fit(asize)) != NULL)
+        {
+            ex_place(bp, asize);
+            return bp;
+        }
+    }
+
     /* no fit found. get more memory and place the block */
     extendsize = MAX(asize, CHUNKSIZE);
     if ((bp = extend_heap(extendsize / WSIZE)) == NULL)
@@ -190,28 +467,54 @@ void *mm_malloc(size_t size)
  */
 void mm_free(void *bp)
 {
-    if (HEAPCHECK && !mm_check())
+    if (HEAPCHECK && !ck_enter(bp))
         exit(0);
 
     size_t size = GET_SIZE(HDRP(bp));
+
+    /* unmap large blocks right away */
+    if (GET_MAPPED(HDRP(bp)))
+    {
+        mem_munmap((char *)bp - DSIZE);
+        return;
+    }
+
+    /* defer coalescing of small blocks, they are likely to be reused */
+    if (DEFERCOAL && size <= QMAX)
+    {
+        qk_push(bp);
+        if (quick_cnt > QLIMIT)
+        {
+            qk_flush();
+            trim_heap();
+        }
+        return;
+    }
+
     PUT(HDRP(bp), PACK(size, 0));
     PUT(FTRP(bp), PACK(size, 0));
 
     ex_insert(bp);
+    trim_heap();
 }
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
+ * mm_realloc - resize a block in place when its neighbours or the brk allow,
+ *              else move it, copying only its live payload
+ *            - a block that grows is marked GROWN and keeps its live size in
+ *              its last payload word when there is room; when it grows in
+ *              place again it gets slack, which it keeps when it shrinks
+ *              to half its size or within its size class
  */
 void *mm_realloc(void *ptr, size_t size)
 {
-    if (HEAPCHECK && !mm_check())
+    if (HEAPCHECK && !ck_enter(ptr))
         exit(0);
 
     char *bp = ptr;
     char *oldbp;
     size_t oldsize = GET_SIZE(HDRP(bp));
-    size_t newsize;
+    size_t newsize, gsize, asize, live;
 
     /* adjust newsize */
     if (size <= 2 * DSIZE)
@@ -219,9 +522,24 @@ void *mm_realloc(void *ptr, size_t size)
     else
         newsize = DSIZE * ALIGN(size + DSIZE);
 
+    if (GET_MAPPED(HDRP(bp)))
+        return mmap_realloc(bp, size, newsize);
+    live = LIVE_SIZE(bp);
+
     /* no need to call malloc if newsize <= oldsize */
     if (newsize <= oldsize)
     {
+        if (size > live)
+            realloc_nocopy++; /* grew into its slack */
+
+        /* keep the slack of a grown block, it will grow again */
+        if (GET_GROWN(HDRP(bp)) && size + DSIZE + WSIZE <= oldsize &&
+            (newsize >= oldsize / 2 || ex_classify(newsize) == ex_classify(oldsize)))
+        {
+            PUT(LIVEP(bp), size);
+            return bp;
+        }
+
         /* split the block (3*DSIZE may be bigger) */
         if (oldsize - newsize >= 3 * DSIZE)
         {
@@ -236,18 +554,38 @@ void *mm_realloc(void *ptr, size_t size)
 
             return oldbp;
         }
-        else
-            return bp;
+        if (GET_GROWN(HDRP(bp)))
+            rl_mark(bp, size);
+        return bp;
     }
 
+    /* a block that grew before gets slack when it grows in place again */
+    gsize = newsize;
+    if (GET_GROWN(HDRP(bp)))
+        gsize += DSIZE * ALIGN(MIN(newsize / 2, CHUNKSIZE));
+
     /* no need to call malloc if oldsize plus prev & next free space enough for newsize */
     char *prev_bp = PREV_BLKP(bp);
     char *next_bp = NEXT_BLKP(bp);
     size_t prev_size = GET_ALLOC(FTRP(prev_bp)) ? 0 : GET_SIZE(FTRP(prev_bp));
     size_t next_size = GET_ALLOC(HDRP(next_bp)) ? 0 : GET_SIZE(HDRP(next_bp));
-    size_t free_size = prev_size + oldsize + next_size - newsize;
+    size_t free_size;
+
+    /* no need to move bp if it is the last block, just move the brk */
+    if (oldsize + next_size < gsize &&
+        (!GET_SIZE(HDRP(next_bp)) || (next_size && !GET_SIZE(HDRP(NEXT_BLKP(next_bp))))))
+    {
+        if (extend_tail(bp, gsize) != NULL)
+        {
+            rl_mark(bp, size);
+            return bp;
+        }
+    }
+
     if (prev_size + oldsize + next_size >= newsize)
     {
+        asize = prev_size + oldsize + next_size >= gsize ? gsize : newsize;
+        free_size = prev_size + oldsize + next_size - asize;
         if (prev_size)
             ex_delete(prev_bp);
         if (next_size)
@@ -258,22 +596,35 @@ void *mm_realloc(void *ptr, size_t size)
         {
             if (prev_size)
             {
-                memmove(prev_bp, bp, oldsize - DSIZE);
+                memmove(prev_bp, bp, live);
+                realloc_copied += live;
                 bp = prev_bp;
             }
+            else
+                realloc_nocopy++;
 
             PUT(HDRP(bp), PACK(prev_size + oldsize + next_size, 1));
             PUT(FTRP(bp), PACK(prev_size + oldsize + next_size, 1));
+            rl_mark(bp, size);
+            CK_TOUCH(bp);
             return bp;
         }
 
         /* split out a free block */
         if (prev_size)
-            memmove(prev_bp, bp, oldsize - DSIZE);
+        {
+            memmove(prev_bp, bp, live);
+            realloc_copied += live;
+        }
         else
+        {
             prev_bp = bp;
-        PUT(HDRP(prev_bp), PACK(newsize, 1));
-        PUT(FTRP(prev_bp), PACK(newsize, 1));
+            realloc_nocopy++;
+        }
+        PUT(HDRP(prev_bp), PACK(asize, 1));
+        PUT(FTRP(prev_bp), PACK(asize, 1));
+        rl_mark(prev_bp, size);
+        CK_TOUCH(prev_bp);
         bp = NEXT_BLKP(prev_bp);
         PUT(HDRP(bp), PACK(free_size, 0));
         PUT(FTRP(bp), PACK(free_size, 0));
@@ -283,15 +634,245 @@ void *mm_realloc(void *ptr, size_t size)
         return prev_bp;
     }
 
-    /* must call malloc for new memory (newsize > oldsize) */
+    /* must call malloc for new memory (newsize > oldsize), slack costs too much space here */
     oldbp = bp;
     if ((bp = mm_malloc(size)) == NULL)
         return NULL;
-    memcpy(bp, oldbp, oldsize - DSIZE);
+    memcpy(bp, oldbp, live);
+    realloc_copied += live;
     mm_free(oldbp);
+    if (!GET_MAPPED(HDRP(bp)))
+        rl_mark(bp, size);
     return bp;
 }
 
+/*
+ * rl_mark - mark an allocated block as GROWN with size live bytes, if its last
+ *           payload word is free to hold that size, else as a plain block
+ */
+static inline void rl_mark(void *bp, size_t size)
+{
+    size_t bsize = GET_SIZE(HDRP(bp));
+
+    if (size + DSIZE + WSIZE <= bsize)
+    {
+        PUT(HDRP(bp), PACK(bsize, GROWN | 1));
+        PUT(FTRP(bp), PACK(bsize, GROWN | 1));
+        PUT(LIVEP(bp), size);
+    }
+    else
+    {
+        PUT(HDRP(bp), PACK(bsize, 1));
+        PUT(FTRP(bp), PACK(bsize, 1));
+    }
+}
+
+/*
+ * mm_malloc_batch - allocate n blocks of size bytes into ptrs, return n or 0 (nothing allocated)
+ *                 - the blocks are cut from one free block, found by one search
+ *                 - a batch that would reach MMAP_THRESHOLD is allocated in parts
+ */
+size_t mm_malloc_batch(size_t n, size_t size, void **ptrs)
+{
+    if (HEAPCHECK && !ck_enter(NULL))
+        exit(0);
+
+    size_t asize, total, part, i;
+    char *bp;
+
+    if (n == 0 || size == 0)
+        return 0;
+
+    /* adjust block size to include overhead and alignment reqs */
+    if (size <= 2 * DSIZE)
+        asize = 3 * DSIZE;
+    else
+        asize = DSIZE * ALIGN(size + DSIZE);
+
+    /* mapped blocks have nothing to share, allocate them one by one */
+    if (asize >= MMAP_THRESHOLD)
+        return batch_each(n, size, ptrs);
+
+    part = (MMAP_THRESHOLD - 1) / asize;
+    if (n > part)
+    {
+        for (i = 0; i < n; i += part)
+        {
+            if (mm_malloc_batch(MIN(part, n - i), size, ptrs + i) == 0)
+            {
+                mm_free_batch(i, ptrs);
+                return 0;
+            }
+        }
+        return n;
+    }
+
+    /* one free block for the whole batch */
+    total = n * asize;
+    if ((bp = ex_find_fit(total)) == NULL && DEFERCOAL && quick_cnt)
+    {
+        qk_flush();
+        bp = ex_find_fit(total);
+    }
+
+    /* no room in one piece, fill the holes one block at a time rather than grow */
+    if (bp == NULL)
+        return batch_each(n, size, ptrs);
+    ex_place(bp, total);
+
+    if (MMSTATS)
+    {
+        stats.req_bytes += n * size;
+        stats.block_bytes += n * asize;
+        stats.alloc_cnt[ex_classify(asize)] += n;
+    }
+
+    /* cut it into n blocks, the last one keeps what was too small to split off */
+    total = GET_SIZE(HDRP(bp));
+    for (i = 0; i < n - 1; i++)
+    {
+        PUT(HDRP(bp), PACK(asize, 1));
+        PUT(FTRP(bp), PACK(asize, 1));
+        ptrs[i] = bp;
+        bp = NEXT_BLKP(bp);
+        total -= asize;
+    }
+    PUT(HDRP(bp), PACK(total, 1));
+    PUT(FTRP(bp), PACK(total, 1));
+    ptrs[n - 1] = bp;
+    return n;
+}
+
+/*
+ * mm_free_batch - free n blocks (NULL entries are skipped), ptrs is sorted in place
+ *               - a run of adjacent blocks becomes one free block, coalesced once
+ */
+void mm_free_batch(size_t n, void **ptrs)
+{
+    if (HEAPCHECK && !ck_enter(NULL))
+        exit(0);
+
+    size_t i, size;
+    char *bp, *endp;
+
+    qsort(ptrs, n, sizeof(void *), ptr_cmp);
+    for (i = 0; i < n;)
+    {
+        bp = ptrs[i++];
+        if (bp == NULL)
+            continue;
+        if (GET_MAPPED(HDRP(bp)))
+        {
+            mem_munmap(bp - DSIZE);
+            continue;
+        }
+
+        /* extend the run while the next pointer is the next block (not the epilogue) */
+        endp = NEXT_BLKP(bp);
+        while (i < n && ptrs[i] == (void *)endp && GET_SIZE(HDRP(endp)))
+        {
+            endp = NEXT_BLKP(endp);
+            i++;
+        }
+
+        size = endp - bp;
+        PUT(HDRP(bp), PACK(size, 0));
+        PUT(FTRP(bp), PACK(size, 0));
+        ex_insert(bp);
+    }
+    trim_heap();
+}
+
+/*
+ * batch_each - mm_malloc_batch one block at a time, return n or 0 (nothing allocated)
+ */
+static size_t batch_each(size_t n, size_t size, void **ptrs)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        if ((ptrs[i] = mm_malloc(size)) == NULL)
+        {
+            mm_free_batch(i, ptrs);
+            return 0;
+        }
+    }
+    return n;
+}
+
+/*
+ * ptr_cmp - order pointers by address for qsort
+ */
+static int ptr_cmp(const void *a, const void *b)
+{
+    char *pa = *(char **)a, *pb = *(char **)b;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * mm_realloc_nocopy - number of reallocs since mm_init that grew a block in place
+ *                   - by moving the brk, taking the free block after it, using
+ *                     slack left by a previous growth or extending its mapping
+ */
+size_t mm_realloc_nocopy(void)
+{
+    return realloc_nocopy;
+}
+
+/*
+ * mm_realloc_copied - payload bytes copied since mm_init by reallocs that moved a block
+ */
+size_t mm_realloc_copied(void)
+{
+    return realloc_copied;
+}
+
+/*
+ * mm_stats - copy the statistics since mm_init into *st, and count the 
+ *            free blocks right now (by walking the free lists)
+ *          - return 0, or -1 if mm.c was compiled without MMSTATS
+ */
+int mm_stats(mm_stats_t *st)
+{
+    int class;
+    char *bp;
+    size_t size;
+
+    memset(st, 0, sizeof(*st));
+    if (!MMSTATS || heap_listp == NULL)
+        return -1;
+
+    *st = stats;
+    st->realloc_nocopy = realloc_nocopy;
+    st->realloc_copied = realloc_copied;
+
+    /* every free block is in exactly one list (or the tree) */
+    for (bp = heap_listp + 2 * WSIZE; GET_SIZE(HDRP(bp)); bp = NEXT_BLKP(bp))
+    {
+        if (GET_ALLOC(HDRP(bp)))
+            continue;
+        size = GET_SIZE(HDRP(bp));
+        st->free_len[ex_classify(size)]++;
+        st->free_bytes += size;
+        st->largest_free = MAX(st->largest_free, size);
+    }
+    st->quick_len = quick_cnt;
+    for (class = 0; class < QCNT; class ++)
+        for (bp = quick_listp[class]; bp != NULL; bp = GET_PREV(bp))
+            st->free_bytes += GET_SIZE(HDRP(bp));
+    return 0;
+}
+
+/*
+ * mm_set_fit - select the search policy used from the next mm_init
+ */
+void mm_set_fit(int policy)
+{
+    fit_policy = policy;
+}
+
 /*
  * mm_check - check heap consistency
  *          - return -1 for uninitialized heap, 1 for consistent, 0 for error
@@ -365,6 +946,13 @@ int mm_check(void)
         if (heap_freep[class] == NULL)
             continue;
 
+        if (IS_TREE(class))
+        {
+            if (tr_check(heap_freep[class], &free_cnt) < 0)
+                return 0;
+            continue;
+        }
+
         bp = heap_freep[class];
         while (1)
         {
@@ -380,6 +968,19 @@ int mm_check(void)
         }
     }
 
+    /* check quick lists, blocks there stay allocated until flushed */
+    for (class = 0; class < QCNT; class ++)
+    {
+        for (bp = quick_listp[class]; bp != NULL; bp = GET_PREV(bp))
+        {
+            if (!GET_ALLOC(HDRP(bp)) || QI(GET_SIZE(HDRP(bp))) != class)
+            {
+                fprintf(stderr, "Heap check error: quick list block error!\n");
+                return 0;
+            }
+        }
+    }
+
     if (free_cnt)
     {
         fprintf(stderr, "Heap check error: free block count(delta=%d) not consistent!\n", free_cnt);
@@ -389,6 +990,143 @@ int mm_check(void)
     return 1;
 }
 
+/*
+ * ck_enter - the incremental heap check (HEAPCHECK 2) at the start of a call,
+ *            bp is the block passed in or NULL
+ *          - return -1 for uninitialized heap, 1 for consistent, 0 for error
+ */
+static int ck_enter(void *bp)
+{
+    char *p, *start;
+    int i;
+
+    if (HEAPCHECK != 2)
+        return mm_check();
+    if (heap_listp == NULL || heap_listp == (void *)-1)
+        return -1;
+    if (++ck_calls % CHECK_FULL == 0 && mm_check() != 1)
+        return 0;
+
+    /* what the last call left behind, and what this one is given */
+    if (ck_last != NULL && !ck_block(ck_last))
+        return 0;
+    ck_last = NULL;
+    if (bp != NULL)
+    {
+        if (!ck_block(bp))
+            return 0;
+        if (!GET_ALLOC(HDRP(bp)))
+        {
+            fprintf(stderr, "Heap check error: block %p passed in is free!\n", bp);
+            return 0;
+        }
+    }
+
+    /* the next blocks of the window, starting over at the epilogue, and
+       no block twice when the heap has fewer than CHECK_WINDOW of them */
+    p = ck_rover;
+    if (p == NULL || p > (char *)mem_heap_hi() || !GET_SIZE(HDRP(p)))
+        p = heap_listp + 2 * WSIZE;
+    start = p;
+    for (i = 0; i < CHECK_WINDOW; i++)
+    {
+        if (!GET_SIZE(HDRP(p)))
+            p = heap_listp + 2 * WSIZE;
+        if (i > 0 && p == start)
+            break;
+        if (!ck_block(p))
+            return 0;
+        p = NEXT_BLKP(p);
+    }
+    ck_rover = p;
+    return 1;
+}
+
+/*
+ * ck_block - check one block (in the heap or mapped) against its neighbours
+ *            and, if it is free, its free list
+ *          - return 1 for consistent, 0 for error
+ */
+static int ck_block(char *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    char *next_bp;
+
+    if ((size_t)bp % DSIZE)
+    {
+        fprintf(stderr, "Heap check error: block %p not aligned!\n", bp);
+        return 0;
+    }
+    if (GET_MAPPED(HDRP(bp)))
+    {
+        if (!GET_ALLOC(HDRP(bp)) || size % mem_pagesize())
+        {
+            fprintf(stderr, "Heap check error: mapped block %p not consistent!\n", bp);
+            return 0;
+        }
+        return 1;
+    }
+
+    if (bp < heap_listp + 2 * WSIZE || size < 3 * DSIZE || size % DSIZE ||
+        bp + size > (char *)mem_heap_hi() + 1)
+    {
+        fprintf(stderr, "Heap check error: block %p out of the heap!\n", bp);
+        return 0;
+    }
+    if (GET(HDRP(bp)) != GET(FTRP(bp)))
+    {
+        fprintf(stderr, "Heap check error: block's head and foot not consistent!\n");
+        return 0;
+    }
+
+    /* the neighbours must start and end where this block says */
+    next_bp = NEXT_BLKP(bp);
+    if (GET(HDRP(PREV_BLKP(bp))) != GET(bp - DSIZE) ||
+        (GET_SIZE(HDRP(next_bp)) &&
+         (next_bp + GET_SIZE(HDRP(next_bp)) > (char *)mem_heap_hi() + 1 ||
+          GET(HDRP(next_bp)) != GET(FTRP(next_bp)))))
+    {
+        fprintf(stderr, "Heap check error: block %p and its neighbours not consistent!\n", bp);
+        return 0;
+    }
+
+    if (GET_ALLOC(HDRP(bp)))
+        return 1;
+    if (!GET_ALLOC(bp - DSIZE) || !GET_ALLOC(HDRP(next_bp)))
+    {
+        fprintf(stderr, "Heap check error: two contiguous free blocks!\n");
+        return 0;
+    }
+    if (!IS_TREE(ex_classify(size)) &&
+        (!ck_in_heap(GET_PREV(bp)) || !ck_in_heap(GET_NEXT(bp)) ||
+         GET_NEXT(GET_PREV(bp)) != bp || GET_PREV(GET_NEXT(bp)) != bp))
+    {
+        fprintf(stderr, "Heap check error: free block %p not linked in its list!\n", bp);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * ck_in_heap - is p a possible block pointer in the heap
+ */
+static inline int ck_in_heap(char *p)
+{
+    return p >= heap_listp + 2 * WSIZE && p <= (char *)mem_heap_hi() &&
+           (size_t)p % DSIZE == 0;
+}
+
+/*
+ * ck_touch - note bp as the block left behind by this call, and move the
+ *            window back to bp if it now points inside bp
+ */
+static inline void ck_touch(char *bp)
+{
+    ck_last = bp;
+    if (ck_rover > bp && ck_rover < bp + GET_SIZE(HDRP(bp)))
+        ck_rover = bp;
+}
+
 /*
  * ex_delete - delete a free block from the explicit list
  */
@@ -401,13 +1139,24 @@ static inline void ex_delete(void *bp)
 
     class = ex_classify(GET_SIZE(HDRP(bp)));
 
+    if (IS_TREE(class))
+    {
+        heap_freep[class] = tr_delete(heap_freep[class], bp);
+        return;
+    }
+
     /* bp is the only one in explicit list */
     if (bp == (void *)GET_NEXT(bp))
     {
         heap_freep[class] = NULL;
+        heap_roverp[class] = NULL;
         return;
     }
 
+    /* move the roving pointer off bp */
+    if (bp == (void *)heap_roverp[class])
+        heap_roverp[class] = GET_NEXT(bp);
+
     /* at least two free blocks in explicit list */
     if (bp == (void *)heap_freep[class])
         heap_freep[class] = GET_NEXT(bp);
@@ -455,6 +1204,13 @@ static void *ex_insert(void *bp)
             return bp;
         class = ex_classify(size);
     }
+    CK_TOUCH(bp);
+
+    if (IS_TREE(class))
+    {
+        heap_freep[class] = tr_insert(heap_freep[class], bp);
+        return bp;
+    }
 
     /* check if the explicit list is valid */
     if (heap_freep[class] == NULL)
@@ -492,6 +1248,13 @@ static void *ex_insert(void *bp)
  */
 static void ex_insert_after(void *prev_bp, void *bp, int class)
 {
+    /* there is no order by address in a tree */
+    if (IS_TREE(class))
+    {
+        heap_freep[class] = tr_insert(heap_freep[class], bp);
+        return;
+    }
+
     /* if prev_bp is NULL then put bp in head */
     if (prev_bp == NULL)
     {
@@ -519,12 +1282,30 @@ static void ex_insert_after(void *prev_bp, void *bp, int class)
 }
 
 /*
- * ex_find_fit - iterate the explicit list to see if there is any free block big enough
+ * ex_find_fit - search the free lists for a block big enough, and count the search
  */
 static inline void *ex_find_fit(size_t asize)
+{
+    size_t steps = stats.search_steps;
+    void *bp = ex_search(asize);
+
+    if (MMSTATS)
+    {
+        stats.search_cnt++;
+        stats.search_max = MAX(stats.search_max, stats.search_steps - steps);
+    }
+    return bp;
+}
+
+/*
+ * ex_search - iterate the explicit list to see if there is any free block big enough
+ *           - first fit starts from the head, next fit from the roving pointer,
+ *           - best fit scans the whole list (or searches the tree)
+ */
+static inline void *ex_search(size_t asize)
 {
     int class;
-    char *bp;
+    char *bp, *startp, *bestp;
 
     for (class = ex_classify(asize); class < FCNT; class ++)
     {
@@ -532,14 +1313,36 @@ static inline void *ex_find_fit(size_t asize)
         if (bp == NULL)
             continue;
 
+        if (IS_TREE(class))
+        {
+            if ((bp = tr_find_fit(bp, asize)) != NULL)
+                return bp;
+            continue;
+        }
+
+        if (fit_policy == MM_FIT_NEXT && heap_roverp[class] != NULL)
+            bp = heap_roverp[class];
+        startp = bp;
+        bestp = NULL;
         while (1)
         {
+            if (MMSTATS)
+                stats.search_steps++;
             if (GET_SIZE(HDRP(bp)) >= asize)
-                return bp;
+            {
+                if (fit_policy == MM_FIT_NEXT)
+                    heap_roverp[class] = bp;
+                if (fit_policy != MM_FIT_BEST || GET_SIZE(HDRP(bp)) == asize)
+                    return bp;
+                if (bestp == NULL || GET_SIZE(HDRP(bp)) < GET_SIZE(HDRP(bestp)))
+                    bestp = bp;
+            }
             bp = GET_NEXT(bp);
-            if (bp == heap_freep[class])
+            if (bp == startp)
                 break;
         }
+        if (bestp != NULL)
+            return bestp;
     }
 
     return NULL;
@@ -559,7 +1362,7 @@ static void ex_place(void *bp, size_t asize)
         char *next_bp;
         int class = ex_classify(fsize - asize);
 
-        if (ex_classify(fsize) == class)
+        if (ex_classify(fsize) == class && !IS_TREE(class))
         {
             next_bp = (char *)bp + asize;
             ex_insert_after(bp, next_bp, class);
@@ -590,6 +1393,7 @@ static void ex_place(void *bp, size_t asize)
         PUT(HDRP(bp), PACK(fsize, 1));
         PUT(FTRP(bp), PACK(fsize, 1));
     }
+    CK_TOUCH(bp);
 }
 
 /*
@@ -598,7 +1402,7 @@ static void ex_place(void *bp, size_t asize)
  */
 static inline void *ex_insert_back(void *bp, int class)
 {
-    if (!GET_ALLOC(FTRP(PREV_BLKP(bp))))
+    if (!GET_ALLOC(FTRP(PREV_BLKP(bp))) || IS_TREE(class))
         return ex_insert(bp);
     else if (heap_freep[class] == NULL)
         ex_insert_after(NULL, bp, class);
@@ -628,7 +1432,9 @@ static inline int ex_classify(size_t size)
  */
 static inline int ex_update(void *bp, size_t newsize)
 {
-    if (ex_classify(GET_SIZE(HDRP(bp))) != ex_classify(newsize))
+    /* a tree block is keyed by its size, it must be reinserted too */
+    if (ex_classify(GET_SIZE(HDRP(bp))) != ex_classify(newsize) ||
+        IS_TREE(ex_classify(newsize)))
     {
         ex_delete(bp);
         PUT(HDRP(bp), PACK(newsize, 0));
@@ -639,6 +1445,236 @@ static inline int ex_update(void *bp, size_t newsize)
     {
         PUT(HDRP(bp), PACK(newsize, 0));
         PUT(FTRP(bp), PACK(newsize, 0));
+        CK_TOUCH(bp);
+        return 0;
+    }
+}
+
+/*
+ * qk_pop - take a block of exactly asize bytes from its quick list, or NULL
+ */
+static inline void *qk_pop(size_t asize)
+{
+    char *bp;
+
+    if (asize > QMAX || (bp = quick_listp[QI(asize)]) == NULL)
+        return NULL;
+
+    quick_listp[QI(asize)] = GET_PREV(bp);
+    quick_cnt--;
+    CK_TOUCH(bp);
+    return bp;
+}
+
+/*
+ * qk_push - put a freed block on its quick list
+ *         - the block keeps its allocated bit, so neighbors won't coalesce with it
+ */
+static inline void qk_push(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+
+    PUT(HDRP(bp), PACK(size, 1));
+    PUT(FTRP(bp), PACK(size, 1));
+    PUT_PREV(bp, quick_listp[QI(size)]);
+    quick_listp[QI(size)] = bp;
+    quick_cnt++;
+}
+
+/*
+ * qk_flush - free every block in the quick lists, with coalescing
+ */
+static void qk_flush(void)
+{
+    int i;
+    char *bp;
+    size_t size;
+
+    for (i = 0; i < QCNT; i++)
+    {
+        while ((bp = quick_listp[i]) != NULL)
+        {
+            quick_listp[i] = GET_PREV(bp);
+            size = GET_SIZE(HDRP(bp));
+            PUT(HDRP(bp), PACK(size, 0));
+            PUT(FTRP(bp), PACK(size, 0));
+            ex_insert(bp);
+        }
+    }
+    quick_cnt = 0;
+}
+
+/*
+ * tr_less - order of tree blocks, by size and then by address
+ */
+#define TR_LESS(a, b) (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) || \
+                       (GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (a) < (b)))
+#define TR_HEIGHT(bp) ((bp) == NULL ? 0 : TREE_HEIGHT(bp))
+
+/*
+ * tr_insert - insert a free block into the tree rooted at root, return the new root
+ */
+static char *tr_insert(char *root, char *bp)
+{
+    if (root == NULL)
+    {
+        TREE_LEFT(bp) = NULL;
+        TREE_RIGHT(bp) = NULL;
+        TREE_HEIGHT(bp) = 1;
+        return bp;
+    }
+
+    if (TR_LESS(bp, root))
+        TREE_LEFT(root) = tr_insert(TREE_LEFT(root), bp);
+    else
+        TREE_RIGHT(root) = tr_insert(TREE_RIGHT(root), bp);
+    return tr_balance(root);
+}
+
+/*
+ * tr_delete - delete a free block from the tree rooted at root, return the new root
+ *           - the block's header must still hold the size it was inserted with
+ */
+static char *tr_delete(char *root, char *bp)
+{
+    char *minp;
+
+    if (root == NULL)
+        return NULL;
+
+    if (root == bp)
+    {
+        if (TREE_LEFT(bp) == NULL)
+            return TREE_RIGHT(bp);
+        if (TREE_RIGHT(bp) == NULL)
+            return TREE_LEFT(bp);
+
+        /* replace bp by its successor */
+        TREE_RIGHT(bp) = tr_delete_min(TREE_RIGHT(bp), &minp);
+        TREE_LEFT(minp) = TREE_LEFT(bp);
+        TREE_RIGHT(minp) = TREE_RIGHT(bp);
+        return tr_balance(minp);
+    }
+
+    if (TR_LESS(bp, root))
+        TREE_LEFT(root) = tr_delete(TREE_LEFT(root), bp);
+    else
+        TREE_RIGHT(root) = tr_delete(TREE_RIGHT(root), bp);
+    return tr_balance(root);
+}
+
+/*
+ * tr_delete_min - unlink the smallest block of the tree into *minp, return the new root
+ */
+static char *tr_delete_min(char *root, char **minp)
+{
+    if (TREE_LEFT(root) == NULL)
+    {
+        *minp = root;
+        return TREE_RIGHT(root);
+    }
+
+    TREE_LEFT(root) = tr_delete_min(TREE_LEFT(root), minp);
+    return tr_balance(root);
+}
+
+/*
+ * tr_balance - restore the AVL property at bp after one of its subtrees changed
+ *            - return the root of the subtree
+ */
+static char *tr_balance(char *bp)
+{
+    char *lp = TREE_LEFT(bp);
+    char *rp = TREE_RIGHT(bp);
+    int diff = TR_HEIGHT(lp) - TR_HEIGHT(rp);
+    char *top;
+
+    if (diff > 1)
+    {
+        /* left heavy, rotate the left-right case into left-left first */
+        if (TR_HEIGHT(TREE_LEFT(lp)) < TR_HEIGHT(TREE_RIGHT(lp)))
+        {
+            top = TREE_RIGHT(lp);
+            TREE_RIGHT(lp) = TREE_LEFT(top);
+            TREE_LEFT(top) = lp;
+            TREE_HEIGHT(lp) = 1 + MAX(TR_HEIGHT(TREE_LEFT(lp)), TR_HEIGHT(TREE_RIGHT(lp)));
+            lp = top;
+        }
+        TREE_LEFT(bp) = TREE_RIGHT(lp);
+        TREE_RIGHT(lp) = bp;
+        TREE_HEIGHT(bp) = 1 + MAX(TR_HEIGHT(TREE_LEFT(bp)), TR_HEIGHT(TREE_RIGHT(bp)));
+        bp = lp;
+    }
+    else if (diff < -1)
+    {
+        /* right heavy, symmetric */
+        if (TR_HEIGHT(TREE_RIGHT(rp)) < TR_HEIGHT(TREE_LEFT(rp)))
+        {
+            top = TREE_LEFT(rp);
+            TREE_LEFT(rp) = TREE_RIGHT(top);
+            TREE_RIGHT(top) = rp;
+            TREE_HEIGHT(rp) = 1 + MAX(TR_HEIGHT(TREE_LEFT(rp)), TR_HEIGHT(TREE_RIGHT(rp)));
+            rp = top;
+        }
+        TREE_RIGHT(bp) = TREE_LEFT(rp);
+        TREE_LEFT(rp) = bp;
+        TREE_HEIGHT(bp) = 1 + MAX(TR_HEIGHT(TREE_LEFT(bp)), TR_HEIGHT(TREE_RIGHT(bp)));
+        bp = rp;
+    }
+
+    TREE_HEIGHT(bp) = 1 + MAX(TR_HEIGHT(TREE_LEFT(bp)), TR_HEIGHT(TREE_RIGHT(bp)));
+    return bp;
+}
+
+/*
+ * tr_find_fit - find the smallest block of at least asize bytes (lowest address on ties)
+ */
+static inline void *tr_find_fit(char *root, size_t asize)
+{
+    char *bestp = NULL;
+
+    while (root != NULL)
+    {
+        if (MMSTATS)
+            stats.search_steps++;
+        if (GET_SIZE(HDRP(root)) >= asize)
+        {
+            bestp = root;
+            root = TREE_LEFT(root);
+        }
+        else
+            root = TREE_RIGHT(root);
+    }
+    return bestp;
+}
+
+/*
+ * tr_check - check the blocks, order and heights of a tree for mm_check
+ *          - return the height of the tree, or -1 for error
+ */
+static int tr_check(char *bp, int *free_cnt)
+{
+    int lh, rh;
+
+    if (bp == NULL)
         return 0;
+
+    if (GET_ALLOC(HDRP(bp)) ||
+        (TREE_LEFT(bp) != NULL && !TR_LESS(TREE_LEFT(bp), bp)) ||
+        (TREE_RIGHT(bp) != NULL && !TR_LESS(bp, TREE_RIGHT(bp))))
+    {
+        fprintf(stderr, "Heap check error: tree block error!\n");
+        return -1;
     }
-}
\ No newline at end of file
+    (*free_cnt)--;
+
+    if ((lh = tr_check(TREE_LEFT(bp), free_cnt)) < 0 ||
+        (rh = tr_check(TREE_RIGHT(bp), free_cnt)) < 0)
+        return -1;
+    if (lh - rh > 1 || rh - lh > 1 || TREE_HEIGHT(bp) != 1 + MAX(lh, rh))
+    {
+        fprintf(stderr, "Heap check error: tree not balanced!\n");
+        return -1;
+    }
+    return TREE_HEIGHT(bp);
+}
@@ -5,6 +5,45 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *bp);
 extern void *mm_realloc(void *ptr, size_t size);
 extern int mm_check(void);
+extern size_t mm_realloc_nocopy(void);
+extern size_t mm_realloc_copied(void);
+
+/* 
+ * batch requests: n blocks of one size, n blocks released together;
+ * mm_free_batch sorts ptrs by address in place, so the caller's array
+ * is reordered
+ */
+extern size_t mm_malloc_batch(size_t n, size_t size, void **ptrs);
+extern void mm_free_batch(size_t n, void **ptrs);
+
+/* fit policies for mm_set_fit, taking effect at the next mm_init */
+#define MM_FIT_FIRST 0
+#define MM_FIT_NEXT  1
+#define MM_FIT_BEST  2
+extern void mm_set_fit(int policy);
+
+/* 
+ * Allocator statistics since the last mm_init, filled in by mm_stats 
+ * when mm.c is compiled with MMSTATS set to 1.
+ */
+#define MM_NCLASS 9 /* size classes of free lists in mm.c */
+typedef struct {
+    size_t alloc_cnt[MM_NCLASS]; /* blocks allocated per size class */
+    size_t mmap_cnt;             /* blocks allocated in their own mapping */
+    size_t free_len[MM_NCLASS];  /* blocks in each free list right now */
+    size_t quick_len;            /* blocks in the quick lists right now */
+    size_t search_cnt;           /* free list searches */
+    size_t search_steps;         /* blocks visited by those searches */
+    size_t search_max;           /* most blocks visited by one search */
+    size_t req_bytes;            /* bytes requested from mm_malloc */
+    size_t block_bytes;          /* block bytes handed out for those requests */
+    size_t free_bytes;           /* bytes in free blocks right now */
+    size_t largest_free;         /* largest free block right now */
+    size_t heap_peak;            /* largest heap size */
+    size_t realloc_nocopy;       /* reallocs that grew a block in place */
+    size_t realloc_copied;       /* payload bytes copied by reallocs that moved a block */
+} mm_stats_t;
+extern int mm_stats(mm_stats_t *stats);
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
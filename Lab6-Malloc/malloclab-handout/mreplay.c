@@ -0,0 +1,241 @@
+/*
+ * mreplay.c - replay a log of the mtrace.so shim with one thread per
+ *             thread of the traced process
+ *
+ *     unix> ./mreplay -a libc app.log
+ *
+ *     Each replay thread makes the requests its thread made, in their
+ * order. A request on a block waits until the requests before it on that
+ * block are done, which for blocks handed between threads may be in
+ * another replay thread; the waits always point to earlier calls, so the
+ * replay cannot deadlock. With -s the requests are made by one thread in
+ * their global order instead, which gives the single-threaded cost of
+ * the same work.
+ *
+ *     The mm and dl allocators run in the memlib heap behind one mutex,
+ * since neither is thread safe; libc malloc is called directly.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "dlmm.h"
+#include "memlib.h"
+#include "mtlog.h"
+
+#define SPINS 64 /* polls of a block before yielding the cpu */
+
+/* An allocator to replay against */
+typedef struct {
+    char *name;
+    int locked;                 /* in the memlib heap, behind the lock */
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} alloc_t;
+
+static int libc_init(void) { return 0; }
+
+static alloc_t allocs[] = {
+    {"libc", 0, libc_init, malloc, free, realloc},
+    {"mm", 1, mm_init, mm_malloc, mm_free, mm_realloc},
+    {"dl", 1, dl_init, dl_malloc, dl_free, dl_realloc},
+};
+
+/* The requests of one replay thread */
+typedef struct {
+    mtop_t **ops;
+    long len;
+    long failed;                /* allocations that returned NULL */
+} stream_t;
+
+static alloc_t *A;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t start;
+static void **blocks;           /* pointer of every block id */
+static int *done;               /* requests done on every block id */
+static int num_ids;
+
+/* Function prototypes */
+static void *replay(void *arg);
+static void run(stream_t *streams, int nstreams, double *secs);
+static int double_cmp(const void *a, const void *b);
+static void usage(void);
+static void app_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    int c, t, k, runs = 5, serial = 0, nstreams;
+    long i, failed;
+    stream_t *streams;
+    mtlog_t *log;
+    mtop_t *op;
+    double *secs;
+    char *name = "libc";
+
+    while ((c = getopt(argc, argv, "ha:k:s")) != EOF) {
+	switch (c) {
+	case 'a': name = optarg; break;
+	case 'k': runs = atoi(optarg); break;
+	case 's': serial = 1; break;
+	case 'h': usage(); exit(0);
+	default: usage(); exit(1);
+	}
+    }
+    for (A = NULL, k = 0; k < sizeof(allocs) / sizeof(alloc_t); k++)
+	if (!strcmp(name, allocs[k].name))
+	    A = &allocs[k];
+    if (A == NULL || runs <= 0 || optind != argc - 1) {
+	usage();
+	exit(1);
+    }
+    log = mtlog_read(argv[optind]);
+    num_ids = log->num_ids;
+    if (A->locked)
+	mem_init();
+
+    /* Split the requests into streams */
+    nstreams = serial ? 1 : log->num_threads;
+    if ((streams = calloc(nstreams, sizeof(stream_t))) == NULL ||
+	(blocks = calloc(log->num_ids, sizeof(void *))) == NULL ||
+	(done = calloc(log->num_ids, sizeof(int))) == NULL ||
+	(secs = calloc(runs, sizeof(double))) == NULL)
+	app_error("mreplay: out of memory");
+    for (i = 0; i < log->num_ops; i++)
+	streams[serial ? 0 : log->ops[i].tid].len++;
+    for (t = 0; t < nstreams; t++) {
+	if ((streams[t].ops = calloc(streams[t].len, sizeof(mtop_t *))) == NULL)
+	    app_error("mreplay: out of memory");
+	streams[t].len = 0;
+    }
+    for (i = 0; i < log->num_ops; i++) {
+	op = &log->ops[i];
+	t = serial ? 0 : op->tid;
+	streams[t].ops[streams[t].len++] = op;
+    }
+
+    for (k = 0; k < runs; k++)
+	run(streams, nstreams, &secs[k]);
+    for (failed = 0, t = 0; t < nstreams; t++)
+	failed += streams[t].failed;
+    qsort(secs, runs, sizeof(double), double_cmp);
+
+    printf("%s, %d thread%s, %ld requests, %d runs\n", A->name, nstreams,
+	   nstreams == 1 ? "" : "s", log->num_ops, runs);
+    printf("best %.6f secs (%.2f Mops/s), median %.6f secs (%.2f Mops/s)\n",
+	   secs[0], log->num_ops / secs[0] / 1e6,
+	   secs[runs / 2], log->num_ops / secs[runs / 2] / 1e6);
+    if (failed > 0)
+	printf("%ld allocations failed\n", failed);
+    mtlog_free(log);
+    exit(0);
+}
+
+/*
+ * run - replay all streams once from a fresh allocator
+ */
+static void run(stream_t *streams, int nstreams, double *secs)
+{
+    pthread_t *tids;
+    struct timespec t0, t1;
+    int t;
+
+    if (A->locked)
+	mem_reset_brk();
+    if (A->init() < 0)
+	app_error("mreplay: allocator init failed");
+    memset(done, 0, num_ids * sizeof(int));
+    for (t = 0; t < nstreams; t++)
+	streams[t].failed = 0;
+    if ((tids = calloc(nstreams, sizeof(pthread_t))) == NULL)
+	app_error("mreplay: out of memory");
+    pthread_barrier_init(&start, NULL, nstreams + 1);
+    for (t = 0; t < nstreams; t++)
+	if (pthread_create(&tids[t], NULL, replay, &streams[t]) != 0)
+	    app_error("mreplay: pthread_create failed");
+    /* before the release, the threads may be done before we run again */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_barrier_wait(&start);
+    for (t = 0; t < nstreams; t++)
+	pthread_join(tids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_barrier_destroy(&start);
+    free(tids);
+    *secs = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+}
+
+/*
+ * replay - the body of a replay thread
+ */
+static void *replay(void *arg)
+{
+    stream_t *s = arg;
+    mtop_t *op;
+    void *p;
+    long i;
+    int spins;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < s->len; i++) {
+	op = s->ops[i];
+	for (spins = 0; __atomic_load_n(&done[op->id], __ATOMIC_ACQUIRE) !=
+		 op->nth; spins++)
+	    if (spins >= SPINS)
+		sched_yield();
+
+	if (A->locked)
+	    pthread_mutex_lock(&lock);
+	switch (op->type) {
+	case 'a':
+	    if ((p = A->malloc(op->size)) == NULL)
+		s->failed++;
+	    else
+		*(char *)p = 1;
+	    blocks[op->id] = p;
+	    break;
+	case 'r':
+	    if ((p = A->realloc(blocks[op->id], op->size)) == NULL)
+		s->failed++;
+	    else
+		blocks[op->id] = p;
+	    break;
+	case 'f':
+	    A->free(blocks[op->id]);
+	    blocks[op->id] = NULL;
+	    break;
+	}
+	if (A->locked)
+	    pthread_mutex_unlock(&lock);
+	__atomic_store_n(&done[op->id], op->nth + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mreplay [-hs] [-a libc|mm|dl] [-k <runs>] <log>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <name>  Allocator to replay against (default libc).\n");
+    fprintf(stderr, "\t-k <runs>  Number of runs (default 5).\n");
+    fprintf(stderr, "\t-s         Replay in one thread, in the global order.\n");
+}
+
+static void app_error(char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
@@ -0,0 +1,301 @@
+/*
+ * mtlog.c - read the binary log of the mtrace.so shim and turn its calls
+ *           into requests on block ids
+ *
+ *     The threads of the traced process flush their buffers one after
+ * another, so the records are first sorted by their global sequence
+ * number. The calls are then replayed on a table from live pointers to
+ * block ids (open addressing, deletion by backward shift): every
+ * allocation gets a fresh id, a realloc keeps the id of its block, and a
+ * free releases it. Calls on pointers the log never saw allocated (blocks
+ * from before the shim was loaded, free(NULL)) are dropped, and so are
+ * failed allocations. A zero-byte request becomes a one-byte one, since
+ * mdriver wants every payload to have an extent.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "mtlog.h"
+
+/* Live pointer to block id table */
+typedef struct {
+    uint64_t ptr;   /* 0 for an empty slot */
+    int id;
+} slot_t;
+
+static slot_t *table = NULL;
+static size_t table_cap = 0, table_len = 0;
+
+/* Per block id: requests so far and current size */
+static int *id_nth = NULL;
+static int *id_size = NULL;
+static int ids_cap = 0;
+
+static long ops_cap = 0;   /* requests room in log->ops */
+static size_t live = 0;    /* bytes live */
+
+/* Function prototypes */
+static int rec_cmp(const void *a, const void *b);
+static size_t hash(uint64_t ptr);
+static int table_find(uint64_t ptr);
+static void table_put(uint64_t ptr, int id);
+static void table_del(uint64_t ptr);
+static int new_id(mtlog_t *log, int size);
+static void release(mtlog_t *log, uint64_t ptr, int id, int tid);
+static void emit(mtlog_t *log, char type, int id, int size, int tid);
+static int clip(uint32_t size);
+static void app_error(char *msg);
+
+/*
+ * mtlog_read - read a log and convert its calls, exits on errors
+ */
+mtlog_t *mtlog_read(char *path)
+{
+    FILE *fp;
+    uint32_t hdr[2];
+    mtrec_t *recs = NULL, *r;
+    size_t nrecs = 0, cap = 0, n, i;
+    mtlog_t *log;
+    int id, k;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+	app_error("mtlog: cannot open the log");
+    if (fread(hdr, sizeof(hdr), 1, fp) != 1 || hdr[0] != MTLOG_MAGIC)
+	app_error("mtlog: not an mtrace log");
+    for (;;) {
+	if (nrecs == cap) {
+	    cap = cap ? 2 * cap : 1 << 16;
+	    if ((recs = realloc(recs, cap * sizeof(mtrec_t))) == NULL)
+		app_error("mtlog: out of memory");
+	}
+	if ((n = fread(recs + nrecs, sizeof(mtrec_t), cap - nrecs, fp)) == 0)
+	    break;
+	nrecs += n;
+    }
+    fclose(fp);
+    qsort(recs, nrecs, sizeof(mtrec_t), rec_cmp);
+
+    if ((log = calloc(1, sizeof(mtlog_t))) == NULL)
+	app_error("mtlog: out of memory");
+    if (table != NULL)
+	memset(table, 0, table_cap * sizeof(slot_t));
+    table_len = 0;
+    ops_cap = 0;
+    live = 0;
+    for (i = 0; i < nrecs; i++) {
+	r = &recs[i];
+	if (r->tid >= log->num_threads)
+	    log->num_threads = r->tid + 1;
+	switch (r->op) {
+	case MT_MALLOC:
+	case MT_CALLOC:
+	    if (r->ptr == 0)
+		break;
+	    /* freed behind the shim's back, e.g. by a static libc */
+	    if ((id = table_find(r->ptr)) >= 0)
+		release(log, r->ptr, id, r->tid);
+	    id = new_id(log, clip(r->size));
+	    table_put(r->ptr, id);
+	    live += id_size[id];
+	    emit(log, 'a', id, id_size[id], r->tid);
+	    break;
+
+	case MT_FREE:
+	    if (r->ptr == 0)
+		break;
+	    if ((id = table_find(r->ptr)) < 0) {
+		log->dropped++;
+		break;
+	    }
+	    release(log, r->ptr, id, r->tid);
+	    break;
+
+	case MT_REALLOC:
+	    id = r->old ? table_find(r->old) : -1;
+	    if (r->old && id < 0)
+		log->dropped++;
+	    if (r->ptr == 0) {
+		/* realloc(p, 0) frees p, any other failure leaves it */
+		if (id >= 0 && r->size == 0)
+		    release(log, r->old, id, r->tid);
+		break;
+	    }
+	    if (id >= 0)
+		table_del(r->old);
+	    if ((k = table_find(r->ptr)) >= 0)
+		release(log, r->ptr, k, r->tid);
+	    if (id < 0) {
+		id = new_id(log, clip(r->size));
+		live += id_size[id];
+		emit(log, 'a', id, id_size[id], r->tid);
+	    }
+	    else {
+		live -= id_size[id];
+		id_size[id] = clip(r->size);
+		live += id_size[id];
+		emit(log, 'r', id, id_size[id], r->tid);
+	    }
+	    table_put(r->ptr, id);
+	    break;
+	}
+	if (live > log->peak)
+	    log->peak = live;
+    }
+    free(recs);
+    return log;
+}
+
+/*
+ * mtlog_free - free a converted log
+ */
+void mtlog_free(mtlog_t *log)
+{
+    free(log->ops);
+    free(log);
+}
+
+/*
+ * rec_cmp - order records by sequence number
+ */
+static int rec_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const mtrec_t *)a)->seq, y = ((const mtrec_t *)b)->seq;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * hash - slot of a pointer, whose low bits are mostly zero
+ */
+static size_t hash(uint64_t ptr)
+{
+    return (size_t)((ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 20) & (table_cap - 1);
+}
+
+/*
+ * table_find - id of a live pointer, or -1
+ */
+static int table_find(uint64_t ptr)
+{
+    size_t i;
+
+    if (table_cap == 0)
+	return -1;
+    for (i = hash(ptr); table[i].ptr != 0; i = (i + 1) & (table_cap - 1))
+	if (table[i].ptr == ptr)
+	    return table[i].id;
+    return -1;
+}
+
+/*
+ * table_put - map a new live pointer to id, growing the table at 1/2 full
+ */
+static void table_put(uint64_t ptr, int id)
+{
+    slot_t *old = table;
+    size_t old_cap = table_cap, i;
+
+    if (2 * (table_len + 1) > table_cap) {
+	table_cap = table_cap ? 2 * table_cap : 1 << 16;
+	if ((table = calloc(table_cap, sizeof(slot_t))) == NULL)
+	    app_error("mtlog: out of memory");
+	table_len = 0;
+	for (i = 0; i < old_cap; i++)
+	    if (old[i].ptr != 0)
+		table_put(old[i].ptr, old[i].id);
+	free(old);
+    }
+    for (i = hash(ptr); table[i].ptr != 0; i = (i + 1) & (table_cap - 1))
+	;
+    table[i].ptr = ptr;
+    table[i].id = id;
+    table_len++;
+}
+
+/*
+ * table_del - remove a live pointer, shifting back the slots after it
+ *     that would no longer be found
+ */
+static void table_del(uint64_t ptr)
+{
+    size_t i, j, k, mask = table_cap - 1;
+
+    for (i = hash(ptr); table[i].ptr != ptr; i = (i + 1) & mask)
+	;
+    for (j = (i + 1) & mask; table[j].ptr != 0; j = (j + 1) & mask) {
+	k = hash(table[j].ptr);
+	/* leave j alone if its home k lies cyclically in (i, j] */
+	if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+	    continue;
+	table[i] = table[j];
+	i = j;
+    }
+    table[i].ptr = 0;
+    table_len--;
+}
+
+/*
+ * new_id - a fresh block id of the given size
+ */
+static int new_id(mtlog_t *log, int size)
+{
+    int id = log->num_ids++;
+
+    if (id == ids_cap) {
+	ids_cap = ids_cap ? 2 * ids_cap : 1 << 16;
+	if ((id_nth = realloc(id_nth, ids_cap * sizeof(int))) == NULL ||
+	    (id_size = realloc(id_size, ids_cap * sizeof(int))) == NULL)
+	    app_error("mtlog: out of memory");
+    }
+    id_nth[id] = 0;
+    id_size[id] = size;
+    return id;
+}
+
+/*
+ * release - free the block id at live pointer ptr
+ */
+static void release(mtlog_t *log, uint64_t ptr, int id, int tid)
+{
+    live -= id_size[id];
+    table_del(ptr);
+    emit(log, 'f', id, 0, tid);
+}
+
+/*
+ * emit - append a request on id
+ */
+static void emit(mtlog_t *log, char type, int id, int size, int tid)
+{
+    mtop_t *op;
+
+    if (log->num_ops == ops_cap) {
+	ops_cap = ops_cap ? 2 * ops_cap : 1 << 16;
+	if ((log->ops = realloc(log->ops, ops_cap * sizeof(mtop_t))) == NULL)
+	    app_error("mtlog: out of memory");
+    }
+    op = &log->ops[log->num_ops++];
+    op->type = type;
+    op->id = id;
+    op->size = size;
+    op->nth = id_nth[id]++;
+    op->tid = tid;
+}
+
+/*
+ * clip - a request size that mdriver accepts
+ */
+static int clip(uint32_t size)
+{
+    if (size == 0)
+	return 1;
+    return size > INT_MAX ? INT_MAX : (int)size;
+}
+
+static void app_error(char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
@@ -0,0 +1,50 @@
+/*
+ * mtlog.h - the binary allocation log written by the mtrace.so shim, and
+ *           its conversion into block requests for mtrace2rep and mreplay
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#define MTLOG_MAGIC 0x4c52544dU /* "MTRL" at the start of every log */
+
+/* Calls recorded by the shim */
+#define MT_MALLOC  1
+#define MT_FREE    2
+#define MT_REALLOC 3
+#define MT_CALLOC  4
+
+/* One call, as the shim writes it (32 bytes, native byte order) */
+typedef struct {
+    uint64_t seq;   /* global order of the calls */
+    uint64_t ptr;   /* block returned, or the block freed */
+    uint64_t old;   /* block passed to realloc */
+    uint32_t size;  /* bytes requested, saturated at UINT32_MAX */
+    uint16_t tid;   /* thread, numbered in order of their first call */
+    uint8_t op;     /* MT_MALLOC ... MT_CALLOC */
+    uint8_t pad;
+} mtrec_t;
+
+/*
+ * One request on a block id, with the pointers of the process remapped
+ * to ids. The nth request on an id must wait for the n before it, which
+ * may come from other threads.
+ */
+typedef struct {
+    char type;      /* 'a', 'f' or 'r', as in a .rep file */
+    int id;         /* block id */
+    int size;       /* bytes, for 'a' and 'r' */
+    int nth;        /* number of earlier requests on this id */
+    int tid;        /* thread that made the request */
+} mtop_t;
+
+typedef struct {
+    mtop_t *ops;    /* requests in global order */
+    long num_ops;
+    int num_ids;
+    int num_threads;
+    size_t peak;    /* most bytes live at once */
+    long dropped;   /* calls on pointers the log never saw allocated */
+} mtlog_t;
+
+extern mtlog_t *mtlog_read(char *path);
+extern void mtlog_free(mtlog_t *log);
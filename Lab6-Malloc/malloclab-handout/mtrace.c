@@ -0,0 +1,370 @@
+/*
+ * mtrace.c - an LD_PRELOAD shim that logs the malloc, calloc, realloc and
+ *            free calls of a process, for mtrace2rep and mreplay
+ *
+ *     unix> LD_PRELOAD=./mtrace.so MTRACE_LOG=app.log ./app
+ *
+ *     Every thread appends its calls to a buffer of its own, with no lock
+ * on the way; only a global sequence number is taken with an atomic add,
+ * after the call for malloc and calloc but before it for free and realloc
+ * (which frees the old block inside the call, while its record waits for
+ * the new pointer), so that a block freed in one thread and handed out
+ * again in another stays in order. A full buffer is written to the log
+ * with one write(2) on an O_APPEND descriptor, so the buffers of the
+ * threads never interleave inside a chunk. A buffer is flushed when its
+ * thread exits and handed to the next new thread; all buffers are
+ * flushed when the process exits (the calls of threads still running
+ * then may be lost).
+ *
+ *     The log is MTRACE_LOG, or mtrace.<pid>.log; a "%d" in MTRACE_LOG is
+ * replaced by the pid, so that children of the process, which inherit
+ * the shim, get logs of their own. Blocks from memalign and friends are
+ * not seen, so their frees are dropped by the converter.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "mtlog.h"
+
+#define BUF_RECS (1 << 14) /* records in a thread buffer (512KB) */
+#define BOOT_SIZE 4096     /* bytes for dlsym's calloc before the real one */
+
+/* The buffer of one thread, on the list of all buffers */
+typedef struct tbuf {
+    struct tbuf *next;
+    int owned;             /* held by a live thread */
+    int len;               /* records in recs */
+    uint16_t tid;          /* thread of the records */
+    mtrec_t recs[BUF_RECS];
+} tbuf_t;
+
+/* The real allocator */
+static void *(*real_malloc)(size_t size);
+static void (*real_free)(void *ptr);
+static void *(*real_realloc)(void *ptr, size_t size);
+static void *(*real_calloc)(size_t n, size_t size);
+
+static char boot_buf[BOOT_SIZE];
+static size_t boot_used = 0;
+static int initializing = 0;    /* looking up the real allocator */
+
+static int log_fd = -1;
+static int log_state = 0;       /* 0 closed, 1 opening, 2 open */
+static uint64_t seq_next = 0;
+static uint16_t tid_next = 0;
+static tbuf_t *all_bufs = NULL; /* pushed with CAS, never popped */
+static pthread_key_t buf_key;
+
+static __thread tbuf_t *my_buf = NULL;
+static __thread int in_shim = 0;  /* inside the shim, don't log */
+
+/* Function prototypes */
+static void init_syms(void);
+static void *boot_alloc(size_t size);
+static void open_log(void);
+static tbuf_t *adopt(void);
+static void release(void *arg);
+static void flush(tbuf_t *b);
+static void record(int op, void *ptr, void *old, size_t size);
+static mtrec_t *reserve(int op, void *old, size_t size);
+static void commit(void);
+static void after_fork(void);
+static void __attribute__((constructor)) mtrace_init(void);
+static void __attribute__((destructor)) mtrace_fini(void);
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (real_malloc == NULL) {
+	if (initializing)
+	    return boot_alloc(size);
+	init_syms();
+    }
+    p = real_malloc(size);
+    record(MT_MALLOC, p, NULL, size);
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p;
+
+    if (real_calloc == NULL) {
+	if (initializing)
+	    return boot_alloc(n * size);
+	init_syms();
+    }
+    p = real_calloc(n, size);
+    record(MT_CALLOC, p, NULL,
+	   size && n > (size_t)-1 / size ? (size_t)-1 : n * size);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    mtrec_t *r;
+
+    if (real_realloc == NULL) {
+	if (initializing)
+	    return NULL;
+	init_syms();
+    }
+    if ((char *)ptr >= boot_buf && (char *)ptr < boot_buf + BOOT_SIZE) {
+	if ((p = malloc(size)) != NULL)
+	    memcpy(p, ptr, size < boot_buf + BOOT_SIZE - (char *)ptr ?
+		   size : boot_buf + BOOT_SIZE - (char *)ptr);
+	return p;
+    }
+    if (in_shim)
+	return real_realloc(ptr, size);
+    in_shim++;
+    r = reserve(MT_REALLOC, ptr, size);
+    p = real_realloc(ptr, size);
+    if (r != NULL) {
+	r->ptr = (uintptr_t)p;
+	commit();
+    }
+    in_shim--;
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL ||
+	((char *)ptr >= boot_buf && (char *)ptr < boot_buf + BOOT_SIZE))
+	return;
+    if (real_free == NULL)
+	init_syms();
+    record(MT_FREE, ptr, NULL, 0);
+    real_free(ptr);
+}
+
+/*
+ * init_syms - find the allocator the shim sits in front of
+ */
+static void init_syms(void)
+{
+    initializing = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    if (!real_malloc || !real_free || !real_realloc || !real_calloc) {
+	fprintf(stderr, "mtrace: cannot find the real allocator\n");
+	_exit(1);
+    }
+    initializing = 0;
+}
+
+/*
+ * boot_alloc - zeroed memory for dlsym, which may allocate while the 
+ *     real allocator is being looked up; it is never freed
+ */
+static void *boot_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (boot_used + size > BOOT_SIZE)
+	return NULL;
+    p = boot_buf + boot_used;
+    boot_used += size;
+    return p;
+}
+
+/*
+ * open_log - open the log and write its header, once; the threads that
+ *     lose the race wait for the winner
+ */
+static void open_log(void)
+{
+    char path[1024], pid[16], *fmt, *d;
+    uint32_t hdr[2] = {MTLOG_MAGIC, 1};
+    int state = 0;
+
+    if (!__atomic_compare_exchange_n(&log_state, &state, 1, 0,
+				     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+	while (__atomic_load_n(&log_state, __ATOMIC_ACQUIRE) != 2)
+	    sched_yield();
+	return;
+    }
+    if ((fmt = getenv("MTRACE_LOG")) == NULL)
+	fmt = "mtrace.%d.log";
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if ((d = strstr(fmt, "%d")) != NULL)
+	snprintf(path, sizeof(path), "%.*s%s%s", (int)(d - fmt), fmt, pid, d + 2);
+    else
+	snprintf(path, sizeof(path), "%s", fmt);
+    log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		  0644);
+    if (log_fd < 0 || write(log_fd, hdr, sizeof(hdr)) != sizeof(hdr))
+	fprintf(stderr, "mtrace: cannot write %s\n", path);
+    __atomic_store_n(&log_state, 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * adopt - give the calling thread a buffer, a released one if there is
+ *     one, else a new one
+ */
+static tbuf_t *adopt(void)
+{
+    tbuf_t *b;
+    int owned;
+
+    for (b = __atomic_load_n(&all_bufs, __ATOMIC_ACQUIRE); b; b = b->next) {
+	owned = 0;
+	if (__atomic_compare_exchange_n(&b->owned, &owned, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	    break;
+    }
+    if (b == NULL) {
+	b = mmap(NULL, sizeof(tbuf_t), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b == MAP_FAILED)
+	    return NULL;
+	b->owned = 1;
+	b->next = __atomic_load_n(&all_bufs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&all_bufs, &b->next, b, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+    b->tid = __atomic_fetch_add(&tid_next, 1, __ATOMIC_RELAXED);
+    my_buf = b;
+    pthread_setspecific(buf_key, b);
+    return b;
+}
+
+/*
+ * release - at thread exit, flush the thread's buffer and give it up
+ */
+static void release(void *arg)
+{
+    tbuf_t *b = arg;
+
+    in_shim++;
+    flush(b);
+    my_buf = NULL;
+    __atomic_store_n(&b->owned, 0, __ATOMIC_RELEASE);
+    in_shim--;
+}
+
+/*
+ * flush - write out the records of a buffer
+ */
+static void flush(tbuf_t *b)
+{
+    char *p = (char *)b->recs;
+    size_t left = b->len * sizeof(mtrec_t);
+    ssize_t n;
+
+    if (b->len == 0)
+	return;
+    if (__atomic_load_n(&log_state, __ATOMIC_ACQUIRE) != 2)
+	open_log();
+    while (left > 0 && log_fd >= 0 && (n = write(log_fd, p, left)) > 0) {
+	p += n;
+	left -= n;
+    }
+    b->len = 0;
+}
+
+/*
+ * record - append a call to the buffer of the calling thread
+ */
+static void record(int op, void *ptr, void *old, size_t size)
+{
+    mtrec_t *r;
+
+    if (in_shim)
+	return;
+    in_shim++;
+    if ((r = reserve(op, old, size)) != NULL) {
+	r->ptr = (uintptr_t)ptr;
+	commit();
+    }
+    in_shim--;
+}
+
+/*
+ * reserve - take the next sequence number for a call, in the next record
+ *     of the calling thread's buffer, which commit appends once its ptr
+ *     is filled in; NULL if the thread has no buffer. Called in the shim.
+ */
+static mtrec_t *reserve(int op, void *old, size_t size)
+{
+    tbuf_t *b;
+    mtrec_t *r;
+
+    if ((b = my_buf) == NULL && (b = adopt()) == NULL)
+	return NULL;
+    r = &b->recs[b->len];
+    r->seq = __atomic_fetch_add(&seq_next, 1, __ATOMIC_RELAXED);
+    r->ptr = 0;
+    r->old = (uintptr_t)old;
+    r->size = size > UINT32_MAX ? UINT32_MAX : size;
+    r->tid = b->tid;
+    r->op = op;
+    r->pad = 0;
+    return r;
+}
+
+/*
+ * commit - append the record reserve handed out
+ */
+static void commit(void)
+{
+    tbuf_t *b = my_buf;
+
+    if (++b->len == BUF_RECS)
+	flush(b);
+}
+
+/*
+ * after_fork - the child starts a log of its own, without the records
+ *     the parent had not flushed yet, and takes back the buffers of the
+ *     threads that did not come along
+ */
+static void after_fork(void)
+{
+    tbuf_t *b;
+
+    if (log_fd >= 0)
+	close(log_fd);
+    log_fd = -1;
+    log_state = 0;
+    for (b = all_bufs; b != NULL; b = b->next) {
+	b->len = 0;
+	if (b != my_buf)
+	    b->owned = 0;
+    }
+}
+
+static void mtrace_init(void)
+{
+    in_shim++;
+    if (real_malloc == NULL)
+	init_syms();
+    pthread_key_create(&buf_key, release);
+    pthread_atfork(NULL, NULL, after_fork);
+    in_shim--;
+}
+
+static void mtrace_fini(void)
+{
+    tbuf_t *b;
+
+    in_shim++;
+    for (b = __atomic_load_n(&all_bufs, __ATOMIC_ACQUIRE); b; b = b->next)
+	flush(b);
+    in_shim--;
+}
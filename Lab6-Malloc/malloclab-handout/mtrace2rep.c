@@ -0,0 +1,117 @@
+/*
+ * mtrace2rep.c - convert a log of the mtrace.so shim into an mdriver trace
+ *
+ *     unix> LD_PRELOAD=./mtrace.so MTRACE_LOG=app.log ./app
+ *     unix> ./mtrace2rep -o app.rep app.log
+ *     unix> ./mdriver -V -f app.rep
+ *
+ *     The calls of all threads are merged in their global order, and the
+ * pointers of the process become block ids (see mtlog.c). The suggested
+ * heap size in the header is the most bytes the process had live at once.
+ * The blocks still live when the process exited are freed at the end, so
+ * the trace is balanced. The threads of the process are lost in the
+ * trace; mreplay replays them in parallel straight from the log.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mtlog.h"
+
+/* Function prototypes */
+static void write_op(FILE *fp, mtop_t *op);
+static void usage(void);
+static void app_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    int c, id, *alloc_tid, *is_live;
+    long i, nlive = 0, cross = 0;
+    char *out = NULL;
+    FILE *fp;
+    mtlog_t *log;
+    mtop_t *op, fin;
+
+    while ((c = getopt(argc, argv, "ho:")) != EOF) {
+	switch (c) {
+	case 'o': out = optarg; break;
+	case 'h': usage(); exit(0);
+	default: usage(); exit(1);
+	}
+    }
+    if (optind != argc - 1) {
+	usage();
+	exit(1);
+    }
+    log = mtlog_read(argv[optind]);
+
+    /* Blocks still live at the end, and frees in another thread */
+    if ((alloc_tid = calloc(log->num_ids + 1, sizeof(int))) == NULL ||
+	(is_live = calloc(log->num_ids + 1, sizeof(int))) == NULL)
+	app_error("mtrace2rep: out of memory");
+    for (i = 0; i < log->num_ops; i++) {
+	op = &log->ops[i];
+	if (op->type == 'a') {
+	    alloc_tid[op->id] = op->tid;
+	    is_live[op->id] = 1;
+	    nlive++;
+	}
+	else if (op->type == 'f') {
+	    is_live[op->id] = 0;
+	    nlive--;
+	    if (op->tid != alloc_tid[op->id])
+		cross++;
+	}
+    }
+
+    if (out == NULL)
+	fp = stdout;
+    else if ((fp = fopen(out, "w")) == NULL)
+	app_error("mtrace2rep: cannot open the output file");
+    fprintf(fp, "%lu\n%d\n%ld\n%d\n", (unsigned long)log->peak, log->num_ids,
+	    log->num_ops + nlive, 1);
+    for (i = 0; i < log->num_ops; i++)
+	write_op(fp, &log->ops[i]);
+    for (id = 0; id < log->num_ids; id++) {
+	if (is_live[id]) {
+	    fin.type = 'f';
+	    fin.id = id;
+	    write_op(fp, &fin);
+	}
+    }
+    if (fp != stdout)
+	fclose(fp);
+
+    fprintf(stderr, "%ld requests, %d blocks, %d threads, peak %lu bytes\n",
+	    log->num_ops, log->num_ids, log->num_threads,
+	    (unsigned long)log->peak);
+    fprintf(stderr, "%ld freed in another thread, %ld live at exit, "
+	    "%ld calls on unknown blocks dropped\n", cross, nlive, log->dropped);
+    mtlog_free(log);
+    exit(0);
+}
+
+/*
+ * write_op - one request as a .rep line
+ */
+static void write_op(FILE *fp, mtop_t *op)
+{
+    if (op->type == 'f')
+	fprintf(fp, "f %d\n", op->id);
+    else
+	fprintf(fp, "%c %d %d\n", op->type, op->id, op->size);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mtrace2rep [-h] [-o <file>] <log>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-o <file>  Output file (default stdout).\n");
+}
+
+static void app_error(char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
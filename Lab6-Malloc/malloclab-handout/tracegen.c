@@ -0,0 +1,332 @@
+/*
+ * tracegen.c - generate synthetic mdriver traces from parametric models
+ * 
+ *     The clock is the number of allocations. At every tick one block is 
+ * allocated with a size drawn from the size model and a lifetime drawn 
+ * from the lifetime model, and every realloc and free whose time has come
+ * is written out (a min-heap of pending events keeps them in order).
+ * 
+ *     size models    power    Pareto from the minimum size, clipped at max
+ *                    bimodal  90% in [min, 4*min], 10% in [max/4, max]
+ *                    hist     "size weight" lines of an observed histogram
+ *     lifetimes      exp      exponential with the given mean
+ *                    power    Pareto (alpha 1.5) with the given mean
+ *     realloc chains a fraction of the blocks is reallocated 1 to 8 times
+ *                    during its life, growing by a factor each time
+ *     phases         the run is cut into phases; phase i scales the sizes 
+ *                    by 2^(i mod 3), and odd phases live 4 times longer
+ * 
+ *     When the requested number of ops is reached, the blocks still alive
+ * are freed, so the trace is balanced. The ops are spooled to a temporary
+ * file, since the header needs their count.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#define MAXLINE 1024
+#define MAXHIST 4096      /* most buckets in a histogram file */
+#define MAXSIZE (1<<24)   /* no block grows beyond this */
+
+/* A pending realloc or free of block id */
+typedef struct {
+    double time;
+    int id;
+    int is_free;
+} event_t;
+
+/* Model parameters */
+static long nops = 1000000;
+static char *size_model = "power";
+static char *life_model = "exp";
+static int minsize = 16, maxsize = 65536;
+static double alpha = 1.2;      /* Pareto shape of the power size model */
+static double mean_life = 1000; /* in allocations */
+static double chain_frac = 0.05;
+static double growth = 1.5;
+static int nphases = 1;
+
+/* Observed histogram */
+static int hist_size[MAXHIST];
+static double hist_cum[MAXHIST];
+static int hist_len = 0;
+
+/* Event heap, ordered by time, frees after reallocs at the same time */
+#define EV_LESS(a, b) ((a).time < (b).time || \
+		       ((a).time == (b).time && (a).is_free < (b).is_free))
+static event_t *heap = NULL;
+static int heap_len = 0, heap_cap = 0;
+
+/* Current size of every block, indexed by id */
+static int *cur_size = NULL;
+static int ids_cap = 0;
+
+/* Function prototypes */
+static double urand(void);
+static int draw_size(int phase);
+static double draw_life(int phase);
+static void read_hist(char *path);
+static void heap_push(double time, int id, int is_free);
+static event_t heap_pop(void);
+static void usage(void);
+static void app_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    int c, id, nids = 0, phase, k, j, size;
+    long emitted = 0, nallocs = 0;
+    double now, life;
+    unsigned seed = 1;
+    char *out = NULL;
+    FILE *body, *fp;
+    event_t ev;
+    char buf[1 << 16];
+    size_t n;
+
+    while ((c = getopt(argc, argv, "hn:z:H:m:M:a:l:t:r:g:p:s:o:")) != EOF) {
+	switch (c) {
+	case 'n': nops = atol(optarg); break;
+	case 'z': size_model = optarg; break;
+	case 'H': size_model = "hist"; read_hist(optarg); break;
+	case 'm': minsize = atoi(optarg); break;
+	case 'M': maxsize = atoi(optarg); break;
+	case 'a': alpha = atof(optarg); break;
+	case 'l': life_model = optarg; break;
+	case 't': mean_life = atof(optarg); break;
+	case 'r': chain_frac = atof(optarg); break;
+	case 'g': growth = atof(optarg); break;
+	case 'p': nphases = atoi(optarg); break;
+	case 's': seed = atoi(optarg); break;
+	case 'o': out = optarg; break;
+	case 'h': usage(); exit(0);
+	default: usage(); exit(1);
+	}
+    }
+    if (nops <= 0 || minsize <= 0 || maxsize < minsize || alpha <= 0 ||
+	mean_life <= 0 || nphases <= 0 || growth < 1 ||
+	(strcmp(size_model, "power") && strcmp(size_model, "bimodal") &&
+	 strcmp(size_model, "hist")) ||
+	(strcmp(life_model, "exp") && strcmp(life_model, "power"))) {
+	usage();
+	exit(1);
+    }
+    if (!strcmp(size_model, "hist") && hist_len == 0)
+	app_error("tracegen: the hist size model needs -H <file>");
+    srand48(seed);
+
+    if ((body = tmpfile()) == NULL)
+	app_error("tracegen: tmpfile failed");
+
+    /* One allocation per tick, then whatever is due */
+    for (now = 0; emitted < nops; now++) {
+	phase = (int)(emitted * nphases / nops);
+
+	if (nids == ids_cap) {
+	    ids_cap = ids_cap ? 2 * ids_cap : 1 << 16;
+	    if ((cur_size = realloc(cur_size, ids_cap * sizeof(int))) == NULL)
+		app_error("tracegen: out of memory");
+	}
+	id = nids++;
+	cur_size[id] = draw_size(phase);
+	fprintf(body, "a %d %d\n", id, cur_size[id]);
+	emitted++;
+	nallocs++;
+
+	life = draw_life(phase);
+	if (urand() < chain_frac) {
+	    k = 1 + (int)(urand() * 8);
+	    for (j = 1; j <= k; j++)
+		heap_push(now + life * j / (k + 1), id, 0);
+	}
+	heap_push(now + life, id, 1);
+
+	while (heap_len > 0 && heap[0].time <= now && emitted < nops) {
+	    ev = heap_pop();
+	    if (ev.is_free) {
+		fprintf(body, "f %d\n", ev.id);
+	    }
+	    else {
+		size = (int)(cur_size[ev.id] * growth) + 1;
+		cur_size[ev.id] = size < MAXSIZE ? size : MAXSIZE;
+		fprintf(body, "r %d %d\n", ev.id, cur_size[ev.id]);
+	    }
+	    emitted++;
+	}
+    }
+
+    /* Free what is still alive, in order of death */
+    while (heap_len > 0) {
+	ev = heap_pop();
+	if (ev.is_free) {
+	    fprintf(body, "f %d\n", ev.id);
+	    emitted++;
+	}
+    }
+
+    /* Header, then the spooled ops */
+    if (out == NULL)
+	fp = stdout;
+    else if ((fp = fopen(out, "w")) == NULL)
+	app_error("tracegen: cannot open the output file");
+    fprintf(fp, "%d\n%d\n%ld\n%d\n", 0, nids, emitted, 1);
+    rewind(body);
+    while ((n = fread(buf, 1, sizeof(buf), body)) > 0)
+	if (fwrite(buf, 1, n, fp) != n)
+	    app_error("tracegen: write failed");
+    fclose(body);
+    if (fp != stdout)
+	fclose(fp);
+
+    fprintf(stderr, "%ld ops, %ld allocations\n", emitted, nallocs);
+    exit(0);
+}
+
+/*
+ * urand - uniform in [0, 1)
+ */
+static double urand(void)
+{
+    return drand48();
+}
+
+/*
+ * draw_size - a block size from the size model, scaled for the phase
+ */
+static int draw_size(int phase)
+{
+    double size, u = urand();
+    int lo, hi, mid;
+
+    if (!strcmp(size_model, "power"))
+	size = minsize * pow(1 - u, -1 / alpha);
+    else if (!strcmp(size_model, "bimodal"))
+	size = u < 0.9 ? minsize + urand() * 3 * minsize :
+	    maxsize / 4 + urand() * (maxsize - maxsize / 4);
+    else {
+	/* first bucket whose cumulative weight passes u */
+	u *= hist_cum[hist_len - 1];
+	for (lo = 0, hi = hist_len - 1; lo < hi;) {
+	    mid = (lo + hi) / 2;
+	    if (hist_cum[mid] > u)
+		hi = mid;
+	    else
+		lo = mid + 1;
+	}
+	size = hist_size[lo];
+    }
+    if (size > maxsize)
+	size = maxsize;
+    return (int)size << (phase % 3);
+}
+
+/*
+ * draw_life - a lifetime (in allocations) from the lifetime model
+ */
+static double draw_life(int phase)
+{
+    double mean = mean_life * (phase % 2 ? 4 : 1);
+    double u = urand();
+
+    if (!strcmp(life_model, "exp"))
+	return -mean * log(1 - u);
+    /* Pareto with shape 1.5 has mean 3 * scale */
+    return mean / 3 * pow(1 - u, -1 / 1.5);
+}
+
+/*
+ * read_hist - read "size weight" lines into the histogram
+ */
+static void read_hist(char *path)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    int size;
+    double weight, total = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	app_error("tracegen: cannot open the histogram file");
+    while (fgets(line, sizeof(line), fp) != NULL && hist_len < MAXHIST) {
+	if (sscanf(line, "%d %lf", &size, &weight) != 2 || size <= 0 ||
+	    weight <= 0)
+	    continue;
+	total += weight;
+	hist_size[hist_len] = size;
+	hist_cum[hist_len++] = total;
+    }
+    fclose(fp);
+}
+
+/*
+ * heap_push - add an event to the heap
+ */
+static void heap_push(double time, int id, int is_free)
+{
+    int i = heap_len++, parent;
+    event_t ev;
+
+    if (heap_len > heap_cap) {
+	heap_cap = heap_cap ? 2 * heap_cap : 1 << 12;
+	if ((heap = realloc(heap, heap_cap * sizeof(event_t))) == NULL)
+	    app_error("tracegen: out of memory");
+    }
+    ev.time = time;
+    ev.id = id;
+    ev.is_free = is_free;
+    for (; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (!EV_LESS(ev, heap[parent]))
+	    break;
+	heap[i] = heap[parent];
+    }
+    heap[i] = ev;
+}
+
+/*
+ * heap_pop - remove the earliest event from the heap
+ */
+static event_t heap_pop(void)
+{
+    event_t top = heap[0], last = heap[--heap_len];
+    int i = 0, child;
+
+    for (; (child = 2 * i + 1) < heap_len; i = child) {
+	if (child + 1 < heap_len && EV_LESS(heap[child + 1], heap[child]))
+	    child++;
+	if (!EV_LESS(heap[child], last))
+	    break;
+	heap[i] = heap[child];
+    }
+    heap[i] = last;
+    return top;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracegen [-h] [-n <ops>] [-z power|bimodal|hist] "
+	    "[-H <file>] [-m <min>] [-M <max>]\n"
+	    "                [-a <alpha>] [-l exp|power] [-t <life>] "
+	    "[-r <frac>] [-g <growth>] [-p <phases>]\n"
+	    "                [-s <seed>] [-o <file>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-n <ops>     Number of ops (default 1000000).\n");
+    fprintf(stderr, "\t-z <model>   Size model (default power).\n");
+    fprintf(stderr, "\t-H <file>    Histogram of \"size weight\" lines, implies -z hist.\n");
+    fprintf(stderr, "\t-m <min>     Smallest size (default 16).\n");
+    fprintf(stderr, "\t-M <max>     Largest size (default 65536).\n");
+    fprintf(stderr, "\t-a <alpha>   Shape of the power size model (default 1.2).\n");
+    fprintf(stderr, "\t-l <model>   Lifetime model (default exp).\n");
+    fprintf(stderr, "\t-t <life>    Mean lifetime in allocations (default 1000).\n");
+    fprintf(stderr, "\t-r <frac>    Fraction of blocks with realloc chains (default 0.05).\n");
+    fprintf(stderr, "\t-g <growth>  Growth factor of a realloc (default 1.5).\n");
+    fprintf(stderr, "\t-p <phases>  Number of phases (default 1).\n");
+    fprintf(stderr, "\t-s <seed>    Random seed (default 1).\n");
+    fprintf(stderr, "\t-o <file>    Output file (default stdout).\n");
+}
+
+static void app_error(char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
@@ -1,20 +1,31 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *     - it runs as a plain CGI program, or pooled by tiny -w
  */
 /* $begin adder */
 #include "csapp.h"
+#include "cgi.h"
 
+void adder(FILE *out);
 void sigpipe_handler(int sig);
 
 int main(void)
+{
+    /* register signal handler */
+    Signal(SIGPIPE, sigpipe_handler);
+
+    exit(cgi_main(adder));
+}
+
+/*
+ * adder - write the response for the request in the environment
+ */
+void adder(FILE *out)
 {
     char *buf;
     char content[MAXLINE];
     int n1 = 0, n2 = 0, is_head;
 
-    /* register signal handler */
-    Signal(SIGPIPE, sigpipe_handler);
-
     /* Extract the two arguments */
     if ((buf = getenv("QUERY_STRING")) != NULL)
         sscanf(buf, "n1=%d&n2=%d", &n1, &n2);
@@ -32,17 +43,13 @@ int main(void)
     sprintf(content, "%sThanks for visiting!\r\n", content);
 
     /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
+    fprintf(out, "Connection: close\r\n");
+    fprintf(out, "Content-length: %d\r\n", (int)strlen(content));
+    fprintf(out, "Content-type: text/html\r\n\r\n");
     if (!is_head)
-        printf("%s", content);
-    fflush(stdout);
-
-    exit(0);
+        fprintf(out, "%s", content);
 }
 /* $end adder */
-
 /*
  * sigpipe_handler - forward SIGPIPE to proc group
  */
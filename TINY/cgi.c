@@ -0,0 +1,131 @@
+/*
+ * cgi.c - the program side of the pooled CGI protocol (see cgi.h)
+ */
+#define _GNU_SOURCE
+#include "csapp.h"
+#include <sys/uio.h>
+#include "cgi.h"
+
+static int serve_pooled(void (*handler)(FILE *out));
+static void set_vars(char *vars, size_t len, int set);
+static int send_msg(uint32_t id, uint32_t type, char *data, size_t len);
+
+/*
+ * cgi_main - run handler, which writes the response headers and body to
+ *     out, once for a plain CGI request or for every request Tiny sends a
+ *     pooled program; return the exit status for main
+ */
+int cgi_main(void (*handler)(FILE *out))
+{
+    if (getenv(CGI_ENV) == NULL)
+    {
+        handler(stdout);
+        fflush(stdout);
+        return 0;
+    }
+    return serve_pooled(handler);
+}
+
+/*
+ * serve_pooled - take requests from the server until it goes away; the
+ *     requests are served one at a time, in the order they come
+ */
+static int serve_pooled(void (*handler)(FILE *out))
+{
+    cgi_hdr_t hdr;
+    char vars[CGI_MAXDATA], *out = NULL;
+    size_t vars_len = 0, out_len, off, n;
+    FILE *fp;
+
+    signal(SIGPIPE, SIG_IGN); /* a write to a gone server fails instead */
+    while (rio_readn(CGI_FD, &hdr, sizeof(hdr)) == sizeof(hdr))
+    {
+        if (hdr.type != CGI_REQUEST || hdr.len > CGI_MAXDATA)
+            return 1;
+
+        /* the variables of the last request go, this one's come */
+        set_vars(vars, vars_len, 0);
+        vars_len = hdr.len;
+        if (rio_readn(CGI_FD, vars, vars_len) != vars_len)
+            return 1;
+        set_vars(vars, vars_len, 1);
+
+        /* run the handler into memory, and send what it wrote */
+        if ((fp = open_memstream(&out, &out_len)) == NULL)
+            return 1;
+        handler(fp);
+        fclose(fp);
+        for (off = 0; off < out_len; off += n)
+        {
+            n = out_len - off < CGI_MAXDATA ? out_len - off : CGI_MAXDATA;
+            if (send_msg(hdr.id, CGI_STDOUT, out + off, n) < 0)
+                return 1;
+        }
+        free(out);
+        if (send_msg(hdr.id, CGI_END, NULL, 0) < 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * set_vars - set (or unset) the "NAME=value\0" variables in vars[0, len)
+ */
+static void set_vars(char *vars, size_t len, int set)
+{
+    char *p, *eq, *end = vars + len;
+
+    for (p = vars; p < end; p += strlen(p) + 1)
+    {
+        if ((eq = strchr(p, '=')) == NULL)
+            continue;
+        *eq = '\0';
+        if (set)
+            setenv(p, eq + 1, 1);
+        else
+            unsetenv(p);
+        *eq = '=';
+    }
+}
+
+/*
+ * send_msg - send one message to the server
+ */
+static int send_msg(uint32_t id, uint32_t type, char *data, size_t len)
+{
+    cgi_hdr_t hdr;
+    struct iovec iov[2];
+    size_t left = sizeof(hdr) + len;
+    ssize_t n;
+
+    hdr.id = id;
+    hdr.type = type;
+    hdr.len = len;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    while (left > 0)
+    {
+        if ((n = writev(CGI_FD, iov, 2)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        left -= n;
+        if ((size_t)n >= iov[0].iov_len)
+        {
+            n -= iov[0].iov_len;
+            iov[0].iov_len = 0;
+            iov[1].iov_base = (char *)iov[1].iov_base + n;
+            iov[1].iov_len -= n;
+        }
+        else
+        {
+            iov[0].iov_base = (char *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+    return 0;
+}
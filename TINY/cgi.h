@@ -0,0 +1,43 @@
+/*
+ * cgi.h - the framed protocol between Tiny and its pooled CGI programs
+ *
+ *     With -w, Tiny keeps CGI programs running instead of forking one per
+ *     request. A pooled program finds a UNIX stream socket to the server
+ *     on CGI_FD, and CGI_ENV set in its environment. Each message on the
+ *     socket is a cgi_hdr_t followed by len bytes of data:
+ *
+ *     CGI_REQUEST  server to program: the request's CGI variables, as
+ *                  "NAME=value\0" strings
+ *     CGI_STDOUT   program to server: a piece of the request's output
+ *     CGI_END      program to server: the output is complete
+ *
+ *     The id of a request, chosen by the server, is on every message
+ *     about it, so several requests may be in flight on one socket and
+ *     their messages may interleave. A program written with cgi_main runs
+ *     the same way as a plain CGI program when CGI_ENV is not set.
+ */
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CGI_FD 3           /* the socket of a pooled program */
+#define CGI_ENV "TINY_CGI" /* set for a pooled program */
+#define CGI_MAXDATA 65536  /* most data bytes in one message */
+
+/* message types */
+#define CGI_REQUEST 1
+#define CGI_STDOUT 2
+#define CGI_END 3
+
+typedef struct
+{
+    uint32_t id;   /* the request */
+    uint32_t type; /* CGI_REQUEST, CGI_STDOUT or CGI_END */
+    uint32_t len;  /* data bytes that follow */
+} cgi_hdr_t;
+
+int cgi_main(void (*handler)(FILE *out));
+
+#endif /* __CGI_H__ */
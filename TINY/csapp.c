@@ -40,7 +40,7 @@ void dns_error(char *msg)
     exit(0);
 }
 
-void gai_error(int code, char *msg) /* Getaddrinfo-style error */
+void addrinfo_error(int code, char *msg) /* Getaddrinfo-style error */
 {
     fprintf(stderr, "%s: %s\n", msg, gai_strerror(code));
     exit(0);
@@ -591,7 +591,7 @@ void Getaddrinfo(const char *node, const char *service,
     int rc;
 
     if ((rc = getaddrinfo(node, service, hints, res)) != 0)
-        gai_error(rc, "Getaddrinfo error");
+        addrinfo_error(rc, "Getaddrinfo error");
 }
 
 void Getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host,
@@ -601,7 +601,7 @@ void Getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host,
 
     if ((rc = getnameinfo(sa, salen, host, hostlen, serv,
                           servlen, flags)) != 0)
-        gai_error(rc, "Getnameinfo error");
+        addrinfo_error(rc, "Getnameinfo error");
 }
 
 void Freeaddrinfo(struct addrinfo *res)
@@ -995,6 +995,8 @@ int open_clientfd(char *hostname, char *port)
 }
 /* $end open_clientfd */
 
+static int listenfd_opt(char *port, int reuseport);
+
 /*  
  * open_listenfd - Open and return a listening socket on port. This
  *     function is reentrant and protocol-independent.
@@ -1003,6 +1005,25 @@ int open_clientfd(char *hostname, char *port)
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port)
+{
+    return listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but with SO_REUSEPORT, so
+ *     that several such sockets (one per thread, say) listen on the same
+ *     port and the kernel spreads the connections among them.
+ */
+int open_reuseport_listenfd(char *port)
+{
+    return listenfd_opt(port, 1);
+}
+
+/*
+ * listenfd_opt - open_listenfd, with SO_REUSEPORT if reuseport is set
+ */
+static int listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, optval = 1;
@@ -1026,6 +1047,9 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
                    (const void *)&optval, sizeof(int));
+        if (reuseport)
+            Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int));
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1043,7 +1067,6 @@ int open_listenfd(char *port)
         return -1;
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1066,4 +1089,13 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port)
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+        unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
 /* $end csapp.c */
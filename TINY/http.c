@@ -0,0 +1,391 @@
+/*
+ * http.c - an incremental HTTP/1.x request parser (see http.h)
+ */
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include "http.h"
+
+/* parser states */
+#define S_METHOD 0    /* in the method */
+#define S_SP1 1       /* spaces before the URI */
+#define S_URI 2       /* in the URI */
+#define S_SP2 3       /* spaces before the version */
+#define S_VERSION 4   /* in the version, up to the end of the line */
+#define S_HDR_START 5 /* at the start of a header line */
+#define S_NAME 6      /* in a header name */
+#define S_VALUE_SP 7  /* spaces before a header value */
+#define S_VALUE 8     /* in a header value, up to the end of the line */
+#define S_END_LF 9    /* CR seen on the blank line */
+
+static int header(http_req_t *r, const char *buf, size_t end);
+static int version(http_req_t *r, const char *p, size_t len);
+static int number(str_t s, size_t *i, off_t *v);
+
+/*
+ * http_init - get a request ready for its first http_parse
+ */
+void http_init(http_req_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->state = S_METHOD;
+    r->content_length = -1;
+}
+
+/*
+ * http_parse - parse buf[r->off, len), the bytes that came since the last
+ *     call; buf holds the whole request from its first byte. Return
+ *     HTTP_DONE when the blank line ending the headers is seen, HTTP_AGAIN
+ *     if more bytes are needed, or HTTP_ERROR on a malformed request
+ *     - lines may end in CRLF or a bare LF
+ *     - each state takes the longest run of bytes it can before going
+ *       back to the switch, the header values with memchr
+ */
+int http_parse(http_req_t *r, const char *buf, size_t len)
+{
+    const char *p = buf + r->off, *end = buf + len, *eol;
+    unsigned char ch;
+
+    while (p < end)
+    {
+        switch (r->state)
+        {
+        case S_METHOD:
+            while (p < end && (((ch = *p) | 0x20) >= 'a' && (ch | 0x20) <= 'z'))
+                p++;
+            if (p == end)
+                break;
+            if (*p != ' ' || p == buf)
+                return HTTP_ERROR;
+            r->method.p = buf;
+            r->method.len = p - buf;
+            r->state = S_SP1;
+            break;
+
+        case S_SP1:
+            while (p < end && *p == ' ')
+                p++;
+            if (p == end)
+                break;
+            r->mark = p - buf;
+            r->state = S_URI;
+            break;
+
+        case S_URI:
+            while (p < end && (unsigned char)*p > ' ')
+                p++;
+            if (p == end)
+                break;
+            if (*p != ' ')
+                return HTTP_ERROR; /* no version (HTTP/0.9), or a control */
+            r->uri.p = buf + r->mark;
+            r->uri.len = p - buf - r->mark;
+            if (r->uri.len == 0)
+                return HTTP_ERROR;
+            r->state = S_SP2;
+            break;
+
+        case S_SP2:
+            while (p < end && *p == ' ')
+                p++;
+            if (p == end)
+                break;
+            r->mark = p - buf;
+            r->state = S_VERSION;
+            /* fall through */
+        case S_VERSION:
+            if ((eol = memchr(p, '\n', end - p)) == NULL)
+            {
+                p = end;
+                break;
+            }
+            p = eol + 1;
+            if (eol > buf + r->mark && eol[-1] == '\r')
+                eol--;
+            if (version(r, buf + r->mark, eol - buf - r->mark) < 0)
+                return HTTP_ERROR;
+            r->state = S_HDR_START;
+            break;
+
+        case S_HDR_START:
+            if (*p == '\r')
+            {
+                p++;
+                r->state = S_END_LF;
+                break;
+            }
+            if (*p == '\n')
+            {
+                r->hdr_len = r->off = p + 1 - buf;
+                return HTTP_DONE;
+            }
+            r->mark = p - buf;
+            r->state = S_NAME;
+            /* fall through */
+        case S_NAME:
+            while (p < end && *p != ':' && (unsigned char)*p > ' ')
+                p++;
+            if (p == end)
+                break;
+            if (*p != ':' || p == buf + r->mark)
+                return HTTP_ERROR; /* folded line, no name, or no colon */
+            r->name_len = p - buf - r->mark;
+            p++;
+            r->state = S_VALUE_SP;
+            /* fall through */
+        case S_VALUE_SP:
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            if (p == end)
+                break;
+            r->value = p - buf;
+            r->state = S_VALUE;
+            /* fall through */
+        case S_VALUE:
+            if ((eol = memchr(p, '\n', end - p)) == NULL)
+            {
+                p = end;
+                break;
+            }
+            p = eol + 1;
+            if (eol > buf + r->value && eol[-1] == '\r')
+                eol--;
+            if (header(r, buf, eol - buf) < 0)
+                return HTTP_ERROR;
+            r->state = S_HDR_START;
+            break;
+
+        case S_END_LF:
+            if (*p != '\n')
+                return HTTP_ERROR;
+            r->hdr_len = r->off = p + 1 - buf;
+            return HTTP_DONE;
+        }
+    }
+    r->off = len;
+    return HTTP_AGAIN;
+}
+
+/*
+ * version - parse "HTTP/major.minor" into the request
+ */
+static int version(http_req_t *r, const char *p, size_t len)
+{
+    if (len != 8 || strncmp(p, "HTTP/", 5) || p[6] != '.' ||
+        p[5] < '0' || p[5] > '9' || p[7] < '0' || p[7] > '9')
+        return -1;
+    r->major = p[5] - '0';
+    r->minor = p[7] - '0';
+    return 0;
+}
+
+/*
+ * header - keep the header whose line ends at buf[end] if Tiny uses it,
+ *     its name matched without regard to case
+ */
+static int header(http_req_t *r, const char *buf, size_t end)
+{
+    const char *name = buf + r->mark;
+    str_t v;
+    size_t i;
+    long cl;
+
+    v.p = buf + r->value;
+    v.len = end - r->value;
+    while (v.len > 0 && (v.p[v.len - 1] == ' ' || v.p[v.len - 1] == '\t'))
+        v.len--;
+
+    switch (r->name_len)
+    {
+    case 5:
+        if (!strncasecmp(name, "Range", 5))
+            r->range = v;
+        break;
+    case 8:
+        if (!strncasecmp(name, "If-Range", 8))
+            r->if_range = v;
+        break;
+    case 10:
+        if (!strncasecmp(name, "Connection", 10))
+            r->connection = v;
+        break;
+    case 12:
+        if (!strncasecmp(name, "Content-Type", 12))
+            r->content_type = v;
+        break;
+    case 14:
+        if (strncasecmp(name, "Content-Length", 14))
+            break;
+        if (v.len == 0)
+            return -1;
+        for (cl = 0, i = 0; i < v.len; i++)
+        {
+            if (v.p[i] < '0' || v.p[i] > '9' || cl > (LONG_MAX - 9) / 10)
+                return -1;
+            cl = cl * 10 + (v.p[i] - '0');
+        }
+        if (r->content_length >= 0 && r->content_length != cl)
+            return -1; /* conflicting lengths */
+        r->content_length = cl;
+        break;
+    case 15:
+        if (!strncasecmp(name, "Accept-Encoding", 15))
+            r->accept_encoding = v;
+        break;
+    case 17:
+        if (!strncasecmp(name, "Transfer-Encoding", 17))
+            r->transfer_encoding = v;
+        break;
+    }
+    return 0;
+}
+
+/*
+ * str_eq - is s the string lit, without regard to case
+ */
+int str_eq(str_t s, const char *lit)
+{
+    return strlen(lit) == s.len && !strncasecmp(s.p, lit, s.len);
+}
+
+/*
+ * str_has_token - is token one of the comma separated items of s, without
+ *     regard to case ("keep-alive, Upgrade" has "upgrade")
+ */
+int str_has_token(str_t s, const char *token)
+{
+    size_t n = strlen(token), i = 0, j;
+
+    while (i < s.len)
+    {
+        while (i < s.len && (s.p[i] == ' ' || s.p[i] == '\t' || s.p[i] == ','))
+            i++;
+        for (j = i; j < s.len && s.p[j] != ','; j++)
+            ;
+        while (j > i && (s.p[j - 1] == ' ' || s.p[j - 1] == '\t'))
+            j--;
+        if (j - i == n && !strncasecmp(s.p + i, token, n))
+            return 1;
+        i = j + 1;
+    }
+    return 0;
+}
+
+/*
+ * http_accepts - does the Accept-Encoding value s take coding: named, or
+ *     matched by "*", with a q value that is not 0 ("gzip;q=0, *" does
+ *     not take gzip, "deflate, gzip;q=0.5" does)
+ */
+int http_accepts(str_t s, const char *coding)
+{
+    size_t n = strlen(coding), i = 0, j, k;
+    int named = -1, star = -1, ok;
+
+    while (i < s.len)
+    {
+        while (i < s.len && (s.p[i] == ' ' || s.p[i] == '\t' || s.p[i] == ','))
+            i++;
+        for (j = i; j < s.len && s.p[j] != ',' && s.p[j] != ';' &&
+                    s.p[j] != ' ' && s.p[j] != '\t'; j++)
+            ;
+        /* the item's q: refused only if every digit of it is 0 */
+        for (k = j; k < s.len && s.p[k] != ',' && s.p[k] != '='; k++)
+            ;
+        ok = 1;
+        if (k < s.len && s.p[k] == '=')
+        {
+            for (ok = 0, k++; k < s.len && s.p[k] != ','; k++)
+                if (s.p[k] >= '1' && s.p[k] <= '9')
+                    ok = 1;
+        }
+        if (j - i == n && !strncasecmp(s.p + i, coding, n))
+            named = ok;
+        else if (j - i == 1 && s.p[i] == '*')
+            star = ok;
+        while (k < s.len && s.p[k] != ',')
+            k++;
+        i = k + 1;
+    }
+    return named >= 0 ? named : star > 0;
+}
+
+/*
+ * http_ranges - parse a Range value, "bytes=0-499, 1000-, -500" say, for
+ *     a file of size bytes: the ranges that overlap the file go in
+ *     ranges, at most max of them, clamped to it. Return how many, 0 if
+ *     none does (416), or -1 if the value is malformed or asks for more
+ *     than max ranges (the Range is ignored, and the whole file sent)
+ *     - "a-" is from a to the end, "-n" the last n bytes
+ */
+int http_ranges(str_t s, off_t size, http_range_t *ranges, int max)
+{
+    size_t i = 6;
+    off_t start, end;
+    int n = 0, specs = 0;
+
+    if (s.len < 6 || strncasecmp(s.p, "bytes=", 6))
+        return -1;
+    while (i < s.len)
+    {
+        if (s.p[i] == ' ' || s.p[i] == '\t' || s.p[i] == ',')
+        {
+            i++;
+            continue;
+        }
+        if (s.p[i] == '-')
+        { /* the last end bytes */
+            i++;
+            if (number(s, &i, &end) < 0)
+                return -1;
+            start = size - end;
+            end = size - 1;
+            if (start < 0)
+                start = 0;
+        }
+        else
+        {
+            if (number(s, &i, &start) < 0 || i == s.len || s.p[i++] != '-')
+                return -1;
+            if (number(s, &i, &end) < 0)
+                end = size - 1; /* to the end */
+            else if (end < start)
+                return -1;
+            else if (end >= size)
+                end = size - 1;
+        }
+        while (i < s.len && (s.p[i] == ' ' || s.p[i] == '\t'))
+            i++;
+        if (i < s.len && s.p[i] != ',')
+            return -1;
+        specs++;
+        if (start > end || start >= size)
+            continue; /* not satisfiable */
+        if (n == max)
+            return -1;
+        ranges[n].start = start;
+        ranges[n++].end = end;
+    }
+    return specs > 0 ? n : -1;
+}
+
+/*
+ * number - the decimal number at s.p[*i], moving *i past it; return -1 if
+ *     there is none - one too big for an off_t is read as LLONG_MAX, for
+ *     the caller to clamp to the file
+ */
+static int number(str_t s, size_t *i, off_t *v)
+{
+    size_t j = *i;
+
+    for (*v = 0; j < s.len && s.p[j] >= '0' && s.p[j] <= '9'; j++)
+    {
+        if (*v > (LLONG_MAX - (s.p[j] - '0')) / 10)
+            *v = LLONG_MAX;
+        else
+            *v = *v * 10 + (s.p[j] - '0');
+    }
+    if (j == *i)
+        return -1;
+    *i = j;
+    return 0;
+}
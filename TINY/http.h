@@ -0,0 +1,66 @@
+/*
+ * http.h - an incremental HTTP/1.x request parser
+ *
+ *     http_parse runs a state machine over the request as it arrives in
+ *     the connection buffer, one pass over each byte, and picks up where
+ *     it stopped when more bytes come. It copies and allocates nothing:
+ *     the request line and the headers Tiny uses come back as views into
+ *     the buffer, which must not move until the request is served.
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* A string in the request buffer, not NUL-terminated */
+typedef struct
+{
+    const char *p;
+    size_t len;
+} str_t;
+
+/* results of http_parse */
+#define HTTP_AGAIN 0  /* the headers are not complete yet */
+#define HTTP_DONE 1   /* the headers are complete, hdr_len is set */
+#define HTTP_ERROR -1 /* the request is malformed */
+
+/* A request, as parsed so far */
+typedef struct
+{
+    int state;          /* where the parser stopped */
+    size_t off;         /* bytes of the buffer parsed */
+    size_t mark;        /* start of the token being parsed */
+    size_t name_len;    /* length of the current header name */
+    size_t value;       /* start of the current header value */
+
+    str_t method, uri;
+    int major, minor;   /* HTTP version */
+    str_t range;        /* header values, len 0 if absent */
+    str_t if_range;
+    str_t accept_encoding;
+    str_t content_type;
+    str_t connection;
+    str_t transfer_encoding;
+    long content_length; /* -1 if absent */
+    size_t hdr_len;     /* bytes up to the end of the headers, once done */
+} http_req_t;
+
+void http_init(http_req_t *r);
+int http_parse(http_req_t *r, const char *buf, size_t len);
+
+int str_eq(str_t s, const char *lit);
+int str_has_token(str_t s, const char *token);
+int http_accepts(str_t s, const char *coding);
+
+/* A byte range of a file, its first and last byte */
+typedef struct
+{
+    off_t start, end;
+} http_range_t;
+
+#define HTTP_MAXRANGES 16 /* ranges served in one response, more are ignored */
+
+int http_ranges(str_t s, off_t size, http_range_t *ranges, int max);
+
+#endif /* __HTTP_H__ */
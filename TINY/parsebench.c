@@ -0,0 +1,143 @@
+/*
+ * parsebench.c - ns per request of http_parse
+ *
+ *     unix> ./parsebench [-n <iters>]
+ *
+ *     Parses a typical browser request: with http_parse on the whole
+ *     request, with http_parse fed 16 bytes at a time (as if the request
+ *     came in small reads), and with the memmem/strstr/sscanf parsing Tiny
+ *     used before, which cut the lines in place and so works on a copy.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "http.h"
+
+#define MAXLINE 8192
+
+static const char request[] =
+    "GET /godzilla.gif HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Referer: http://localhost:8000/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Range: bytes=0-1023\r\n"
+    "\r\n";
+
+static volatile long sink; /* keeps the results alive */
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * parse_whole - http_parse on the whole request
+ */
+static void parse_whole(const char *buf, size_t len)
+{
+    http_req_t r;
+
+    http_init(&r);
+    if (http_parse(&r, buf, len) != HTTP_DONE)
+        exit(1);
+    sink += r.hdr_len + r.range.len + r.connection.len;
+}
+
+/*
+ * parse_split - http_parse fed 16 bytes at a time
+ */
+static void parse_split(const char *buf, size_t len)
+{
+    http_req_t r;
+    size_t n = 0;
+    int rc = HTTP_AGAIN;
+
+    http_init(&r);
+    while (rc == HTTP_AGAIN && n < len)
+    {
+        n = n + 16 < len ? n + 16 : len;
+        rc = http_parse(&r, buf, n);
+    }
+    if (rc != HTTP_DONE)
+        exit(1);
+    sink += r.hdr_len + r.range.len + r.connection.len;
+}
+
+/*
+ * parse_old - the parsing Tiny did before http_parse: find the blank line,
+ *     cut the lines in place, look for the headers with strstr, and take
+ *     the request line apart with sscanf
+ */
+static void parse_old(const char *buf, size_t len)
+{
+    char in[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char *line, *eol, *end, *range = "", *content_type = "";
+    int content_length = 0;
+
+    memcpy(in, buf, len);
+    if ((end = memmem(in, len, "\r\n\r\n", 4)) == NULL)
+        exit(1);
+    end += 4;
+    for (line = in; line < end; line = eol + 1)
+    {
+        eol = memchr(line, '\n', end - line);
+        *eol = '\0';
+        if (line == in)
+            continue;
+        if (strstr(line, "Range"))
+            range = line;
+        else if (strstr(line, "Content-Type"))
+            content_type = line;
+        else if (strstr(line, "Content-Length"))
+            sscanf(line, "Content-Length: %d", &content_length);
+    }
+    sscanf(in, "%s %s %s", method, uri, version);
+    sink += strlen(range) + strlen(content_type) + content_length + strlen(uri);
+}
+
+static void run(char *name, void (*parse)(const char *, size_t), long iters)
+{
+    double t0, ns;
+    long i;
+
+    for (i = 0; i < iters / 10; i++) /* warm up */
+        parse(request, sizeof(request) - 1);
+    t0 = now_ns();
+    for (i = 0; i < iters; i++)
+        parse(request, sizeof(request) - 1);
+    ns = (now_ns() - t0) / iters;
+    printf("%-28s%8.1f ns/request%8.2f ns/byte\n", name, ns,
+           ns / (sizeof(request) - 1));
+}
+
+int main(int argc, char **argv)
+{
+    long iters = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        if (opt != 'n')
+        {
+            fprintf(stderr, "usage: %s [-n <iters>]\n", argv[0]);
+            exit(1);
+        }
+        iters = atol(optarg);
+    }
+    printf("%d byte request, %ld iterations\n", (int)sizeof(request) - 1, iters);
+    run("http_parse", parse_whole, iters);
+    run("http_parse, 16 byte reads", parse_split, iters);
+    run("memmem/strstr/sscanf", parse_old, iters);
+    exit(0);
+}
@@ -1,394 +1,2512 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.1 Web server that uses the GET method to
+ *     serve static and dynamic content.
+ *
+ *     All connections are served by one edge-triggered epoll loop over
+ *     non-blocking sockets. Each connection is a small state machine: in
+ *     CONN_READ it collects the request line, the headers and a POST body
+ *     in its buffer as they arrive, then doit builds the response, and in
+ *     CONN_WRITE the response goes out as fast as the client takes it. So
+ *     a slow client only holds its own connection, and a connection that
+ *     makes no progress for idle_timeout seconds (a client that stops in
+ *     the middle of its headers, say) is closed.
+ *
+ *     Connections are persistent: after a response is written, the next
+ *     request is served from the bytes already in the buffer (a client may
+ *     pipeline several) before reading again. A connection closes when the
+ *     client asks for it (or speaks HTTP/1.0 without keep-alive), or after
+ *     max_requests requests. Responses go out in order, one at a time.
+ *
+ *     File bodies go out with sendfile from a per-worker cache of open
+ *     files and their stat, keyed by path and bounded by max_files (LRU);
+ *     inotify drops a cached file as soon as it changes, so a hot file
+ *     costs no open, stat or mmap per response. A small file asked for
+ *     more than once also gets its whole response (headers and body)
+ *     prebuilt in memory, within a byte budget per worker, and goes out
+ *     with one writev. Any static file may be asked for by byte ranges
+ *     (with 64-bit offsets, so video files of any size can be seeked in):
+ *     one range is a 206, several a multipart/byteranges body, and
+ *     If-Range checks the ETag or Last-Modified every response carries.
+ *
+ *     A text file goes gzipped to a client whose Accept-Encoding takes
+ *     gzip: path.gz if there is such a file next to it, else the file
+ *     compressed once when first asked for, its gzip response (headers
+ *     and body) kept with it in the file cache within a byte budget per
+ *     worker of its own, like a hot file's.
+ *
+ *     A forked CGI program writes to a pipe in the worker's epoll set, and
+ *     its output is relayed with the program's Content-Length, chunked
+ *     when it gives none, CGI_BUF bytes at a time: no more is read until
+ *     the client has taken them, so a program can only get that far ahead
+ *     of a slow client before it blocks on the pipe.
+ *
+ *     CGI programs are forked per request, or with -w kept running in a
+ *     small pool per program in each worker: a pooled program takes
+ *     framed requests on a socket that is in the worker's epoll set (see
+ *     cgi.h), so no request waits on a fork and exec. Its output is
+ *     relayed the same way, CGI_BUF bytes held per request: a program
+ *     whose output a slow client has not taken is not read from, and
+ *     blocks on its socket. A pooled program that exits fails its
+ *     requests in flight with a 502 and is started again.
+ *
+ *     There is one such loop per worker thread, one worker per online CPU
+ *     by default. Each worker has a listening socket of its own on the
+ *     port (SO_REUSEPORT), so the kernel spreads the connections over the
+ *     workers and they share nothing on the request path. Each worker
+ *     counts what it does in its own worker_t; SIGUSR1 makes the main
+ *     thread print the counters of all workers and their sum, and SIGINT
+ *     or SIGTERM prints them once more and exits.
  */
+#define _GNU_SOURCE
 #include "csapp.h"
+#include "http.h"
+#include "cgi.h"
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include <time.h>
+#include <sched.h>
 
 /* define service type */
 #define SERVICE_STATIC 0
 #define SERVICE_DYNAMIC 1
-#define SERVICE_MP4 2
+
+/* connection states */
+#define CONN_READ 0  /* reading the request */
+#define CONN_WRITE 1 /* writing the response */
+#define CONN_CGI 2   /* waiting for a CGI program's headers */
+#define CONN_CLOSED 3 /* closed, freed after the events at hand */
+
+/* what an epoll event is for, the first field of its object */
+#define EV_CONN 0 /* a client connection */
+#define EV_CGI 1  /* the socket of a pooled CGI program */
+#define EV_PIPE 2 /* the stdout of a forked CGI program */
+
+/* how a relayed CGI response body ends */
+#define RELAY_LENGTH 0  /* after the program's Content-Length */
+#define RELAY_CHUNKED 1 /* at a last, empty chunk */
+#define RELAY_EOF 2     /* when the connection closes */
+
+#define MAXEVENTS 256    /* events taken by one epoll_wait */
+#define IDLE_TIMEOUT 10  /* default seconds a connection may make no progress */
+#define MAX_REQUESTS 100 /* default requests served on one connection */
+#define MAX_FILES 256    /* default open files cached by a worker */
+#define FCACHE_CHECK 1000 /* ms between stats of a cached file, without inotify */
+#define HOT_CACHE_KB 16384 /* default KB of prebuilt responses cached by a worker */
+#define HOT_FILE_MAX (256 * 1024) /* largest file whose response is prebuilt */
+#define GZIP_CACHE_KB 16384 /* default KB of gzip responses cached by a worker */
+#define GZIP_MIN 256 /* smallest file compressed, below it gzip does not pay */
+#define GZIP_FILE_MAX (1024 * 1024) /* largest file compressed on the fly */
+#define GZIP_LEVEL 6 /* zlib's default, most of the gain of 9 for less time */
+#define CGI_RESTART_MS 1000 /* least time between starts of a pooled program */
+#define CGI_BUF 65536 /* bytes of a CGI program's output held at a time */
 
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 
-/* signal handler function*/
-void sigchld_handler(int sig);
-void sigpipe_handler(int sig);
+/* Counters of a worker, written only by the worker itself */
+typedef struct
+{
+    unsigned long accepted;  /* connections accepted */
+    unsigned long requests;  /* responses built */
+    unsigned long bytes;     /* response bytes written */
+    unsigned long expired;   /* connections closed for being idle */
+    unsigned long open;      /* connections open right now */
+    unsigned long opens;     /* files opened, the misses of the file cache */
+    unsigned long hot;       /* responses sent from memory */
+    unsigned long gzip;      /* responses sent gzipped */
+} stats_t;
+
+#define STAT_ADD(w, field, n) \
+    __atomic_store_n(&(w)->stats.field, (w)->stats.field + (n), __ATOMIC_RELAXED)
+
+/* An open file in a worker's file cache, with its stat */
+typedef struct fentry
+{
+    char *path;
+    unsigned hash;
+    int fd;
+    int wd;                     /* inotify watch, or -1 */
+    int refs;                   /* one while cached, one per response sending it */
+    long checked;               /* last stat (ms), without inotify */
+    struct stat st;
+    char etag[48];              /* its validators, from the stat */
+    char mtime[32];             /* Last-Modified */
+    int hits;                   /* requests, until the response is prebuilt */
+    char *data;                 /* the prebuilt response, or NULL */
+    size_t data_len;
+    char *hdr[2];               /* its headers, by keep_alive, in data */
+    size_t hdr_len[2];
+    char *body;                 /* its body, st.st_size bytes in data */
+    int gz_static;              /* a path.gz next to it: -1 not looked for yet */
+    int gz_tried;               /* compressed once (gz stays NULL if it did not pay) */
+    char *gz;                   /* the prebuilt gzip response, or NULL */
+    size_t gz_len;
+    char *gz_hdr[2];            /* its headers, by keep_alive, in gz */
+    size_t gz_hdr_len[2];
+    char *gz_body;              /* its compressed body, in gz */
+    size_t gz_body_len;
+    struct fentry *hnext;       /* hash chain */
+    struct fentry *prev, *next; /* LRU list, least recently used first */
+} fentry_t;
+
+/* A worker thread with its event loop (cache line aligned, they share nothing) */
+typedef struct worker
+{
+    int id;
+    int cpu;                          /* pinned to this CPU, or -1 */
+    pthread_t tid;
+    int listenfd;
+    int epfd;                         /* the epoll instance */
+    int spare_fd;                     /* given up to shed a connection at EMFILE */
+    struct conn *idle_head, *idle_tail; /* its connections, by last progress */
+    struct conn *closed;              /* closed, still in the events at hand */
+    int ifd;                          /* inotify instance, or -1 */
+    fentry_t **files;                 /* file cache hash table */
+    unsigned files_mask;
+    fentry_t *lru_head, *lru_tail;
+    int nfiles;
+    size_t hot_bytes;                 /* bytes of prebuilt responses */
+    size_t gz_bytes;                  /* bytes of gzip responses */
+    unsigned long multiparts;         /* multipart responses, for boundaries */
+    struct cgi_pool *pools;           /* pooled CGI programs, by path */
+    stats_t stats;
+} __attribute__((aligned(64))) worker_t;
+
+/* The output of a CGI program, relayed to its connection: read from the
+   stdout of a forked one, or put in cgi_out by cgi_event for a pooled one */
+typedef struct
+{
+    int type;             /* EV_PIPE */
+    int busy;             /* a response is being relayed */
+    int fd;               /* the pipe's read end, -1 after EOF (or pooled) */
+    pid_t pid;
+    struct conn *c;
+    int framing;          /* RELAY_LENGTH, RELAY_CHUNKED or RELAY_EOF */
+    long left;            /* body bytes still to send, with RELAY_LENGTH */
+    int chunks;           /* chunks sent, with RELAY_CHUNKED */
+    int is_head;          /* the body is dropped */
+    size_t piece;         /* bytes of cgi_out in the piece being written */
+} cgi_pipe_t;
+
+/* A client connection */
+typedef struct conn
+{
+    int type;                 /* EV_CONN */
+    int fd;
+    worker_t *w;              /* the worker that owns it */
+    int state;                /* CONN_READ, CONN_WRITE or CONN_CGI */
+    int keep_alive;           /* serve another request after this one */
+    int nreq;                 /* requests seen on the connection */
+    long last;                /* time of the last progress (ms) */
+    struct conn *prev, *next; /* idle list, least recently active first */
+
+    /* request */
+    char in[MAXLINE];     /* bytes read so far, pipelined requests included */
+    size_t in_len;
+    http_req_t req;       /* the request in in, as parsed so far */
+    size_t hdr_len;       /* bytes up to the end of the headers, 0 until seen */
+    size_t post_len;      /* bytes of the POST body to wait for */
+
+    /* response */
+    char out[MAXBUF];     /* status line and headers, or an error page */
+    char *head;           /* the headers to send: out, or prebuilt ones */
+    size_t out_len, out_off;
+    char *body;           /* a body in memory, or NULL */
+    size_t body_len, body_off;
+    fentry_t *file;       /* the file the body is sent from (or whose prebuilt
+                             response is sent), or NULL */
+    off_t file_off;       /* next body byte in the file */
+    size_t file_left;     /* body bytes still to send */
+    int corked;           /* TCP_CORK set until the body is out */
+    struct cgi_proc *cgi; /* the pooled program running the request, or NULL */
+    uint32_t cgi_id;      /* the request's id there */
+    char *cgi_out;        /* the program's output not sent yet, CGI_BUF bytes */
+    size_t cgi_len;
+    cgi_pipe_t relay;     /* the program's output, while relay.busy */
+    http_range_t ranges[HTTP_MAXRANGES]; /* the parts of a multipart body */
+    int nranges, range_i; /* how many, and the next one to send */
+    fentry_t *ranges_file; /* their file, held until the last part, or NULL */
+    char boundary[24];
+    char range_type[64];  /* the Content-Type of the parts */
+} conn_t;
+
+/* A request in flight at a pooled CGI program, by id */
+typedef struct
+{
+    int busy;
+    conn_t *c;            /* its connection, or NULL if it has closed */
+} cgi_slot_t;
+
+/* A running CGI program of a pool (one worker's, they share nothing) */
+typedef struct cgi_proc
+{
+    int type;             /* EV_CGI */
+    int fd;               /* socket to the program, or -1 while it is down */
+    pid_t pid;
+    struct cgi_pool *pool;
+    long started;         /* last start (ms) */
+    int inflight;         /* requests sent and not ended */
+    cgi_slot_t *slots;
+    int nslots;
+    char *rbuf;           /* messages read, up to a whole one */
+    size_t rlen;
+    struct conn *stalled; /* the connection whose full cgi_out stops the
+                             reading, or NULL */
+    char *wbuf;           /* requests still to write */
+    size_t wlen, woff, wcap;
+} cgi_proc_t;
+
+/* The pooled processes of one CGI program */
+typedef struct cgi_pool
+{
+    char *path;
+    worker_t *w;
+    cgi_proc_t *procs;
+    struct cgi_pool *next;
+} cgi_pool_t;
+
+static int verbose = 1;                  /* print requests and responses */
+static int idle_timeout = IDLE_TIMEOUT;  /* seconds */
+static int max_requests = MAX_REQUESTS;  /* per connection */
+static int max_files = MAX_FILES;        /* per worker, 0 for no cache */
+static size_t hot_cache = HOT_CACHE_KB * 1024; /* per worker, bytes */
+static size_t gzip_cache = GZIP_CACHE_KB * 1024; /* per worker, bytes, 0 for none */
+static int cgi_procs = 0;                /* per program per worker, 0 to fork */
+static char *port;
+static worker_t *workers;
+static int nworkers;
+
+/* signal handler function*/
+void sigchld_handler(int sig);
+void sigpipe_handler(int sig);
+
+/* workers and their event loops */
+static void *worker_main(void *arg);
+static void print_stats(void);
+static long now_ms(void);
+static void accept_conns(worker_t *w);
+static void conn_event(conn_t *c, uint32_t events);
+static int conn_read(conn_t *c);
+static int conn_write(conn_t *c);
+static void conn_next(conn_t *c);
+static void conn_touch(conn_t *c);
+static void conn_close(conn_t *c);
+static int expire_conns(worker_t *w);
+static void conn_puts(conn_t *c, char *s);
+static void conn_putn(conn_t *c, char *s, size_t n);
+static char *conn_header(conn_t *c);
+static void fcache_init(worker_t *w);
+static fentry_t *fcache_get(worker_t *w, char *path);
+static void fcache_put(fentry_t *f);
+static void fcache_drop(worker_t *w, fentry_t *f);
+static void fcache_notify(worker_t *w);
+static int fcache_load(worker_t *w, fentry_t *f, char *filetype);
+static int static_header(char *buf, fentry_t *f, char *filetype, int keep_alive,
+                         long gz_len);
+static int gzip_type(char *filetype);
+static int fcache_gzip(worker_t *w, fentry_t *f, char *filetype);
+static int serve_gzip(conn_t *c, fentry_t *f, char *filename, char *filetype,
+                      int is_head);
+static int range_fresh(conn_t *c, fentry_t *f);
+static void serve_ranges(conn_t *c, fentry_t *f, char *filetype, int n, int is_head);
+static size_t part_header(conn_t *c, char *buf, int i);
+static void range_next(conn_t *c);
+static cgi_pool_t *cgi_pool(worker_t *w, char *path);
+static int cgi_start(cgi_proc_t *p);
+static void cgi_dispatch(conn_t *c, char *filename, char *cgiargs, int is_head);
+static void cgi_flush(cgi_proc_t *p);
+static void cgi_event(cgi_proc_t *p);
+static int cgi_take(cgi_proc_t *p);
+static void cgi_stall(cgi_proc_t *p, conn_t *c);
+static void cgi_down(cgi_proc_t *p);
+static size_t cgi_hdr_end(char *buf, size_t len);
+static int cgi_header(conn_t *c, char *buf, size_t len, long *length, int is_head);
+static int relay_read(conn_t *c);
+static void relay_end(conn_t *c, int kill_it);
+
+void doit(conn_t *c);
+void read_requesthdrs(conn_t *c);
+int parse_uri(str_t uri, char *filetype, char *filename, char *cgiargs);
+void serve_static(conn_t *c, char *filetype, char *filename, int is_head);
+void get_filetype(char *filename, char *filetype);
+void serve_dynamic(conn_t *c, char *filename, char *cgiargs, int is_head);
+void clienterror(conn_t *c, char *cause, char *errnum,
+                 char *shortmsg, char *longmsg);
+static void usage(char *prog);
+
+int main(int argc, char **argv)
+{
+    int opt, i, sig, pin = 0, ncpus;
+    struct rlimit rl;
+    sigset_t mask;
+
+    /* Check command line args */
+    nworkers = ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "qt:m:f:b:z:w:n:p")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            verbose = 0;
+            break;
+        case 't':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'm':
+            max_requests = atoi(optarg);
+            break;
+        case 'f':
+            max_files = atoi(optarg);
+            break;
+        case 'b':
+            hot_cache = atol(optarg) * 1024;
+            break;
+        case 'z':
+            gzip_cache = atol(optarg) * 1024;
+            break;
+        case 'w':
+            cgi_procs = atoi(optarg);
+            break;
+        case 'n':
+            nworkers = atoi(optarg);
+            break;
+        case 'p':
+            pin = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || idle_timeout <= 0 || max_requests <= 0 ||
+        max_files < 0 || cgi_procs < 0 || nworkers <= 0)
+        usage(argv[0]);
+    port = argv[optind];
+
+    /* register signal handler */
+    Signal(SIGCHLD, sigchld_handler);
+    Signal(SIGPIPE, sigpipe_handler);
+
+    /* one descriptor per connection, take all we may have */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* the workers inherit the mask, only the main thread takes these */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    if ((workers = aligned_alloc(64, nworkers * sizeof(worker_t))) == NULL)
+        unix_error("aligned_alloc error");
+    memset(workers, 0, nworkers * sizeof(worker_t));
+    for (i = 0; i < nworkers; i++)
+    {
+        workers[i].id = i;
+        workers[i].cpu = pin ? i % ncpus : -1;
+        Pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+
+    while (1)
+    {
+        if (sigwait(&mask, &sig) != 0)
+            continue;
+        print_stats();
+        if (sig != SIGUSR1)
+            exit(0);
+    }
+}
+/* $end tinymain */
+
+/*
+ * worker_main - the event loop of a worker, on its own listening socket
+ */
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    struct epoll_event ev, events[MAXEVENTS];
+    cpu_set_t set;
+    conn_t *c;
+    int i, n;
+
+    if (w->cpu >= 0)
+    {
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if ((n = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+            posix_error(n, "pthread_setaffinity_np error");
+    }
+    w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    w->listenfd = Open_reuseport_listenfd(port);
+    fcntl(w->listenfd, F_SETFL, O_NONBLOCK);
+    fcntl(w->listenfd, F_SETFD, FD_CLOEXEC);
+    if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; /* the listening socket */
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    fcache_init(w);
+
+    while (1)
+    {
+        n = epoll_wait(w->epfd, events, MAXEVENTS, expire_conns(w));
+        if (n < 0 && errno != EINTR)
+            unix_error("epoll_wait error");
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                accept_conns(w);
+            else if (events[i].data.ptr == w)
+                fcache_notify(w);
+            else if (*(int *)events[i].data.ptr == EV_CGI)
+                cgi_event(events[i].data.ptr);
+            else if (*(int *)events[i].data.ptr == EV_PIPE)
+            {
+                /* stale once the relay is over (the conn_t outlives it) */
+                if (((cgi_pipe_t *)events[i].data.ptr)->busy)
+                    conn_event(((cgi_pipe_t *)events[i].data.ptr)->c, 0);
+            }
+            else
+                conn_event(events[i].data.ptr, events[i].events);
+        }
+
+        /* a pooled program's answer may close a connection that has an
+           event further on in the batch, so they are freed only now */
+        while ((c = w->closed) != NULL)
+        {
+            w->closed = c->next;
+            Free(c);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * print_stats - print the counters of every worker and their sum
+ */
+static void print_stats(void)
+{
+    stats_t s, sum;
+    int i, k;
+    unsigned long *from, *to;
+
+    memset(&sum, 0, sizeof(sum));
+    printf("%-8s%6s%12s%12s%14s%10s%8s%10s%12s%12s\n", "worker", "cpu",
+           "accepted", "requests", "bytes", "expired", "open", "opens", "hot",
+           "gzip");
+    for (i = 0; i < nworkers; i++)
+    {
+        from = (unsigned long *)&workers[i].stats;
+        to = (unsigned long *)&s;
+        for (k = 0; k < sizeof(stats_t) / sizeof(unsigned long); k++)
+        {
+            to[k] = __atomic_load_n(&from[k], __ATOMIC_RELAXED);
+            ((unsigned long *)&sum)[k] += to[k];
+        }
+        printf("%-8d%6d%12lu%12lu%14lu%10lu%8lu%10lu%12lu%12lu\n", i,
+               workers[i].cpu, s.accepted, s.requests, s.bytes, s.expired,
+               s.open, s.opens, s.hot, s.gzip);
+    }
+    printf("%-8s%6s%12lu%12lu%14lu%10lu%8lu%10lu%12lu%12lu\n", "total", "",
+           sum.accepted, sum.requests, sum.bytes, sum.expired, sum.open,
+           sum.opens, sum.hot, sum.gzip);
+    fflush(stdout);
+}
+
+/*
+ * now_ms - monotonic time in milliseconds
+ */
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * accept_conns - accept every pending connection (the listening socket
+ *     is edge-triggered) and watch it for both reading and writing
+ */
+static void accept_conns(worker_t *w)
+{
+    int connfd, one = 1;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    struct epoll_event ev;
+    conn_t *c;
+
+    while (1)
+    {
+        clientlen = sizeof(clientaddr);
+        connfd = accept4(w->listenfd, (SA *)&clientaddr, &clientlen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* out of descriptors: shed the connection, or it stays queued
+               and the edge-triggered listener never fires for it again */
+            if ((errno == EMFILE || errno == ENFILE) && w->spare_fd >= 0)
+            {
+                close(w->spare_fd);
+                if ((connfd = accept(w->listenfd, NULL, NULL)) >= 0)
+                    close(connfd);
+                w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "accept error: %s\n", strerror(errno));
+            return;
+        }
+        if (verbose)
+        {
+            getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE,
+                        port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
+            printf("Accepted connection from (%s, %s)\n", hostname, port);
+        }
+
+        /* responses go out in one write each, don't let Nagle hold them */
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        c = Malloc(sizeof(conn_t));
+        c->type = EV_CONN;
+        c->fd = connfd;
+        c->w = w;
+        c->state = CONN_READ;
+        c->keep_alive = c->nreq = 0;
+        c->in_len = c->hdr_len = c->post_len = 0;
+        http_init(&c->req);
+        c->head = c->out;
+        c->out_len = c->out_off = 0;
+        c->body = NULL;
+        c->body_len = c->body_off = 0;
+        c->file = NULL;
+        c->file_off = c->file_left = 0;
+        c->corked = 0;
+        c->cgi = NULL;
+        c->cgi_out = NULL;
+        c->cgi_len = 0;
+        c->relay.type = EV_PIPE;
+        c->relay.busy = 0;
+        c->relay.fd = -1;
+        c->relay.c = c;
+        c->nranges = c->range_i = 0;
+        c->ranges_file = NULL;
+        c->prev = c->next = NULL;
+        conn_touch(c);
+        STAT_ADD(w, accepted, 1);
+        STAT_ADD(w, open, 1);
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+        {
+            fprintf(stderr, "epoll_ctl error: %s\n", strerror(errno));
+            conn_close(c);
+        }
+    }
+}
+
+/*
+ * conn_event - advance a connection's state machine after an event,
+ *     through as many requests as the client has pipelined
+ */
+static void conn_event(conn_t *c, uint32_t events)
+{
+    int rc;
+
+    if (c->state == CONN_CLOSED)
+        return;
+    if (events & EPOLLERR)
+    {
+        conn_close(c);
+        return;
+    }
+    while (1)
+    {
+        if (c->state == CONN_CGI && (!c->relay.busy || !relay_read(c)))
+            return; /* wait for the program */
+        if (c->state == CONN_READ)
+        {
+            if (conn_read(c) < 0)
+            {
+                conn_close(c);
+                return;
+            }
+            if (c->state != CONN_WRITE)
+                return; /* wait for the rest of the request, or the program */
+        }
+        if ((rc = conn_write(c)) == 0)
+            return; /* wait for room */
+        if (rc < 0)
+        {
+            conn_close(c);
+            return;
+        }
+        if (c->relay.busy)
+        {
+            /* the client has taken the output so far, take more */
+            if (!relay_read(c))
+                return;
+            continue;
+        }
+        if (c->ranges_file)
+        {
+            range_next(c); /* the next part of a multipart body */
+            continue;
+        }
+        if (!c->keep_alive)
+        {
+            conn_close(c);
+            return;
+        }
+        conn_next(c);
+    }
+}
+
+/*
+ * conn_read - parse the request in the buffer, reading from the socket
+ *     while it is incomplete; once the headers and the body are complete,
+ *     build the response and move on to CONN_WRITE. Return 0 to go on, or
+ *     -1 to close the connection
+ */
+static int conn_read(conn_t *c)
+{
+    ssize_t n;
+    int rc;
+
+    while (1)
+    {
+        /* parse the bytes that came since the last time */
+        if (c->hdr_len == 0)
+        {
+            rc = http_parse(&c->req, c->in, c->in_len);
+            if (rc == HTTP_DONE)
+            {
+                c->hdr_len = c->req.hdr_len;
+                read_requesthdrs(c);
+                if (c->req.content_length > 0)
+                    c->post_len = MIN(c->req.content_length, sizeof(c->in) - 1 - c->hdr_len);
+                /* the rest of a body that does not fit would pass for a request */
+                if (c->req.content_length > (long)c->post_len)
+                    c->keep_alive = 0;
+            }
+            else if (rc == HTTP_ERROR || c->in_len == sizeof(c->in) - 1)
+            {
+                /* malformed, or the headers do not fit: answer before the
+                   client is done, and close */
+                c->hdr_len = c->in_len;
+                c->keep_alive = 0;
+                clienterror(c, "request", "400", "Bad Request",
+                            "Tiny couldn't understand the request due to invalid syntax");
+                c->state = CONN_WRITE;
+                return 0;
+            }
+        }
+
+        if (c->hdr_len != 0 && c->in_len >= c->hdr_len + c->post_len)
+        {
+            c->state = CONN_WRITE; /* or CONN_CGI, if doit passes it on */
+            doit(c);
+            STAT_ADD(c->w, requests, 1);
+            return 0;
+        }
+
+        n = read(c->fd, c->in + c->in_len, sizeof(c->in) - 1 - c->in_len);
+        if (n > 0)
+        {
+            c->in_len += n;
+            conn_touch(c);
+        }
+        else if (n == 0)
+            return -1; /* the client is gone before its request is complete */
+        else if (errno != EINTR)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+}
+
+/*
+ * conn_next - drop the request just served and its response, keeping the
+ *     bytes of the pipelined requests behind it
+ */
+static void conn_next(conn_t *c)
+{
+    size_t used = c->hdr_len + c->post_len;
+
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    c->state = CONN_READ;
+    c->hdr_len = c->post_len = 0;
+    http_init(&c->req);
+    c->head = c->out;
+    c->out_len = c->out_off = 0;
+    c->body = NULL;
+    c->body_len = c->body_off = 0;
+    if (c->cgi_out)
+        Free(c->cgi_out);
+    c->cgi_out = NULL;
+    c->cgi_len = 0;
+}
+
+/*
+ * conn_write - write the response until it is out or the socket is full,
+ *     return 0 to wait for room, 1 when done, or -1 on error
+ *     - only bytes written count as progress for the idle timeout, so a
+ *       client that stops reading expires
+ *     - a body in memory goes out with the headers in one writev
+ *     - a body from a file goes out with sendfile, behind the headers:
+ *       the socket is corked until the end, so that the headers and the
+ *       first bytes of the body share a segment
+ */
+static int conn_write(conn_t *c)
+{
+    struct iovec iov[2];
+    ssize_t n;
+    size_t head;
+    int on = 1, off = 0, wrote = 0;
+
+    if (c->file_left > 0 && !c->corked)
+    {
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+        c->corked = 1;
+    }
+    while (c->out_off < c->out_len || c->body_off < c->body_len || c->file_left > 0)
+    {
+        head = c->out_len - c->out_off;
+        if (head > 0 || c->body_off < c->body_len)
+        {
+            iov[0].iov_base = c->head + c->out_off;
+            iov[0].iov_len = head;
+            iov[1].iov_base = c->body + c->body_off;
+            iov[1].iov_len = c->body_len - c->body_off;
+            n = writev(c->fd, iov, 2);
+        }
+        else
+            n = sendfile(c->fd, c->file->fd, &c->file_off, c->file_left);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (wrote)
+                    conn_touch(c);
+                return 0;
+            }
+            return -1;
+        }
+        if (n == 0)
+            return -1; /* the file shrank under the response */
+        wrote = 1;
+        STAT_ADD(c->w, bytes, n);
+        if ((size_t)n <= head)
+            c->out_off += n;
+        else
+        {
+            c->out_off = c->out_len;
+            if (c->body_off < c->body_len)
+                c->body_off += n - head;
+            else
+                c->file_left -= n - head;
+        }
+    }
+    if (wrote)
+        conn_touch(c);
+    if (c->corked)
+    {
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        c->corked = 0;
+    }
+    if (c->file)
+    {
+        fcache_put(c->file);
+        c->file = NULL;
+    }
+    return 1;
+}
+
+/*
+ * conn_touch - note progress on a connection, moving it to the end of the
+ *     idle list
+ */
+static void conn_touch(conn_t *c)
+{
+    worker_t *w = c->w;
+
+    c->last = now_ms();
+    if (w->idle_tail == c)
+        return;
+
+    /* unlink */
+    if (c->prev)
+        c->prev->next = c->next;
+    else if (w->idle_head == c)
+        w->idle_head = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    /* append */
+    c->prev = w->idle_tail;
+    c->next = NULL;
+    if (w->idle_tail)
+        w->idle_tail->next = c;
+    else
+        w->idle_head = c;
+    w->idle_tail = c;
+}
+
+/*
+ * conn_close - close a connection and free what its response holds; the
+ *     conn_t itself is freed by worker_main after the events at hand
+ */
+static void conn_close(conn_t *c)
+{
+    worker_t *w = c->w;
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        w->idle_head = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        w->idle_tail = c->prev;
+    STAT_ADD(w, open, -1);
+
+    if (c->file)
+        fcache_put(c->file);
+    if (c->relay.busy)
+        relay_end(c, 1);
+    if (c->ranges_file)
+        fcache_put(c->ranges_file);
+    if (c->cgi_out)
+        Free(c->cgi_out);
+    /* a forked CGI program may still hold the socket as its stdout, and
+       epoll drops a socket only when its last descriptor is closed */
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    Close(c->fd);
+    c->state = CONN_CLOSED;
+    c->next = w->closed;
+    w->closed = c;
+}
+
+/*
+ * expire_conns - close the connections idle for idle_timeout seconds,
+ *     return the ms until the next one may expire, or -1 if there is none
+ */
+static int expire_conns(worker_t *w)
+{
+    long now = now_ms(), limit = idle_timeout * 1000L;
+
+    while (w->idle_head && now - w->idle_head->last >= limit)
+    {
+        if (verbose)
+            printf("Closing idle connection %d\n", w->idle_head->fd);
+        STAT_ADD(w, expired, 1);
+        conn_close(w->idle_head);
+    }
+    return w->idle_head ? (int)(w->idle_head->last + limit - now) : -1;
+}
+
+/*
+ * conn_puts - append a string to the response headers
+ */
+static void conn_puts(conn_t *c, char *s)
+{
+    conn_putn(c, s, strlen(s));
+}
+
+/*
+ * conn_putn - append n bytes of s to the response headers, as they fit
+ */
+static void conn_putn(conn_t *c, char *s, size_t n)
+{
+    n = MIN(n, sizeof(c->out) - c->out_len);
+    memcpy(c->out + c->out_len, s, n);
+    c->out_len += n;
+}
+
+/*
+ * conn_header - the value of the Connection header of a response
+ */
+static char *conn_header(conn_t *c)
+{
+    return c->keep_alive ? "keep-alive" : "close";
+}
+
+/*
+ * fcache_init - set up the worker's cache of open files, watched with
+ *     inotify; without inotify a cached file is checked with stat at
+ *     most every FCACHE_CHECK ms
+ */
+static void fcache_init(worker_t *w)
+{
+    struct epoll_event ev;
+    unsigned size = 1;
+
+    while (size < 2 * (unsigned)max_files)
+        size <<= 1;
+    w->files = Calloc(size, sizeof(fentry_t *));
+    w->files_mask = size - 1;
+    w->lru_head = w->lru_tail = NULL;
+    w->nfiles = 0;
+    w->hot_bytes = 0;
+    w->gz_bytes = 0;
+
+    w->ifd = max_files > 0 ? inotify_init1(IN_NONBLOCK | IN_CLOEXEC) : -1;
+    if (w->ifd >= 0)
+    {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = w; /* the inotify instance */
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->ifd, &ev) < 0)
+        {
+            close(w->ifd);
+            w->ifd = -1;
+        }
+    }
+}
+
+/*
+ * fcache_hash - hash of a path
+ */
+static unsigned fcache_hash(char *path)
+{
+    unsigned h = 5381;
+
+    while (*path)
+        h = h * 33 + (unsigned char)*path++;
+    return h;
+}
+
+/*
+ * fcache_unwatch - remove an inotify watch, unless another cached path
+ *     names the same file (and so has the same watch)
+ */
+static void fcache_unwatch(worker_t *w, int wd)
+{
+    fentry_t *f;
+
+    if (wd < 0)
+        return;
+    for (f = w->lru_head; f != NULL; f = f->next)
+        if (f->wd == wd)
+            return;
+    inotify_rm_watch(w->ifd, wd);
+}
+
+/*
+ * fcache_get - the open file and stat of a path, from the cache or opened
+ *     and cached now (evicting the least recently used file when full);
+ *     return NULL with errno set if it cannot be opened. The caller holds
+ *     a reference until fcache_put
+ */
+static fentry_t *fcache_get(worker_t *w, char *path)
+{
+    unsigned h = fcache_hash(path);
+    fentry_t *f, **b = &w->files[h & w->files_mask];
+    struct stat sbuf;
+    struct tm tm;
+    long now;
+    int err;
+
+    for (f = *b; f != NULL; f = f->hnext)
+        if (f->hash == h && !strcmp(f->path, path))
+            break;
+    if (f && w->ifd < 0 && (now = now_ms()) - f->checked >= FCACHE_CHECK)
+    {
+        f->checked = now;
+        if (stat(path, &sbuf) < 0 || sbuf.st_ino != f->st.st_ino ||
+            sbuf.st_dev != f->st.st_dev || sbuf.st_size != f->st.st_size ||
+            sbuf.st_mtim.tv_sec != f->st.st_mtim.tv_sec ||
+            sbuf.st_mtim.tv_nsec != f->st.st_mtim.tv_nsec)
+        {
+            fcache_drop(w, f);
+            f = NULL;
+        }
+    }
+    if (f)
+    {
+        /* move to the end of the LRU list */
+        if (f != w->lru_tail)
+        {
+            if (f->prev)
+                f->prev->next = f->next;
+            else
+                w->lru_head = f->next;
+            f->next->prev = f->prev;
+            f->prev = w->lru_tail;
+            f->next = NULL;
+            w->lru_tail->next = f;
+            w->lru_tail = f;
+        }
+        f->refs++;
+        return f;
+    }
+
+    /* watch before the open, so that no change after it goes unseen */
+    f = Malloc(sizeof(fentry_t));
+    f->wd = -1;
+    if (w->ifd >= 0)
+        f->wd = inotify_add_watch(w->ifd, path, IN_MODIFY | IN_ATTRIB |
+                                  IN_MOVE_SELF | IN_DELETE_SELF);
+    if ((f->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0 ||
+        fstat(f->fd, &f->st) < 0)
+    {
+        err = errno;
+        if (f->fd >= 0)
+            close(f->fd);
+        fcache_unwatch(w, f->wd);
+        Free(f);
+        errno = err;
+        return NULL;
+    }
+    STAT_ADD(w, opens, 1);
+    sprintf(f->etag, "\"%lx-%llx\"", (long)f->st.st_mtime, (long long)f->st.st_size);
+    strftime(f->mtime, sizeof(f->mtime), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&f->st.st_mtime, &tm));
+    f->refs = 1;
+    f->hits = 0;
+    f->data = NULL;
+    f->gz_static = -1;
+    f->gz_tried = 0;
+    f->gz = NULL;
+    if (max_files == 0)
+        return f; /* not cached, closed by fcache_put */
+
+    if (w->nfiles == max_files)
+        fcache_drop(w, w->lru_head);
+    f->path = Malloc(strlen(path) + 1);
+    strcpy(f->path, path);
+    f->hash = h;
+    f->checked = now_ms();
+    f->refs++;
+    f->hnext = *b;
+    *b = f;
+    f->prev = w->lru_tail;
+    f->next = NULL;
+    if (w->lru_tail)
+        w->lru_tail->next = f;
+    else
+        w->lru_head = f;
+    w->lru_tail = f;
+    w->nfiles++;
+    return f;
+}
+
+/*
+ * fcache_put - drop a reference to a file, closing it after the last one
+ */
+static void fcache_put(fentry_t *f)
+{
+    if (--f->refs > 0)
+        return;
+    close(f->fd);
+    if (f->data)
+        Free(f->data);
+    if (f->gz)
+        Free(f->gz);
+    if (max_files > 0)
+        Free(f->path);
+    Free(f);
+}
+
+/*
+ * fcache_drop - take a file out of the cache; the responses still
+ *     sending it keep it open
+ */
+static void fcache_drop(worker_t *w, fentry_t *f)
+{
+    fentry_t **p;
+
+    for (p = &w->files[f->hash & w->files_mask]; *p != f; p = &(*p)->hnext)
+        ;
+    *p = f->hnext;
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        w->lru_head = f->next;
+    if (f->next)
+        f->next->prev = f->prev;
+    else
+        w->lru_tail = f->prev;
+    w->nfiles--;
+    if (f->data)
+        w->hot_bytes -= f->data_len;
+    if (f->gz)
+        w->gz_bytes -= f->gz_len;
+    fcache_unwatch(w, f->wd);
+    fcache_put(f);
+}
+
+/*
+ * fcache_notify - drop the cached files that inotify says have changed,
+ *     moved or gone
+ */
+static void fcache_notify(worker_t *w)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    fentry_t *f, *next;
+    ssize_t n;
+    char *p;
+
+    while ((n = read(w->ifd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+    {
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (struct inotify_event *)p;
+            for (f = w->lru_head; f != NULL; f = next)
+            {
+                next = f->next;
+                if (f->wd == ev->wd)
+                {
+                    f->wd = -1; /* the watch goes with the last of them */
+                    if (verbose)
+                        printf("File changed, dropped from cache: %s\n", f->path);
+                    fcache_drop(w, f);
+                    if (!(ev->mask & IN_IGNORED))
+                        fcache_unwatch(w, ev->wd);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * fcache_load - prebuild the whole response for a cached file, headers and
+ *     body, making room in the worker's byte budget by dropping the least
+ *     recently used files that have one; return 0 on success, -1 if the
+ *     file cannot be loaded
+ */
+static int fcache_load(worker_t *w, fentry_t *f, char *filetype)
+{
+    char hdr[2][MAXBUF];
+    size_t size = f->st.st_size, len;
+    fentry_t *v, *next;
+    ssize_t n;
+    int k;
+
+    for (k = 0; k < 2; k++)
+        f->hdr_len[k] = static_header(hdr[k], f, filetype, k, -1);
+    len = f->hdr_len[0] + f->hdr_len[1] + size;
+    if (len > hot_cache)
+        return -1;
+    for (v = w->lru_head; v != NULL && w->hot_bytes + len > hot_cache; v = next)
+    {
+        next = v->next;
+        if (v->data && v != f)
+            fcache_drop(w, v);
+    }
+
+    f->data = Malloc(len);
+    f->hdr[0] = f->data;
+    f->hdr[1] = f->hdr[0] + f->hdr_len[0];
+    f->body = f->hdr[1] + f->hdr_len[1];
+    memcpy(f->hdr[0], hdr[0], f->hdr_len[0]);
+    memcpy(f->hdr[1], hdr[1], f->hdr_len[1]);
+    for (len = 0; len < size; len += n)
+    {
+        if ((n = pread(f->fd, f->body + len, size - len, len)) <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                n = 0;
+                continue;
+            }
+            Free(f->data); /* the file shrank or cannot be read */
+            f->data = NULL;
+            return -1;
+        }
+    }
+    f->data_len = f->hdr_len[0] + f->hdr_len[1] + size;
+    w->hot_bytes += f->data_len;
+    return 0;
+}
+
+/*
+ * doit - handle one HTTP request/response transaction, whose request line,
+ *     headers (already parsed into c->req) and body are in c->in
+ */
+/* $begin doit */
+void doit(conn_t *c)
+{
+    int servtype, is_head;
+    str_t method = c->req.method, ctype = c->req.content_type;
+    char filetype[MAXLINE], filename[MAXLINE], cgiargs[MAXLINE], cause[MAXLINE];
+
+    /* determine request method */
+    is_head = 0;
+    if (str_eq(method, "GET"))
+        servtype = parse_uri(c->req.uri, filetype, filename, cgiargs);
+    else if (str_eq(method, "HEAD"))
+    {
+        is_head = 1;
+        servtype = parse_uri(c->req.uri, filetype, filename, cgiargs);
+    }
+    else if (str_eq(method, "POST"))
+    {
+        if (!memmem(ctype.p, ctype.len, "application/x-www-form-urlencoded", 33))
+        {
+            sprintf(cause, "%.*s", (int)ctype.len, ctype.p);
+            clienterror(c, cause, "415", "Unsupported Media Type",
+                        "Tiny does not support this content-type(or not specified) for post");
+            return;
+        }
+        sprintf(filename, ".%.*s", (int)c->req.uri.len, c->req.uri.p);
+        /* the body, n1=15&n2=23 say, is framed by Content-Length
+         * (Chrome sends no \r\n or EOF after it), and conn_read
+         * has waited for all of it
+         */
+        memcpy(cgiargs, c->in + c->hdr_len, c->post_len);
+        cgiargs[c->post_len] = '\0';
+        servtype = SERVICE_DYNAMIC;
+    }
+    else
+    {
+        sprintf(cause, "%.*s", (int)method.len, method.p);
+        clienterror(c, cause, "501", "Not Implemented",
+                    "Tiny does not implement this method");
+        return;
+    }
+
+    /* serve content */
+    switch (servtype)
+    {
+    case SERVICE_STATIC:
+        serve_static(c, filetype, filename, is_head);
+        break;
+    case SERVICE_DYNAMIC:
+        serve_dynamic(c, filename, cgiargs, is_head);
+        break;
+    default:
+        clienterror(c, filename, "400", "Bad Request",
+                    "Tiny couldn't understand the request due to invalid syntax");
+    }
+}
+/* $end doit */
+
+/*
+ * read_requesthdrs - act on the headers http_parse found in
+ *     c->in[0, c->hdr_len)
+ *     - an HTTP/1.1 connection stays open unless the client says close,
+ *       an HTTP/1.0 one only if it says keep-alive
+ */
+/* $begin read_requesthdrs */
+void read_requesthdrs(conn_t *c)
+{
+    http_req_t *r = &c->req;
+
+    if (verbose)
+        printf("%.*s", (int)c->hdr_len, c->in);
+
+    c->keep_alive = r->major == 1 && r->minor >= 1;
+    if (str_has_token(r->connection, "close"))
+        c->keep_alive = 0;
+    else if (str_has_token(r->connection, "keep-alive"))
+        c->keep_alive = 1;
+    if (r->transfer_encoding.len > 0)
+        c->keep_alive = 0; /* a chunked body would pass for a request */
+    if (++c->nreq >= max_requests)
+        c->keep_alive = 0;
+
+    return;
+}
+/* $end read_requesthdrs */
+
+/*
+ * parse_uri - parse URI into filename and CGI args
+ *             return 0 if dynamic content, 1 if static
+ */
+/* $begin parse_uri */
+int parse_uri(str_t uri, char *filetype, char *filename, char *cgiargs)
+{
+    const char *ptr;
+    int len = uri.len;
+
+    if (!memmem(uri.p, uri.len, "cgi-bin", 7))
+    { /* Static content */
+        strcpy(cgiargs, "");
+        sprintf(filename, ".%.*s%s", len, uri.p,
+                uri.p[len - 1] == '/' ? "home.html" : "");
+        get_filetype(filename, filetype);
+
+        return SERVICE_STATIC;
+    }
+    else
+    { /* Dynamic content */
+        ptr = memchr(uri.p, '?', uri.len);
+        if (ptr)
+        {
+            sprintf(cgiargs, "%.*s", (int)(uri.p + len - ptr - 1), ptr + 1);
+            len = ptr - uri.p;
+        }
+        else
+            strcpy(cgiargs, "");
+        sprintf(filename, ".%.*s", len, uri.p);
+        return SERVICE_DYNAMIC;
+    }
+}
+/* $end parse_uri */
+
+/*
+ * serve_static - copy a file back to the client
+ *     - a small file asked for more than once gets its whole response
+ *       prebuilt in the file cache, and later requests send it as is
+ *     - a Range asks for parts of the file instead (serve_ranges), unless
+ *       an If-Range shows the client has another version of it
+ *     - a text file goes gzipped to a client that takes gzip (serve_gzip)
+ */
+/* $begin serve_static */
+void serve_static(conn_t *c, char *filetype, char *filename, int is_head)
+{
+    off_t filesize;
+    fentry_t *f;
+    char buf[MAXBUF];
+    int n;
+
+    /* open the file (or find it open) and check its stat */
+    if ((f = fcache_get(c->w, filename)) == NULL && errno != EACCES)
+    {
+        clienterror(c, filename, "404", "Not found",
+                    "Tiny couldn't find this file");
+        return;
+    }
+    if (f == NULL || !(S_ISREG(f->st.st_mode)) || !(S_IRUSR & f->st.st_mode))
+    {
+        if (f)
+            fcache_put(f);
+        clienterror(c, filename, "403", "Forbidden",
+                    "Tiny couldn't read the file");
+        return;
+    }
+    filesize = f->st.st_size;
+
+    if (c->req.range.len > 0 && range_fresh(c, f) &&
+        (n = http_ranges(c->req.range, filesize, c->ranges, HTTP_MAXRANGES)) >= 0)
+    {
+        serve_ranges(c, f, filetype, n, is_head);
+        return;
+    }
+
+    if (c->req.accept_encoding.len > 0 && gzip_type(filetype) &&
+        http_accepts(c->req.accept_encoding, "gzip") &&
+        serve_gzip(c, f, filename, filetype, is_head) == 0)
+        return;
+
+    /* a hot file: its prebuilt response, straight from memory */
+    if (f->data == NULL && f->refs > 1 && ++f->hits >= 2 &&
+        filesize <= HOT_FILE_MAX)
+        fcache_load(c->w, f, filetype);
+    if (f->data)
+    {
+        c->head = f->hdr[c->keep_alive];
+        c->out_len = f->hdr_len[c->keep_alive];
+        if (verbose)
+        {
+            printf("Response headers:\n");
+            printf("%.*s", (int)c->out_len, c->head);
+        }
+        if (!is_head)
+        {
+            c->body = f->body;
+            c->body_len = filesize;
+        }
+        c->file = f; /* held until the response is out */
+        STAT_ADD(c->w, hot, 1);
+        return;
+    }
+
+    /* Send response headers to client */
+    static_header(buf, f, filetype, c->keep_alive, -1);
+    if (verbose)
+    {
+        printf("Response headers:\n");
+        printf("%s", buf);
+    }
+    conn_puts(c, buf);
+
+    /* Send response body to client, conn_write sends it from the file */
+    if (is_head || filesize == 0)
+    {
+        fcache_put(f);
+        return;
+    }
+    c->file = f;
+    c->file_off = 0;
+    c->file_left = filesize;
+}
+
+/*
+ * static_header - the headers of a static response into buf (MAXBUF
+ *     bytes), return their length; with gz_len >= 0 the body is the file
+ *     gzipped, gz_len bytes of it (with an ETag of its own, and no ranges
+ *     of it served)
+ */
+static int static_header(char *buf, fentry_t *f, char *filetype, int keep_alive,
+                         long gz_len)
+{
+    int n;
+
+    n = snprintf(buf, MAXBUF, "HTTP/1.1 200 OK\r\n");
+    n += snprintf(buf + n, MAXBUF - n, "Server: Tiny Web Server\r\n");
+    n += snprintf(buf + n, MAXBUF - n, "Connection: %s\r\n",
+                  keep_alive ? "keep-alive" : "close");
+    if (gz_len < 0)
+    {
+        n += snprintf(buf + n, MAXBUF - n, "Accept-Ranges: bytes\r\n");
+        n += snprintf(buf + n, MAXBUF - n, "ETag: %s\r\n", f->etag);
+    }
+    else
+    {
+        n += snprintf(buf + n, MAXBUF - n, "Content-Encoding: gzip\r\n");
+        n += snprintf(buf + n, MAXBUF - n, "ETag: %.*s-gz\"\r\n",
+                      (int)strlen(f->etag) - 1, f->etag);
+    }
+    if (gzip_type(filetype))
+        n += snprintf(buf + n, MAXBUF - n, "Vary: Accept-Encoding\r\n");
+    n += snprintf(buf + n, MAXBUF - n, "Last-Modified: %s\r\n", f->mtime);
+    n += snprintf(buf + n, MAXBUF - n, "Content-length: %lld\r\n",
+                  gz_len < 0 ? (long long)f->st.st_size : (long long)gz_len);
+    n += snprintf(buf + n, MAXBUF - n, "Content-type: %s\r\n\r\n", filetype);
+    return n;
+}
+
+/*
+ * gzip_type - is a file of this type worth gzipping (text compresses,
+ *     the images and video Tiny serves are compressed already)
+ */
+static int gzip_type(char *filetype)
+{
+    return !strncmp(filetype, "text/", 5);
+}
+
+/*
+ * serve_gzip - send the file gzipped: path.gz if there is one next to it,
+ *     else the file compressed once and kept with its cache entry; return
+ *     -1 to send it as is (f is still held then), 0 if the response is on
+ *     its way
+ */
+static int serve_gzip(conn_t *c, fentry_t *f, char *filename, char *filetype,
+                      int is_head)
+{
+    char path[MAXLINE], buf[MAXBUF];
+    struct stat sbuf;
+    fentry_t *g;
+    off_t size = f->st.st_size;
+
+    /* a precompressed sibling, looked for once per opening of the file */
+    snprintf(path, sizeof(path), "%s.gz", filename);
+    if (f->gz_static < 0)
+        f->gz_static = stat(path, &sbuf) == 0 && S_ISREG(sbuf.st_mode);
+    if (f->gz_static)
+    {
+        if ((g = fcache_get(c->w, path)) != NULL && S_ISREG(g->st.st_mode))
+        {
+            static_header(buf, g, filetype, c->keep_alive, g->st.st_size);
+            if (verbose)
+            {
+                printf("Response headers:\n");
+                printf("%s", buf);
+            }
+            conn_puts(c, buf);
+            fcache_put(f);
+            STAT_ADD(c->w, gzip, 1);
+            if (is_head || g->st.st_size == 0)
+            {
+                fcache_put(g);
+                return 0;
+            }
+            c->file = g;
+            c->file_off = 0;
+            c->file_left = g->st.st_size;
+            return 0;
+        }
+        if (g)
+            fcache_put(g);
+        f->gz_static = 0; /* gone since */
+    }
+
+    /* else compressed on the fly, once per cached file */
+    if (f->gz == NULL && !f->gz_tried && f->refs > 1 && gzip_cache > 0 &&
+        size >= GZIP_MIN && size <= GZIP_FILE_MAX)
+    {
+        f->gz_tried = 1;
+        fcache_gzip(c->w, f, filetype);
+    }
+    if (f->gz == NULL)
+        return -1;
+    c->head = f->gz_hdr[c->keep_alive];
+    c->out_len = f->gz_hdr_len[c->keep_alive];
+    if (verbose)
+    {
+        printf("Response headers:\n");
+        printf("%.*s", (int)c->out_len, c->head);
+    }
+    if (!is_head)
+    {
+        c->body = f->gz_body;
+        c->body_len = f->gz_body_len;
+    }
+    c->file = f; /* held until the response is out */
+    STAT_ADD(c->w, gzip, 1);
+    return 0;
+}
+
+/*
+ * fcache_gzip - gzip a cached file into a prebuilt response, headers and
+ *     body, making room in the worker's gzip budget by dropping the least
+ *     recently used files that have one; return 0 on success, -1 if the
+ *     file cannot be read or does not get smaller
+ */
+static int fcache_gzip(worker_t *w, fentry_t *f, char *filetype)
+{
+    char hdr[2][MAXBUF], *src = f->body, *out;
+    size_t size = f->st.st_size, len, bound;
+    fentry_t *v, *next;
+    z_stream z;
+    ssize_t n;
+    int k, rc;
+
+    /* the file, from its prebuilt response or read for the purpose */
+    if (f->data == NULL)
+    {
+        src = Malloc(size);
+        for (len = 0; len < size; len += n)
+        {
+            if ((n = pread(f->fd, src + len, size - len, len)) <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                {
+                    n = 0;
+                    continue;
+                }
+                Free(src); /* the file shrank or cannot be read */
+                return -1;
+            }
+        }
+    }
+
+    /* windowBits 15 + 16: a gzip wrapper, not zlib's */
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        if (src != f->body)
+            Free(src);
+        return -1;
+    }
+    bound = deflateBound(&z, size);
+    out = Malloc(bound);
+    z.next_in = (Bytef *)src;
+    z.avail_in = size;
+    z.next_out = (Bytef *)out;
+    z.avail_out = bound;
+    rc = deflate(&z, Z_FINISH);
+    f->gz_body_len = z.total_out;
+    deflateEnd(&z);
+    if (src != f->body)
+        Free(src);
+    if (rc != Z_STREAM_END || f->gz_body_len >= size)
+    {
+        Free(out);
+        return -1;
+    }
+
+    for (k = 0; k < 2; k++)
+        f->gz_hdr_len[k] = static_header(hdr[k], f, filetype, k,
+                                         f->gz_body_len);
+    len = f->gz_hdr_len[0] + f->gz_hdr_len[1] + f->gz_body_len;
+    if (len > gzip_cache)
+    {
+        Free(out);
+        return -1;
+    }
+    for (v = w->lru_head; v != NULL && w->gz_bytes + len > gzip_cache; v = next)
+    {
+        next = v->next;
+        if (v->gz && v != f)
+            fcache_drop(w, v);
+    }
+
+    f->gz = Malloc(len);
+    f->gz_hdr[0] = f->gz;
+    f->gz_hdr[1] = f->gz_hdr[0] + f->gz_hdr_len[0];
+    f->gz_body = f->gz_hdr[1] + f->gz_hdr_len[1];
+    memcpy(f->gz_hdr[0], hdr[0], f->gz_hdr_len[0]);
+    memcpy(f->gz_hdr[1], hdr[1], f->gz_hdr_len[1]);
+    memcpy(f->gz_body, out, f->gz_body_len);
+    Free(out);
+    f->gz_len = len;
+    w->gz_bytes += len;
+    return 0;
+}
+
+/*
+ * range_fresh - may the Range of the request be served from f: yes
+ *     without If-Range, or if it names f's ETag or Last-Modified
+ */
+static int range_fresh(conn_t *c, fentry_t *f)
+{
+    str_t v = c->req.if_range;
+    char *tag = v.len > 0 && v.p[0] == '"' ? f->etag : f->mtime;
+
+    return v.len == 0 || (v.len == strlen(tag) && !memcmp(v.p, tag, v.len));
+}
+
+/*
+ * serve_ranges - send the n ranges of f in c->ranges: one as a 206 with
+ *     its Content-Range, several as a multipart/byteranges body whose
+ *     parts range_next sends one after the other, none as a 416
+ *     - the bytes go out from the prebuilt body if f is hot, else with
+ *       sendfile, like a whole file
+ */
+static void serve_ranges(conn_t *c, fentry_t *f, char *filetype, int n, int is_head)
+{
+    char buf[MAXBUF], part[MAXLINE];
+    off_t size = f->st.st_size, length;
+    http_range_t *r = c->ranges;
+    int i, k;
+
+    if (n == 0)
+    {
+        fcache_put(f);
+        k = snprintf(buf, MAXBUF, "HTTP/1.1 416 Range Not Satisfiable\r\n");
+        k += snprintf(buf + k, MAXBUF - k, "Connection: %s\r\n", conn_header(c));
+        k += snprintf(buf + k, MAXBUF - k, "Content-Range: bytes */%lld\r\n",
+                      (long long)size);
+        k += snprintf(buf + k, MAXBUF - k, "Content-length: 0\r\n\r\n");
+        if (verbose)
+        {
+            printf("Response headers:\n");
+            printf("%s", buf);
+        }
+        conn_puts(c, buf);
+        return;
+    }
+
+    k = snprintf(buf, MAXBUF, "HTTP/1.1 206 Partial Content\r\n");
+    k += snprintf(buf + k, MAXBUF - k, "Server: Tiny Web Server\r\n");
+    k += snprintf(buf + k, MAXBUF - k, "Connection: %s\r\n", conn_header(c));
+    k += snprintf(buf + k, MAXBUF - k, "Accept-Ranges: bytes\r\n");
+    k += snprintf(buf + k, MAXBUF - k, "ETag: %s\r\n", f->etag);
+    k += snprintf(buf + k, MAXBUF - k, "Last-Modified: %s\r\n", f->mtime);
+    if (n == 1)
+    {
+        length = r[0].end + 1 - r[0].start;
+        k += snprintf(buf + k, MAXBUF - k, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                      (long long)r[0].start, (long long)r[0].end, (long long)size);
+        k += snprintf(buf + k, MAXBUF - k, "Content-length: %lld\r\n",
+                      (long long)length);
+        k += snprintf(buf + k, MAXBUF - k, "Content-type: %s\r\n\r\n", filetype);
+    }
+    else
+    {
+        /* the length of the whole multipart body, ahead of it */
+        sprintf(c->boundary, "%020lu", ++c->w->multiparts);
+        snprintf(c->range_type, sizeof(c->range_type), "%s", filetype);
+        c->ranges_file = f;
+        for (length = 0, i = 0; i < n; i++)
+            length += part_header(c, part, i) + r[i].end + 1 - r[i].start;
+        length += snprintf(part, sizeof(part), "\r\n--%s--\r\n", c->boundary);
+        k += snprintf(buf + k, MAXBUF - k, "Content-length: %lld\r\n",
+                      (long long)length);
+        k += snprintf(buf + k, MAXBUF - k,
+                      "Content-type: multipart/byteranges; boundary=%s\r\n\r\n",
+                      c->boundary);
+    }
+    if (verbose)
+    {
+        printf("Response headers:\n");
+        printf("%s", buf);
+    }
+    conn_puts(c, buf);
+    if (is_head)
+    {
+        fcache_put(f);
+        c->ranges_file = NULL;
+        return;
+    }
+    if (n > 1)
+    {
+        c->nranges = n;
+        c->range_i = 0;
+        range_next(c);
+        return;
+    }
+
+    /* Send response body to client, conn_write sends it */
+    c->file = f;
+    if (f->data)
+    {
+        c->body = f->body + r[0].start;
+        c->body_len = length;
+    }
+    else
+    {
+        c->file_off = r[0].start;
+        c->file_left = length;
+    }
+}
+
+/*
+ * part_header - the boundary and headers in front of part i of a
+ *     multipart body into buf (MAXLINE bytes), return their length
+ */
+static size_t part_header(conn_t *c, char *buf, int i)
+{
+    return snprintf(buf, MAXLINE, "%s--%s\r\nContent-type: %s\r\n"
+                                  "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    i > 0 ? "\r\n" : "", c->boundary, c->range_type,
+                    (long long)c->ranges[i].start, (long long)c->ranges[i].end,
+                    (long long)c->ranges_file->st.st_size);
+}
+
+/*
+ * range_next - set up the next part of a multipart body, or after the
+ *     last one the closing boundary, when the last piece is out
+ */
+static void range_next(conn_t *c)
+{
+    fentry_t *f = c->ranges_file;
+    http_range_t *r = &c->ranges[c->range_i];
+    char buf[MAXLINE];
+
+    if (c->out_off == c->out_len)
+        c->out_len = c->out_off = 0; /* the last piece is out */
+    c->body_len = c->body_off = 0;
+    if (c->range_i == c->nranges)
+    {
+        snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", c->boundary);
+        conn_puts(c, buf);
+        fcache_put(f);
+        c->ranges_file = NULL;
+        c->nranges = c->range_i = 0;
+        return;
+    }
+    part_header(c, buf, c->range_i++);
+    conn_puts(c, buf);
+    c->file = f;
+    f->refs++; /* one for the part, released by conn_write */
+    if (f->data)
+    {
+        c->body = f->body + r->start;
+        c->body_len = r->end + 1 - r->start;
+    }
+    else
+    {
+        c->file_off = r->start;
+        c->file_left = r->end + 1 - r->start;
+    }
+}
+
+/*
+ * get_filetype - derive file type from file name
+ */
+void get_filetype(char *filename, char *filetype)
+{
+    if (strstr(filename, ".html"))
+        strcpy(filetype, "text/html");
+    else if (strstr(filename, ".gif"))
+        strcpy(filetype, "image/gif");
+    else if (strstr(filename, ".png"))
+        strcpy(filetype, "image/png");
+    else if (strstr(filename, ".jpg"))
+        strcpy(filetype, "image/jpeg");
+    else if (strstr(filename, ".mp4"))
+        strcpy(filetype, "video/mp4");
+    else
+        strcpy(filetype, "text/plain");
+}
+/* $end serve_static */
+
+/*
+ * serve_dynamic - run a CGI program on behalf of the client
+ *     - the program writes to a pipe, and the worker relays what comes out
+ *       of it as the client takes it (relay_read), so the connection is
+ *       served like any other: framed, kept alive and timed out
+ *     - with -w the request goes to a pooled program instead (cgi_dispatch)
+ */
+/* $begin serve_dynamic */
+void serve_dynamic(conn_t *c, char *filename, char *cgiargs, int is_head)
+{
+    struct stat sbuf;
+    struct epoll_event ev;
+    char *emptylist[] = {NULL};
+    cgi_pipe_t *r = &c->relay;
+    int fds[2];
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp, char *range, char *content_type, int *content_length_ptr);
-int parse_uri(char *uri, char *filetype, char *filename, char *cgiargs);
-void serve_static(int fd, char *filetype, char *filename, int is_head);
-void get_filetype(char *filename, char *filetype);
-void serve_mp4(int fd, char *filename, char *range, int is_head);
-void serve_dynamic(int fd, char *filename, char *cgiargs, int is_head);
-void clienterror(int fd, char *cause, char *errnum,
-                 char *shortmsg, char *longmsg);
+    /* check file stat */
+    if (stat(filename, &sbuf) < 0)
+    {
+        clienterror(c, filename, "404", "Not found",
+                    "Tiny couldn't find this file");
+        return;
+    }
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode))
+    {
+        clienterror(c, filename, "403", "Forbidden",
+                    "Tiny couldn't run the CGI program");
+        return;
+    }
+    if (cgi_procs > 0)
+    {
+        cgi_dispatch(c, filename, cgiargs, is_head);
+        return;
+    }
 
-int main(int argc, char **argv)
-{
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        clienterror(c, filename, "503", "Service Unavailable",
+                    "Tiny couldn't run the CGI program");
+        return;
+    }
+    if ((r->pid = Fork()) == 0)
+    { /* Child */
+        sigset_t none;
 
-    /* Check command line args */
-    if (argc != 2)
+        /* the signals the workers block would stay blocked in the program */
+        sigemptyset(&none);
+        pthread_sigmask(SIG_SETMASK, &none, NULL);
+        /* Real server would set all CGI vars here */
+        setenv("QUERY_STRING", cgiargs, 1);
+        if (is_head)
+            setenv("IS_HEAD", "HEAD", 1);
+        Dup2(fds[1], STDOUT_FILENO);          /* Redirect stdout to the pipe */
+        Execve(filename, emptylist, environ); /* Run CGI program */
+    }
+    close(fds[1]);
+
+    /* the headers come first, relay_read answers when they are in */
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    r->fd = fds[0];
+    r->busy = 1;
+    r->is_head = is_head;
+    r->chunks = 0;
+    r->piece = 0;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = r;
+    if (epoll_ctl(c->w->epfd, EPOLL_CTL_ADD, r->fd, &ev) < 0)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+        relay_end(c, 1);
+        clienterror(c, filename, "503", "Service Unavailable",
+                    "Tiny couldn't run the CGI program");
+        return;
     }
+    c->cgi_out = Malloc(CGI_BUF);
+    c->cgi_len = 0;
+    c->state = CONN_CGI;
+}
+/* $end serve_dynamic */
 
-    /* register signal handler */
-    Signal(SIGCHLD, sigchld_handler);
-    Signal(SIGPIPE, sigpipe_handler);
+/*
+ * cgi_pool - the pool of a CGI program in a worker, made (with no
+ *     process started yet) on its first request
+ */
+static cgi_pool_t *cgi_pool(worker_t *w, char *path)
+{
+    cgi_pool_t *pool;
+    int i;
 
-    listenfd = Open_listenfd(argv[1]);
-    while (1)
+    for (pool = w->pools; pool != NULL; pool = pool->next)
+        if (!strcmp(pool->path, path))
+            return pool;
+    pool = Malloc(sizeof(cgi_pool_t));
+    pool->path = Malloc(strlen(path) + 1);
+    strcpy(pool->path, path);
+    pool->w = w;
+    pool->procs = Calloc(cgi_procs, sizeof(cgi_proc_t));
+    for (i = 0; i < cgi_procs; i++)
     {
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE,
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        doit(connfd);
-        Close(connfd);
+        pool->procs[i].type = EV_CGI;
+        pool->procs[i].fd = -1;
+        pool->procs[i].started = -CGI_RESTART_MS;
+        pool->procs[i].pool = pool;
+        pool->procs[i].rbuf = Malloc(sizeof(cgi_hdr_t) + CGI_MAXDATA);
     }
+    pool->next = w->pools;
+    w->pools = pool;
+    return pool;
 }
-/* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * cgi_start - start a pooled program, with its end of a socket pair on
+ *     CGI_FD; return 0, or -1 if it cannot be started
  */
-/* $begin doit */
-void doit(int fd)
+static int cgi_start(cgi_proc_t *p)
 {
-    int servtype, is_head;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filetype[MAXLINE], filename[MAXLINE], cgiargs[MAXLINE];
-    char range[MAXLINE], content_type[MAXLINE];
-    int content_length;
-    rio_t rio;
-
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))
-        return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    read_requesthdrs(&rio, range, content_type, &content_length);
+    int sv[2];
+    struct epoll_event ev;
+    char *emptylist[] = {NULL};
 
-    /* determine request method */
-    is_head = 0;
-    if (!strcasecmp(method, "GET"))
-        servtype = parse_uri(uri, filetype, filename, cgiargs);
-    else if (!strcasecmp(method, "HEAD"))
+    p->started = now_ms();
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    if ((p->pid = fork()) < 0)
     {
-        is_head = 1;
-        servtype = parse_uri(uri, filetype, filename, cgiargs);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
     }
-    else if (!strcasecmp(method, "POST"))
+    if (p->pid == 0)
+    { /* Child */
+        sigset_t none;
+
+        sigemptyset(&none);
+        pthread_sigmask(SIG_SETMASK, &none, NULL);
+        if (sv[1] == CGI_FD)
+            fcntl(CGI_FD, F_SETFD, 0);
+        else
+            Dup2(sv[1], CGI_FD); /* the copy stays open across exec */
+        setenv(CGI_ENV, "1", 1);
+        Execve(p->pool->path, emptylist, environ);
+    }
+    close(sv[1]);
+    p->fd = sv[0];
+    fcntl(p->fd, F_SETFL, O_NONBLOCK);
+    p->rlen = p->wlen = p->woff = 0;
+    p->stalled = NULL;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = p;
+    if (epoll_ctl(p->pool->w->epfd, EPOLL_CTL_ADD, p->fd, &ev) < 0)
     {
-        if (content_type[0] == '\0' || !strstr(content_type, "application/x-www-form-urlencoded"))
-        {
-            clienterror(fd, content_type, "415", "Unsupported Media Type",
-                        "Tiny does not support this content-type(or not specified) for post");
-            return;
-        }
-        strcpy(filename, ".");
-        strcat(filename, uri);
-        /* Rio_readlineb(&rio, cgiargs, MAXLINE);
-         * can not be used, because Chrome, for example, 
-         * will only send n1=15&n2=23 but without \r\n or EOF
-         * so we should pass in the Content-Length param
-         */
-        Rio_readlineb(&rio, cgiargs, MIN(content_length + 1, MAXLINE));
-        servtype = SERVICE_DYNAMIC;
+        close(p->fd);
+        p->fd = -1;
+        kill(p->pid, SIGKILL);
+        return -1;
     }
-    else
+    if (verbose)
+        printf("Started CGI program %s, pid %d\n", p->pool->path, (int)p->pid);
+    return 0;
+}
+
+/*
+ * cgi_dispatch - send a request to the least busy program of its pool,
+ *     restarting the ones that are down (at most once every
+ *     CGI_RESTART_MS, so that a program that dies at once does not spin);
+ *     the connection waits in CONN_CGI, and its output is relayed as a
+ *     forked program's is
+ */
+static void cgi_dispatch(conn_t *c, char *filename, char *cgiargs, int is_head)
+{
+    cgi_pool_t *pool = cgi_pool(c->w, filename);
+    cgi_proc_t *p, *best = NULL;
+    cgi_hdr_t hdr;
+    long now = now_ms();
+    char vars[2 * MAXLINE];
+    int i, id;
+
+    for (i = 0; i < cgi_procs; i++)
     {
-        clienterror(fd, method, "501", "Not Implemented",
-                    "Tiny does not implement this method");
+        p = &pool->procs[i];
+        if (p->fd < 0 && now - p->started >= CGI_RESTART_MS)
+            cgi_start(p);
+        if (p->fd >= 0 && (best == NULL || p->inflight < best->inflight))
+            best = p;
+    }
+    if ((p = best) == NULL)
+    {
+        clienterror(c, filename, "503", "Service Unavailable",
+                    "Tiny couldn't start the CGI program");
         return;
     }
 
-    /* serve content */
-    switch (servtype)
+    /* a free id */
+    for (id = 0; id < p->nslots && p->slots[id].busy; id++)
+        ;
+    if (id == p->nslots)
     {
-    case SERVICE_STATIC:
-        serve_static(fd, filetype, filename, is_head);
-        break;
-    case SERVICE_DYNAMIC:
-        serve_dynamic(fd, filename, cgiargs, is_head);
-        break;
-    case SERVICE_MP4:
-        serve_mp4(fd, filename, range, is_head);
-        break;
-    default:
-        clienterror(fd, filename, "400", "Bad Request",
-                    "Tiny couldn't understand the request due to invalid syntax");
+        p->nslots = p->nslots ? 2 * p->nslots : 8;
+        p->slots = Realloc(p->slots, p->nslots * sizeof(cgi_slot_t));
+        memset(p->slots + id, 0, (p->nslots - id) * sizeof(cgi_slot_t));
+    }
+    p->slots[id].busy = 1;
+    p->slots[id].c = c;
+    p->inflight++;
+
+    /* the message, behind the ones not written yet */
+    hdr.id = id;
+    hdr.type = CGI_REQUEST;
+    hdr.len = sprintf(vars, "QUERY_STRING=%s%cIS_HEAD=%s%c", cgiargs, '\0',
+                      is_head ? "HEAD" : "", '\0');
+    if (p->wlen + sizeof(hdr) + hdr.len > p->wcap)
+    {
+        p->wcap = 2 * (p->wlen + sizeof(hdr) + hdr.len);
+        p->wbuf = Realloc(p->wbuf, p->wcap);
     }
+    memcpy(p->wbuf + p->wlen, &hdr, sizeof(hdr));
+    memcpy(p->wbuf + p->wlen + sizeof(hdr), vars, hdr.len);
+    p->wlen += sizeof(hdr) + hdr.len;
+    cgi_flush(p);
+
+    c->cgi = p;
+    c->cgi_id = id;
+    c->cgi_out = Malloc(CGI_BUF);
+    c->cgi_len = 0;
+    c->relay.busy = 1;
+    c->relay.is_head = is_head;
+    c->relay.chunks = 0;
+    c->relay.piece = 0;
+    c->state = CONN_CGI;
 }
-/* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * cgi_flush - write the requests waiting for a program; a write error
+ *     shuts the socket down, and the event that follows takes the
+ *     program down
  */
-/* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp, char *range, char *content_type, int *content_length_ptr)
+static void cgi_flush(cgi_proc_t *p)
 {
-    char buf[MAXLINE];
-    range[0] = '\0';
-    content_type[0] = '\0';
-    *content_length_ptr = 0;
-
-    do
-    {
-        // TODO
-        // Rio_readlineb use Unix read under the hood
-        // so it is blocking
-        // in the case a client send GET / HTTP/1.0\r\n
-        // and then terminate
-        // the result is the server enters a loop here
-        Rio_readlineb(rp, buf, MAXLINE);
-        printf("%s", buf);
-        if (strstr(buf, "Range"))
-            strcpy(range, buf);
-        else if (strstr(buf, "Content-Type"))
-            strcpy(content_type, buf);
-        else if (strstr(buf, "Content-Length"))
-            sscanf(buf, "Content-Length: %d", content_length_ptr);
-    } while (strcmp(buf, "\r\n"));
+    ssize_t n;
 
-    return;
+    while (p->woff < p->wlen)
+    {
+        if ((n = write(p->fd, p->wbuf + p->woff, p->wlen - p->woff)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                shutdown(p->fd, SHUT_RDWR);
+            return;
+        }
+        p->woff += n;
+    }
+    p->wlen = p->woff = 0;
 }
-/* $end read_requesthdrs */
 
 /*
- * parse_uri - parse URI into filename and CGI args
- *             return 0 if dynamic content, 1 if static
+ * cgi_event - write what waits for a program, and take its messages
+ *     (cgi_take) as long as no connection's buffer is full. A program
+ *     that closes its socket or breaks the protocol is down
  */
-/* $begin parse_uri */
-int parse_uri(char *uri, char *filetype, char *filename, char *cgiargs)
+static void cgi_event(cgi_proc_t *p)
 {
-    char *ptr;
-
-    if (!strstr(uri, "cgi-bin"))
-    { /* Static content (including mp4) */
-        strcpy(cgiargs, "");
-        strcpy(filename, ".");
-        strcat(filename, uri);
-        if (uri[strlen(uri) - 1] == '/')
-            strcat(filename, "home.html");
-        get_filetype(filename, filetype);
+    ssize_t n;
 
-        return strstr(filename, "mp4") ? SERVICE_MP4 : SERVICE_STATIC;
-    }
-    else
-    { /* Dynamic content */
-        ptr = index(uri, '?');
-        if (ptr)
+    if (p->fd < 0)
+        return; /* down earlier in the events at hand */
+    cgi_flush(p);
+    while (1)
+    {
+        if (p->stalled != NULL || cgi_take(p) < 0 || p->stalled != NULL)
+            return; /* wait for a client, or down */
+        n = read(p->fd, p->rbuf + p->rlen, sizeof(cgi_hdr_t) + CGI_MAXDATA - p->rlen);
+        if (n > 0)
+            p->rlen += n;
+        else if (n == 0 || (errno != EINTR && errno != EAGAIN))
         {
-            strcpy(cgiargs, ptr + 1);
-            *ptr = '\0';
+            cgi_down(p);
+            return;
         }
-        else
-            strcpy(cgiargs, "");
-        strcpy(filename, ".");
-        strcat(filename, uri);
-        return SERVICE_DYNAMIC;
+        else if (errno == EAGAIN)
+            return;
     }
 }
-/* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * cgi_take - take the whole messages read from a program: output goes to
+ *     the cgi_out of its connection, and the end of a request sends the
+ *     rest of the response. A message that does not fit in cgi_out is
+ *     split, its rest left in rbuf, and the program stalled until the
+ *     client has taken what is there. Return -1 if the program broke the
+ *     protocol (it is down), else 0
+ *     - a connection is sent its output as it comes once its headers
+ *       are out, and before that only when cgi_out is full or the output
+ *       is complete, so that a short response has a Content-Length
  */
-/* $begin serve_static */
-void serve_static(int fd, char *filetype, char *filename, int is_head)
+static int cgi_take(cgi_proc_t *p)
 {
-    int srcfd, filesize;
-    struct stat sbuf;
-    char *srcp, buf[MAXBUF];
+    cgi_hdr_t hdr;
+    conn_t *c;
+    size_t used = 0, n;
 
-    /* check file stat */
-    if (stat(filename, &sbuf) < 0)
-    {
-        clienterror(fd, filename, "404", "Not found",
-                    "Tiny couldn't find this file");
-        return;
-    }
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
+    while (p->stalled == NULL && p->rlen - used >= sizeof(hdr))
     {
-        clienterror(fd, filename, "403", "Forbidden",
-                    "Tiny couldn't read the file");
-        return;
+        memcpy(&hdr, p->rbuf + used, sizeof(hdr));
+        if (hdr.len > CGI_MAXDATA || hdr.id >= (uint32_t)p->nslots ||
+            !p->slots[hdr.id].busy ||
+            (hdr.type != CGI_STDOUT && hdr.type != CGI_END))
+        {
+            kill(p->pid, SIGKILL);
+            cgi_down(p);
+            return -1;
+        }
+        if (p->rlen - used < sizeof(hdr) + hdr.len)
+            break;
+        c = p->slots[hdr.id].c;
+        if (hdr.type == CGI_STDOUT && c != NULL)
+        {
+            n = MIN(hdr.len, CGI_BUF - c->cgi_len);
+            memcpy(c->cgi_out + c->cgi_len, p->rbuf + used + sizeof(hdr), n);
+            c->cgi_len += n;
+            if (n < hdr.len)
+            { /* the rest, as a message of its own in front of its data */
+                used += n;
+                hdr.len -= n;
+                memcpy(p->rbuf + used, &hdr, sizeof(hdr));
+                cgi_stall(p, c);
+            }
+            else
+                used += sizeof(hdr) + hdr.len;
+            if (p->stalled != NULL || c->state == CONN_WRITE)
+                conn_event(c, 0); /* a client that takes it all at once
+                                     resumes the program in relay_read */
+            continue;
+        }
+        used += sizeof(hdr) + hdr.len;
+        if (hdr.type == CGI_END)
+        {
+            p->slots[hdr.id].busy = 0;
+            p->slots[hdr.id].c = NULL;
+            p->inflight--;
+            if (c != NULL)
+            {
+                c->cgi = NULL; /* the end of the output for relay_read */
+                conn_event(c, 0);
+            }
+        }
     }
-    filesize = sbuf.st_size;
+    memmove(p->rbuf, p->rbuf + used, p->rlen - used);
+    p->rlen -= used;
+    return 0;
+}
 
-    /* Send response headers to client */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    printf("Response headers:\n");
-    printf("%s", buf);
-    if (Rio_writen(fd, buf, strlen(buf)) < 0)
-        return;
+/*
+ * cgi_stall - stop reading a program while the cgi_out of c is full, or
+ *     with c NULL go on reading it: putting EPOLLIN back reports the
+ *     socket again if it is ready (EPOLLOUT nearly always is), so the
+ *     messages left in rbuf are taken in the event that follows
+ */
+static void cgi_stall(cgi_proc_t *p, conn_t *c)
+{
+    struct epoll_event ev;
 
-    /* Send response body to client */
-    if (is_head)
+    p->stalled = c;
+    if (p->fd < 0)
         return;
-    srcfd = Open(filename, O_RDONLY, 0);
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
-    Munmap(srcp, filesize);
+    ev.events = (c ? 0 : EPOLLIN) | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = p;
+    epoll_ctl(p->pool->w->epfd, EPOLL_CTL_MOD, p->fd, &ev);
 }
 
 /*
- * get_filetype - derive file type from file name
+ * cgi_down - after a program exits or breaks the protocol: its requests
+ *     get a 502, or are cut short if their headers are out, and it is
+ *     started again on a later request
  */
-void get_filetype(char *filename, char *filetype)
+static void cgi_down(cgi_proc_t *p)
 {
-    if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-        strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".png"))
-        strcpy(filetype, "image/png");
-    else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
-    else if (strstr(filename, ".mp4"))
-        strcpy(filetype, "video/mp4");
-    else
-        strcpy(filetype, "text/plain");
+    conn_t **lost = Malloc((p->nslots + 1) * sizeof(conn_t *));
+    int i, n = 0;
+
+    if (verbose)
+        printf("CGI program %s, pid %d, is down\n", p->pool->path, (int)p->pid);
+    close(p->fd); /* also removes it from the epoll set */
+    p->fd = -1;
+    p->rlen = p->wlen = p->woff = 0;
+    p->stalled = NULL;
+    for (i = 0; i < p->nslots; i++)
+    {
+        if (p->slots[i].busy && p->slots[i].c != NULL)
+        {
+            lost[n++] = p->slots[i].c;
+            p->slots[i].c->cgi = NULL;
+        }
+        p->slots[i].busy = 0;
+        p->slots[i].c = NULL;
+    }
+    p->inflight = 0;
+
+    /* the connections may go on to requests for this pool */
+    for (i = 0; i < n; i++)
+    {
+        relay_end(lost[i], 0);
+        if (lost[i]->state != CONN_CGI)
+        {
+            conn_close(lost[i]); /* the client sees the response is short */
+            continue;
+        }
+        clienterror(lost[i], p->pool->path, "502", "Bad Gateway",
+                    "The CGI program exited before its response was done");
+        lost[i]->state = CONN_WRITE;
+        conn_event(lost[i], 0);
+    }
+    Free(lost);
 }
-/* $end serve_static */
 
 /*
- * serve_mp4 - serve a portion of mp4 file (max to 2G)
- *           - to let client stream it
- * P.S. mp4 can be streamed in Chrome,
- *      but cannot be downloaded.
+ * cgi_hdr_end - the bytes of buf[0, len) up to and including the blank
+ *     line after a CGI program's headers, or 0 if it has not come yet
  */
-/* $begin serve_mp4 */
-void serve_mp4(int fd, char *filename, char *range, int is_head)
+static size_t cgi_hdr_end(char *buf, size_t len)
 {
-    int srcfd, filesize;
-    int start, end, length;
-    int page_start;
-    int page = sysconf(_SC_PAGE_SIZE);
-    struct stat sbuf;
-    char *srcp, buf[MAXLINE];
+    char *p = buf, *end = buf + len, *eol;
 
-    /* check file stat */
-    if (stat(filename, &sbuf) < 0)
+    while ((eol = memchr(p, '\n', end - p)) != NULL)
     {
-        clienterror(fd, filename, "404", "Not found",
-                    "Tiny couldn't find this file");
-        return;
+        if (eol == p || (eol == p + 1 && *p == '\r'))
+            return eol + 1 - buf;
+        p = eol + 1;
+    }
+    return 0;
+}
+
+/*
+ * cgi_header - make the response headers from the headers a CGI program
+ *     wrote, buf[0, len): the status line from its Status (200 OK if it
+ *     gives none), its own headers but for Connection and the framing,
+ *     which are Tiny's. *length is the body bytes there are, or -1 if the
+ *     body is still to come; it becomes the bytes to send (the program's
+ *     Content-Length), or -1 if the body is not framed by a length.
+ *     Return how the body ends, or -1 if the headers do not fit in out
+ *     - an unknown length is chunked for HTTP/1.1, and ends with the
+ *       connection for HTTP/1.0
+ *     - a body shorter than the program's Content-Length closes the
+ *       connection after it, so the client sees it is cut short
+ */
+static int cgi_header(conn_t *c, char *buf, size_t len, long *length, int is_head)
+{
+    char *p, *eol, *end = buf + len, *v, *status = "200 OK", line[MAXLINE];
+    size_t n, status_len = 6;
+    long cl = -1;
+    int framing = RELAY_LENGTH;
+
+    /* the status first, the program may give it anywhere */
+    for (p = buf; (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1)
+    {
+        if ((n = eol - p) > 0 && p[n - 1] == '\r')
+            n--;
+        if ((v = memchr(p, ':', n)) == NULL)
+            continue;
+        for (v++; v < p + n && (*v == ' ' || *v == '\t'); v++)
+            ;
+        if (v - p > 6 && !strncasecmp(p, "Status:", 7))
+        {
+            status = v;
+            status_len = p + n - v;
+        }
+        else if (v - p > 14 && !strncasecmp(p, "Content-Length:", 15))
+            cl = strtol(v, NULL, 10);
     }
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
+    sprintf(line, "HTTP/1.1 %.*s\r\n", (int)MIN(status_len, 256), status);
+    conn_puts(c, line);
+    conn_puts(c, "Server: Tiny Web Server\r\n");
+    for (p = buf; (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1)
     {
-        clienterror(fd, filename, "403", "Forbidden",
-                    "Tiny couldn't read the file");
-        return;
+        if ((n = eol - p) > 0 && p[n - 1] == '\r')
+            n--;
+        if (n == 0 || (v = memchr(p, ':', n)) == NULL ||
+            (v - p == 6 && !strncasecmp(p, "Status", 6)) ||
+            (v - p == 10 && !strncasecmp(p, "Connection", 10)) ||
+            (v - p == 10 && !strncasecmp(p, "Keep-Alive", 10)) ||
+            (v - p == 14 && !strncasecmp(p, "Content-Length", 14)) ||
+            (v - p == 17 && !strncasecmp(p, "Transfer-Encoding", 17)))
+            continue;
+        conn_putn(c, p, n);
+        conn_puts(c, "\r\n");
     }
-    filesize = sbuf.st_size;
 
-    if (range[0] != '\0')
+    /* the framing */
+    if (cl >= 0)
     {
-        if (sscanf(range, "Range: bytes=%d-%d", &start, &end) != 2)
-            end = MIN(filesize - 1, start + page * 5 - 1);
-        else
-            end = MIN(filesize - 1, end);
-        page_start = start / page;
-        length = end + 1 - page_start * page;
+        if (!is_head && *length >= 0 && *length < cl)
+            c->keep_alive = 0;
+        if (*length < 0 || *length > cl)
+            *length = cl;
+        sprintf(line, "Content-length: %ld\r\n", cl);
+        conn_puts(c, line);
+    }
+    else if (is_head)
+        ; /* nothing follows, whatever the length */
+    else if (*length >= 0)
+    {
+        sprintf(line, "Content-length: %ld\r\n", *length);
+        conn_puts(c, line);
+    }
+    else if (c->req.minor >= 1)
+    {
+        framing = RELAY_CHUNKED;
+        conn_puts(c, "Transfer-Encoding: chunked\r\n");
     }
     else
     {
-        sprintf(buf, "HTTP/1.1 200 OK\r\n");
-        sprintf(buf, "%sAccept-Ranges: bytes\r\n", buf);
-        sprintf(buf, "%sContent-Type: video/mp4\r\n", buf);
-        sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-        printf("Response headers:\n");
-        printf("%s", buf);
-        Rio_writen(fd, buf, strlen(buf));
-        return;
+        framing = RELAY_EOF;
+        c->keep_alive = 0;
     }
-
-    /* Send response headers to client */
-    sprintf(buf, "HTTP/1.1 206 Partial Content\r\n");
-    sprintf(buf, "%sContent-Range: bytes %d-%d/%d\r\n",
-            buf, start, end, filesize);
-    sprintf(buf, "%sContent-Length: %d\r\n\r\n", buf, end + 1 - start);
-    printf("Response headers:\n");
-    printf("%s", buf);
-    if (Rio_writen(fd, buf, strlen(buf)) < 0)
-        return;
-
-    /* Send response body to client */
     if (is_head)
-        return;
-    srcfd = Open(filename, O_RDONLY, 0);
-    srcp = Mmap(0, length, PROT_READ, MAP_PRIVATE, srcfd, page_start * page);
-    Close(srcfd);
-    Rio_writen(fd, srcp + (start - page_start * page), end + 1 - start);
-    Munmap(srcp, length);
+        *length = 0;
+    sprintf(line, "Connection: %s\r\n\r\n", conn_header(c));
+    if (c->out_len + strlen(line) > sizeof(c->out))
+        return -1; /* conn_putn has cut them short */
+    conn_puts(c, line);
+    if (verbose)
+    {
+        printf("Response headers:\n");
+        printf("%.*s", (int)c->out_len, c->out);
+    }
+    return framing;
 }
-/* $end serve_mp4 */
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * relay_read - read what a forked program has written, as much as
+ *     CGI_BUF holds, once the client has taken all that came before (so a
+ *     program that writes faster than the client reads blocks on the full
+ *     pipe), or take what cgi_event has put in cgi_out for a pooled one
+ *     (which is stalled while cgi_out is full); return 1 with a piece of
+ *     the response to write, or 0 to wait for the program
+ *     - the first piece holds the headers, from cgi_header; a program
+ *       that exits before its headers are done gets a 502, and one whose
+ *       headers do not fit in out a 502 and the connection closed
+ *     - the response is over (relay.busy is 0) with its last piece
  */
-/* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs, int is_head)
+static int relay_read(conn_t *c)
 {
-    struct stat sbuf;
-    char buf[MAXLINE], *emptylist[] = {NULL};
+    cgi_pipe_t *r = &c->relay;
+    size_t start = 0;
+    ssize_t n;
+    long length;
+    int eof = r->fd < 0 && c->cgi == NULL, done = 0;
+    char prefix[32] = "";
 
-    /* check file stat */
-    if (stat(filename, &sbuf) < 0)
+    if (c->state == CONN_WRITE)
+    { /* the last piece is out, keep what came behind it */
+        c->cgi_len -= r->piece;
+        memmove(c->cgi_out, c->cgi_out + r->piece, c->cgi_len);
+        r->piece = 0;
+        c->out_len = c->out_off = 0;
+        c->body_len = c->body_off = 0;
+        if (c->cgi != NULL && c->cgi->stalled == c)
+            cgi_stall(c->cgi, NULL);
+    }
+    while (r->fd >= 0 && c->cgi_len < CGI_BUF)
     {
-        clienterror(fd, filename, "404", "Not found",
-                    "Tiny couldn't find this file");
-        return;
+        n = read(r->fd, c->cgi_out + c->cgi_len, CGI_BUF - c->cgi_len);
+        if (n > 0)
+            c->cgi_len += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+        {
+            eof = 1;
+            epoll_ctl(c->w->epfd, EPOLL_CTL_DEL, r->fd, NULL);
+            close(r->fd);
+            r->fd = -1;
+        }
     }
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode))
+
+    if (c->state == CONN_CGI)
     {
-        clienterror(fd, filename, "403", "Forbidden",
-                    "Tiny couldn't run the CGI program");
-        return;
+        if (!eof && c->cgi != NULL && c->cgi_len < CGI_BUF)
+            return 0; /* see cgi_take */
+        if ((start = cgi_hdr_end(c->cgi_out, c->cgi_len)) == 0)
+        {
+            if (!eof && c->cgi_len < CGI_BUF)
+                return 0;
+            relay_end(c, 1);
+            clienterror(c, "CGI program", "502", "Bad Gateway",
+                        "The CGI program's headers are missing or too long");
+            c->state = CONN_WRITE;
+            return 1;
+        }
+        length = eof ? (long)(c->cgi_len - start) : -1;
+        if ((r->framing = cgi_header(c, c->cgi_out, start, &length, r->is_head)) < 0)
+        {
+            relay_end(c, 1);
+            c->out_len = 0;
+            c->keep_alive = 0;
+            clienterror(c, "CGI program", "502", "Bad Gateway",
+                        "The CGI program's headers are too long");
+            c->state = CONN_WRITE;
+            return 1;
+        }
+        r->left = length;
+        c->state = CONN_WRITE;
     }
+    else if (c->cgi_len == 0 && !eof)
+        return 0;
+    conn_touch(c);
 
-    /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    printf("Response headers:\n");
-    printf("%s(...Left by cgi program)\n\n", buf);
-    if (Rio_writen(fd, buf, strlen(buf)) < 0)
-        return;
+    r->piece = c->cgi_len;
+    c->body = c->cgi_out + start;
+    c->body_len = r->is_head ? 0 : c->cgi_len - start;
+    if (r->is_head)
+        done = 1;
+    else if (r->framing == RELAY_LENGTH)
+    {
+        c->body_len = MIN(c->body_len, (size_t)r->left);
+        r->left -= c->body_len;
+        if (r->left == 0)
+            done = 1;
+        else if (eof)
+        {
+            c->keep_alive = 0; /* cut short, the client sees the close */
+            done = 1;
+        }
+    }
+    else if (r->framing == RELAY_CHUNKED)
+    {
+        /* the CRLF that ends a chunk goes out in front of the next one */
+        if (c->body_len > 0)
+            sprintf(prefix, "%s%zx\r\n", r->chunks++ ? "\r\n" : "", c->body_len);
+        else if (eof)
+        {
+            sprintf(prefix, "%s0\r\n\r\n", r->chunks ? "\r\n" : "");
+            done = 1;
+        }
+        conn_puts(c, prefix);
+    }
+    else
+        done = eof;
+    if (done)
+        relay_end(c, 0);
+    return 1;
+}
 
-    if (Fork() == 0)
-    { /* Child */
-        /* Real server would set all CGI vars here */
-        setenv("QUERY_STRING", cgiargs, 1);
-        if (is_head)
-            setenv("IS_HEAD", "HEAD", 1);
-        Dup2(fd, STDOUT_FILENO);              /* Redirect stdout to client */
-        Execve(filename, emptylist, environ); /* Run CGI program */
+/*
+ * relay_end - stop relaying a program's output: a forked program is
+ *     killed too if the response is not complete, a pooled one's answer
+ *     to the rest of the request is dropped
+ */
+static void relay_end(conn_t *c, int kill_it)
+{
+    cgi_pipe_t *r = &c->relay;
+
+    if (r->fd >= 0)
+    {
+        if (kill_it)
+            kill(r->pid, SIGKILL);
+        epoll_ctl(c->w->epfd, EPOLL_CTL_DEL, r->fd, NULL);
+        close(r->fd);
+        r->fd = -1;
     }
+    if (c->cgi != NULL)
+    {
+        c->cgi->slots[c->cgi_id].c = NULL;
+        if (c->cgi->stalled == c)
+            cgi_stall(c->cgi, NULL);
+        c->cgi = NULL;
+    }
+    r->busy = 0;
 }
-/* $end serve_dynamic */
 
 /*
  * clienterror - returns an error message to the client
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum,
+void clienterror(conn_t *c, char *cause, char *errnum,
                  char *shortmsg, char *longmsg)
 {
     char buf[MAXLINE], body[MAXBUF];
@@ -400,29 +2518,32 @@ void clienterror(int fd, char *cause, char *errnum,
                   ">\r\n",
             body);
     sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
+    sprintf(body, "%s<p>%s: %.512s\r\n", body, longmsg, cause);
     sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    sprintf(buf, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
+    sprintf(buf, "%sConnection: %s\r\n", buf, conn_header(c));
     sprintf(buf, "%sContent-type: text/html\r\n", buf);
     sprintf(buf, "%sContent-length: %d\r\n\r\n", buf, (int)strlen(body));
-    if (Rio_writen(fd, buf, strlen(buf)) < 0)
-        return;
-    Rio_writen(fd, body, strlen(body));
+    conn_puts(c, buf);
+    conn_puts(c, body);
 }
 /* $end clienterror */
 
 /*
- * sigchld_handler - reap child process
+ * sigchld_handler - reap the children that have exited, without
+ *     waiting for the ones still running
  */
 void sigchld_handler(int sig)
 {
     int olderrno = errno;
+    pid_t pid;
 
-    while (waitpid(-1, NULL, 0) > 0)
-        Sio_puts("sigchld_handler reaped child\n");
-    if (errno != ECHILD)
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        if (verbose)
+            Sio_puts("sigchld_handler reaped child\n");
+    if (pid < 0 && errno != ECHILD)
         Sio_error("waitpid error");
     errno = olderrno;
 }
@@ -432,5 +2553,27 @@ void sigchld_handler(int sig)
  */
 void sigpipe_handler(int sig)
 {
-    Sio_puts("Connection closed by foreign host.\n");
-}
\ No newline at end of file
+    if (verbose)
+        Sio_puts("Connection closed by foreign host.\n");
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-qp] [-t <idle secs>] [-m <max requests>] [-f <max files>] [-b <cache KB>] [-z <gzip KB>] [-w <cgi procs>] [-n <workers>] <port>\n", prog);
+    fprintf(stderr, "\t-q  Do not print requests and responses.\n");
+    fprintf(stderr, "\t-t  Close connections idle this long (default %d).\n",
+            IDLE_TIMEOUT);
+    fprintf(stderr, "\t-m  Close connections after this many requests (default %d).\n",
+            MAX_REQUESTS);
+    fprintf(stderr, "\t-f  Open files cached by each worker, 0 for none (default %d).\n",
+            MAX_FILES);
+    fprintf(stderr, "\t-b  KB of prebuilt responses cached by each worker (default %d).\n",
+            HOT_CACHE_KB);
+    fprintf(stderr, "\t-z  KB of gzip responses cached by each worker, 0 for none (default %d).\n",
+            GZIP_CACHE_KB);
+    fprintf(stderr, "\t-w  Pooled processes per CGI program per worker, 0 forks per request (default 0).\n");
+    fprintf(stderr, "\t-n  Worker threads (default one per online CPU).\n");
+    fprintf(stderr, "\t-p  Pin worker i to CPU i (modulo the CPUs).\n");
+    fprintf(stderr, "\tSIGUSR1 prints the counters of the workers.\n");
+    exit(1);
+}
@@ -0,0 +1,436 @@
+/*
+ * tinyload.c - a load generator for Tiny
+ *
+ *     unix> ./tinyload -c 1000 -d 10 localhost 8000 /home.html
+ *
+ *     Keeps conns connections busy for secs seconds, all from one epoll
+ *     loop. By default each one makes an HTTP/1.0 request, reads the whole
+ *     response and starts over on a new connection. With -k the requests
+ *     are HTTP/1.1 and a connection goes on with the next request as long
+ *     as the server keeps it open, and with -P depth it sends depth
+ *     requests at a time (pipelining) and reads their responses back to
+ *     back. It reports the requests per second and the latency
+ *     percentiles, where the latency of a request runs from the connect,
+ *     or the send of its batch on an open connection, to the last byte of
+ *     its response, and the bytes read per response, which shows what a
+ *     Content-Encoding asked for with -H saves.
+ *
+ *     A response ends at Content-Length, or at EOF if it has none. After a
+ *     response with "Connection: close" the connection starts over, and
+ *     the requests of its batch that got no response are not counted.
+ */
+#define _GNU_SOURCE
+#include "csapp.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define MAXEVENTS 256
+#define MAXHDRS 16 /* -H options */
+
+#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
+
+/* client states */
+#define CL_CONNECT 0 /* waiting for the connect to complete */
+#define CL_WRITE 1   /* sending the request */
+#define CL_READ 2    /* reading the response */
+
+/* One connection of the load */
+typedef struct
+{
+    int fd;
+    int state;
+    long start;       /* when the batch started (us) */
+    size_t sent;      /* batch bytes sent */
+    int pending;      /* responses of the batch still to come */
+    char hdr[MAXBUF]; /* headers of the current response read so far */
+    size_t hdr_len;
+    int hdr_done;     /* all headers seen */
+    int closing;      /* the server closes after this response */
+    long clen;        /* Content-Length, or -1 */
+    long body;        /* body bytes read */
+} client_t;
+
+static struct addrinfo *server;
+static char request[MAXBUF];
+static size_t request_len;
+static char *batch;       /* depth requests back to back */
+static size_t batch_len;
+static int depth = 1;     /* requests in flight on a connection */
+static int keep_alive;
+static int epfd;
+static long deadline;     /* us */
+static int stalled;       /* clients whose connect failed, to start again */
+
+/* results */
+static unsigned *lat;     /* latency of every request (us) */
+static long nlat, lat_cap;
+static long bytes_read;
+static long status[6];    /* responses by status class, 0 for unparsable */
+static long connect_errs, read_errs;
+static long opened;       /* connections */
+
+static long now_us(void);
+static void start(client_t *cl);
+static void client_event(client_t *cl);
+static int client_write(client_t *cl);
+static int client_read(client_t *cl);
+static int response_done(client_t *cl);
+static void finish(client_t *cl, int ok);
+static void parse_headers(client_t *cl);
+static int lat_cmp(const void *a, const void *b);
+static void report(int conns, double secs);
+static void usage(char *prog);
+
+int main(int argc, char **argv)
+{
+    int conns = 100, secs = 10, opt, i, n, nhdrs = 0;
+    char *hdrs[MAXHDRS];
+    struct addrinfo hints;
+    struct epoll_event events[MAXEVENTS];
+    struct rlimit rl;
+    client_t *clients;
+    long t0;
+
+    while ((opt = getopt(argc, argv, "c:d:H:kP:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            secs = atoi(optarg);
+            break;
+        case 'H':
+            if (nhdrs < MAXHDRS)
+                hdrs[nhdrs++] = optarg;
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'P':
+            depth = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 3 || conns <= 0 || secs <= 0 || depth <= 0)
+        usage(argv[0]);
+    if (depth > 1 && !keep_alive)
+    {
+        fprintf(stderr, "%s: -P needs -k\n", argv[0]);
+        exit(1);
+    }
+
+    /* the request, the same for every connection */
+    sprintf(request, "GET %s HTTP/1.%d\r\nHost: %s\r\n", argv[optind + 2],
+            keep_alive, argv[optind]);
+    for (i = 0; i < nhdrs; i++)
+        sprintf(request + strlen(request), "%s\r\n", hdrs[i]);
+    strcat(request, "\r\n");
+    request_len = strlen(request);
+    batch_len = depth * request_len;
+    batch = Malloc(batch_len);
+    for (i = 0; i < depth; i++)
+        memcpy(batch + i * request_len, request, request_len);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    Getaddrinfo(argv[optind], argv[optind + 1], &hints, &server);
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if ((epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+
+    clients = Calloc(conns, sizeof(client_t));
+    t0 = now_us();
+    deadline = t0 + secs * 1000000L;
+    for (i = 0; i < conns; i++)
+        start(&clients[i]);
+
+    while (now_us() < deadline)
+    {
+        n = epoll_wait(epfd, events, MAXEVENTS, 100);
+        if (n < 0 && errno != EINTR)
+            unix_error("epoll_wait error");
+        for (i = 0; i < n; i++)
+            client_event(events[i].data.ptr);
+        for (i = 0; stalled > 0 && i < conns; i++)
+        {
+            if (clients[i].fd < 0)
+            {
+                stalled--;
+                start(&clients[i]);
+            }
+        }
+    }
+    report(conns, (now_us() - t0) / 1e6);
+    exit(0);
+}
+
+/*
+ * now_us - monotonic time in microseconds
+ */
+static long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * start - open a new connection for the next request
+ */
+static void start(client_t *cl)
+{
+    struct epoll_event ev;
+
+    cl->start = now_us();
+    cl->sent = cl->hdr_len = 0;
+    cl->pending = depth;
+    cl->hdr_done = cl->closing = 0;
+    cl->clen = -1;
+    cl->body = 0;
+    cl->state = CL_CONNECT;
+    opened++;
+    if ((cl->fd = socket(server->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        unix_error("socket error");
+    if (connect(cl->fd, server->ai_addr, server->ai_addrlen) < 0 && errno != EINPROGRESS)
+    {
+        /* out of ports, say: try again after the next epoll_wait */
+        connect_errs++;
+        close(cl->fd);
+        cl->fd = -1;
+        stalled++;
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = cl;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, cl->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+/*
+ * client_event - advance a connection after an event
+ */
+static void client_event(client_t *cl)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    int rc;
+
+    if (cl->state == CL_CONNECT)
+    {
+        getsockopt(cl->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == EINPROGRESS)
+            return;
+        if (err != 0)
+        {
+            connect_errs++;
+            finish(cl, -1);
+            return;
+        }
+        cl->state = CL_WRITE;
+    }
+    /* a batch done on a kept connection goes back to CL_WRITE */
+    while (1)
+    {
+        if (cl->state == CL_WRITE && (rc = client_write(cl)) != 0)
+        {
+            finish(cl, rc);
+            return;
+        }
+        if (cl->state == CL_WRITE)
+            return;
+        if ((rc = client_read(cl)) != 0)
+        {
+            finish(cl, rc);
+            return;
+        }
+        if (cl->state == CL_READ)
+            return;
+    }
+}
+
+/*
+ * client_write - send the batch, return 0 to go on or -1 on error
+ */
+static int client_write(client_t *cl)
+{
+    ssize_t n;
+
+    while (cl->sent < batch_len)
+    {
+        if ((n = write(cl->fd, batch + cl->sent, batch_len - cl->sent)) < 0)
+            return errno == EAGAIN ? 0 : -1;
+        cl->sent += n;
+    }
+    cl->state = CL_READ;
+    return 0;
+}
+
+/*
+ * client_read - read the responses of the batch, which may come in one
+ *     read or split anywhere; return 0 to go on, 1 when the connection is
+ *     done, or -1 on error
+ */
+static int client_read(client_t *cl)
+{
+    char buf[RIO_BUFSIZE], *p, *end;
+    ssize_t n;
+    long take;
+
+    while (1)
+    {
+        if ((n = read(cl->fd, buf, sizeof(buf))) < 0)
+            return errno == EAGAIN ? 0 : -1;
+        if (n == 0)
+        {
+            if (!cl->hdr_done || cl->clen >= 0)
+                return -1; /* closed in the middle of a response */
+            response_done(cl);
+            return 1;
+        }
+        bytes_read += n;
+        for (p = buf, end = buf + n; p < end;)
+        {
+            if (!cl->hdr_done)
+            {
+                /* up to the blank line, a byte at a time */
+                if (cl->hdr_len == sizeof(cl->hdr) - 1)
+                    return -1;
+                cl->hdr[cl->hdr_len++] = *p++;
+                if (cl->hdr_len < 4 || memcmp(cl->hdr + cl->hdr_len - 4, "\r\n\r\n", 4))
+                    continue;
+                cl->hdr[cl->hdr_len] = '\0';
+                parse_headers(cl);
+            }
+            else
+            {
+                take = cl->clen < 0 ? end - p : MIN(end - p, cl->clen - cl->body);
+                cl->body += take;
+                p += take;
+            }
+            if (cl->clen >= 0 && cl->body >= cl->clen && response_done(cl))
+                return 1;
+            if (cl->state == CL_WRITE)
+                return 0;
+        }
+    }
+}
+
+/*
+ * response_done - record a complete response; return 1 if the connection
+ *     is done, else 0, with the client set for the next response or, at
+ *     the end of the batch, for the next batch
+ */
+static int response_done(client_t *cl)
+{
+    long now = now_us();
+
+    if (nlat == lat_cap)
+    {
+        lat_cap = lat_cap ? 2 * lat_cap : 1 << 16;
+        lat = Realloc(lat, lat_cap * sizeof(unsigned));
+    }
+    lat[nlat++] = now - cl->start;
+    if (cl->closing || !keep_alive)
+        return 1;
+    cl->hdr_len = cl->hdr_done = 0;
+    cl->clen = -1;
+    cl->body = 0;
+    if (--cl->pending == 0)
+    {
+        cl->start = now;
+        cl->sent = 0;
+        cl->pending = depth;
+        cl->state = CL_WRITE;
+    }
+    return 0;
+}
+
+/*
+ * parse_headers - the status and the framing of a response
+ */
+static void parse_headers(client_t *cl)
+{
+    int code = 0;
+    char *p;
+
+    cl->hdr_done = 1;
+    sscanf(cl->hdr, "HTTP/%*d.%*d %d", &code);
+    status[code >= 100 && code < 600 ? code / 100 : 0]++;
+    if ((p = strcasestr(cl->hdr, "\r\nContent-Length:")) != NULL)
+        cl->clen = atol(p + 17);
+    if ((p = strcasestr(cl->hdr, "\r\nConnection:")) != NULL)
+        cl->closing = !strncasecmp(p + 13 + strspn(p + 13, " "), "close", 5);
+    else
+        cl->closing = strncmp(cl->hdr, "HTTP/1.1", 8) != 0;
+}
+
+/*
+ * finish - close a connection that is done (ok 1) or failed (ok -1), and
+ *     start the next one
+ */
+static void finish(client_t *cl, int ok)
+{
+    if (ok < 0 && cl->state != CL_CONNECT)
+        read_errs++;
+    if (cl->fd >= 0)
+        close(cl->fd);
+    cl->fd = -1;
+    if (now_us() < deadline)
+        start(cl);
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * report - print the throughput and the latency percentiles
+ */
+static void report(int conns, double secs)
+{
+    qsort(lat, nlat, sizeof(unsigned), lat_cmp);
+    printf("%d connections, %.1f secs, %s", conns, secs,
+           keep_alive ? "keep-alive" : "close");
+    if (depth > 1)
+        printf(", pipeline depth %d", depth);
+    printf(", %ld connections opened\n", opened);
+    printf("%ld requests, %.1f requests/sec, %.2f MB/sec read\n",
+           nlat, nlat / secs, bytes_read / secs / 1e6);
+    if (nlat > 0)
+        printf("%.0f bytes/response on the wire, headers included\n",
+               (double)bytes_read / nlat);
+    if (nlat > 0)
+        printf("latency ms: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+               lat[nlat / 2] / 1e3, lat[nlat * 9 / 10] / 1e3,
+               lat[nlat * 99 / 100] / 1e3, lat[nlat - 1] / 1e3);
+    printf("status: 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld, other %ld\n",
+           status[2], status[3], status[4], status[5], status[0] + status[1]);
+    printf("errors: connect %ld, read %ld\n", connect_errs, read_errs);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-k] [-c <conns>] [-d <secs>] [-P <depth>] [-H <header>] <host> <port> <uri>\n", prog);
+    fprintf(stderr, "\t-c  Concurrent connections (default 100).\n");
+    fprintf(stderr, "\t-d  Duration in seconds (default 10).\n");
+    fprintf(stderr, "\t-k  Keep connections open (HTTP/1.1).\n");
+    fprintf(stderr, "\t-P  Requests pipelined on a connection, with -k (default 1).\n");
+    fprintf(stderr, "\t-H  Extra request header line, may be repeated.\n");
+    exit(1);
+}